@@ -9,20 +9,140 @@
 #define BLOCK_CACHE_HPP
 
 #include <types.hpp>
+#include <vector.hpp>
+
+/*!
+ * \brief The queue of the block cache a block belongs to
+ */
+enum class block_queue_type : uint8_t {
+    FREE, ///< The block holds no sector
+    A1IN, ///< The block has been accessed once
+    AM    ///< The block has been accessed several times
+};
+
+/*!
+ * \brief The alignment of the headers and of the payloads of the blocks
+ */
+constexpr const size_t BLOCK_ALIGNMENT = 16;
+
+/*!
+ * \brief Round the given size up to the block alignment
+ */
+constexpr size_t block_align(size_t size){
+    return (size + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1);
+}
 
 /*!
  * \brief A block in the block cache
+ *
+ * The payload follows the header, at the next aligned address.
  */
 struct block_t {
-    uint64_t key; ///< The key of the block
-    block_t* hash_next; ///< The next block in the hash map bucket
-    block_t* free_next; ///< The next block in the free list
-    block_t* free_prev; ///< The previous block in the free list
-    char payload; ///< The start of the payload
-} __attribute__((packed));
+    uint64_t key; ///< The hash of the device and sector of the block
+    uint64_t sector; ///< The sector of the block
+    uint64_t dirty_time; ///< The time (ms) at which the block became dirty
+    block_t* hash_next; ///< The next block in the hash table bucket
+    block_t* hash_prev; ///< The previous block in the hash table bucket
+    block_t* next; ///< The next (older) block in the queue
+    block_t* prev; ///< The previous (newer) block in the queue
+    uint16_t device; ///< The device of the block
+    block_queue_type queue; ///< The queue of the block, it returns to it once clean
+    bool dirty; ///< Indicates if the block must be written back
+    bool writeback; ///< Indicates if the block is being written back and has not been modified since
+
+    /*!
+     * \brief Returns the start of the payload of the block
+     */
+    char* payload(){
+        return reinterpret_cast<char*>(this) + block_align(sizeof(block_t));
+    }
+};
+
+/*!
+ * \brief The key of a block recently evicted from A1in
+ */
+struct ghost_t {
+    uint64_t key; ///< The hash of the device and sector of the evicted block
+    uint64_t sector; ///< The sector of the evicted block
+    uint16_t device; ///< The device of the evicted block
+    ghost_t* hash_next; ///< The next ghost in the hash table bucket
+    ghost_t* hash_prev; ///< The previous ghost in the hash table bucket
+    ghost_t* next; ///< The next (older) ghost in the queue
+    ghost_t* prev; ///< The previous (newer) ghost in the queue
+};
+
+/*!
+ * \brief A page of memory holding blocks, at the start of the page
+ */
+struct block_slab {
+    block_slab* next; ///< The next slab
+    block_slab* prev; ///< The previous slab
+    size_t physical;  ///< The physical address of the page
+};
+
+/*!
+ * \brief A doubly-linked queue, from the newest (head) to the oldest (tail)
+ */
+template<typename T>
+struct block_list {
+    T* head = nullptr;
+    T* tail = nullptr;
+    size_t size = 0;
+
+    void push_front(T* value){
+        value->prev = nullptr;
+        value->next = head;
+
+        if(head){
+            head->prev = value;
+        } else {
+            tail = value;
+        }
+
+        head = value;
+        ++size;
+    }
+
+    void remove(T* value){
+        if(value->prev){
+            value->prev->next = value->next;
+        } else {
+            head = value->next;
+        }
+
+        if(value->next){
+            value->next->prev = value->prev;
+        } else {
+            tail = value->prev;
+        }
+
+        value->next = nullptr;
+        value->prev = nullptr;
+        --size;
+    }
+};
 
 /*!
  * \brief A cache for I/O blocks
+ *
+ * The blocks are replaced with the 2Q policy. A block accessed for the
+ * first time enters the A1in FIFO queue. When it is evicted from A1in, its
+ * key is remembered in the A1out ghost queue. A block missed while its key
+ * is in A1out has been accessed twice recently and enters the Am LRU queue.
+ * Only the blocks of Am are promoted on hit, so a long sequential scan only
+ * cycles through A1in and does not evict the hot blocks of Am.
+ *
+ * Dirty blocks are never evicted, they must be written back and marked clean
+ * before their memory can be reused. They are moved out of A1in and Am to the
+ * dirty queue until then, so that the oldest block of a queue can always be
+ * evicted and the dirty blocks are found by age without scanning the cache.
+ *
+ * The blocks are allocated by pages directly from the physical allocator so
+ * that the cache can grow and give pages back at runtime.
+ *
+ * The blocks are indexed by a hash of their device and sector. The buckets
+ * are doubly-linked so that a block is unlinked in constant time and the
+ * table is doubled when the cache grows beyond one block per bucket.
  */
 struct block_cache {
     /*!
@@ -32,6 +152,38 @@ struct block_cache {
      */
     void init(uint64_t payload_size, uint64_t blocks);
 
+    /*!
+     * \brief Returns the number of blocks the cache can hold
+     */
+    size_t capacity() const;
+
+    /*!
+     * \brief Allocate pages until the cache holds at least the given number of blocks
+     * \return false if there is not enough free memory
+     */
+    bool grow(size_t blocks);
+
+    /*!
+     * \brief Remove the pages of clean blocks until the cache holds at most the given number of blocks
+     *
+     * The pages are only given back to the system by release(), so that the
+     * cache can be shrunk from inside the physical allocator.
+     *
+     * \return The number of pages removed
+     */
+    size_t shrink(size_t blocks);
+
+    /*!
+     * \brief Give the pages removed by shrink() back to the system
+     * \return The number of pages released
+     */
+    size_t release();
+
+    /*!
+     * \brief Returns the number of blocks held by each page
+     */
+    size_t blocks_per_page() const;
+
     /*!
      * \brief Returns the block at the given position if it exists
      * \return the block payload address if there is a block,nullptr otherwise
@@ -39,35 +191,105 @@ struct block_cache {
     char* block_if_present(uint16_t device, uint64_t sector);
 
     /*!
-     * \brief Returns the block at the given position if it exists
-     * \return the block payload address if there is a block,nullptr otherwise
+     * \brief Indicates if the given sector is cached, without counting an access
      */
-    char* block_if_present(uint64_t key);
+    bool contains(uint16_t device, uint64_t sector);
 
     /*!
-     * \brief Returns the block at the given position if it exists
+     * \brief Returns the block at the given position if it exists, without counting an access
+     * \return the block payload address if there is a block, nullptr otherwise
+     */
+    char* peek(uint16_t device, uint64_t sector);
+
+    /*!
+     * \brief Returns the block at the given position, allocating it if necessary
      * \param valid An output parameter indicating if the block is valid or new (false)
-     * \return the block payload address
+     * \return the block payload address, nullptr if all the blocks are dirty
      */
     char* block(uint16_t device, uint64_t sector, bool& valid);
 
     /*!
-     * \brief Returns the block at the given position if it exists
-     * \param valid An output parameter indicating if the block is valid or new (false)
-     * \return the block payload address
+     * \brief Mark the block with the given payload as dirty
+     * \param time The current time, in milliseconds
+     */
+    void mark_dirty(char* payload, uint64_t time);
+
+    /*!
+     * \brief Mark the given dirty block as being written back
+     *
+     * The block remains dirty, and therefore cannot be evicted, until the
+     * write completes.
+     */
+    void mark_writeback(block_t* block);
+
+    /*!
+     * \brief Complete the write back of the given block
+     *
+     * The block becomes clean if the write succeeded and the block has not
+     * been modified since it was copied. It remains dirty otherwise.
+     *
+     * \param success Indicates if the write succeeded
+     * \param time The current time, in milliseconds
+     */
+    void mark_written(block_t* block, bool success, uint64_t time);
+
+    /*!
+     * \brief Collect the dirty blocks that became dirty at or before the given time
      */
-    char* block(uint64_t key, bool& valid);
+    void dirty_blocks(std::vector<block_t*>& dirty, uint64_t before);
+
+    /*!
+     * \brief Returns the number of dirty blocks
+     */
+    size_t dirty_count() const;
+
+    size_t hits() const;      ///< The number of accesses to cached blocks
+    size_t misses() const;    ///< The number of blocks allocated on access
+    size_t evictions() const; ///< The number of blocks reused for another sector
 
 private:
+    block_t* find(uint16_t device, uint64_t sector);
+    void touch(block_t* block);
+    block_t* reclaim();
+    block_list<block_t>& queue_of(block_t* block);
+    void hash_insert(block_t* block);
+    void hash_remove(block_t* block);
+    void resize_table(size_t buckets);
+    block_t* slab_block(block_slab* slab, size_t i);
+    void retire_slab(block_slab* slab);
+    void init_ghosts(size_t ghosts);
+
+    ghost_t* find_ghost(uint16_t device, uint64_t sector);
+    void add_ghost(block_t* block);
+    void remove_ghost(ghost_t* ghost);
+
     uint64_t payload_size; ///< The size of each blocks
-    uint64_t blocks; ///< The number of blocks to cache
+    uint64_t block_size; ///< The size of each blocks, with its header, a multiple of BLOCK_ALIGNMENT
+    uint64_t slab_blocks; ///< The number of blocks per slab
+    uint64_t blocks = 0; ///< The number of blocks to cache
+    uint64_t buckets = 0; ///< The number of buckets of the hash table, a power of two
+
+    size_t a1in_max; ///< The target size of A1in
+    size_t a1out_max; ///< The number of ghosts of A1out
+
+    size_t _hits = 0;
+    size_t _misses = 0;
+    size_t _evictions = 0;
 
-    void* blocks_memory; ///< The memory holding the blocks
+    ghost_t* ghosts_memory = nullptr; ///< The memory holding the ghosts
 
-    block_t** hash_table; ///< Pointer to the hash table
+    block_t** hash_table = nullptr; ///< Pointer to the hash table
+    ghost_t** ghost_table = nullptr; ///< Pointer to the hash table of the ghosts
+    size_t ghost_buckets; ///< The number of buckets of the ghost table, a power of two
 
-    block_t* front; ///< The head of the free list
-    block_t* rear;  ///< The tail of the free list
+    block_list<block_slab> slabs; ///< The pages holding the blocks
+    block_list<block_slab> retired; ///< The pages removed from the cache, not yet released
+    block_list<block_t> free;  ///< The blocks holding no sector
+    block_list<block_t> a1in;  ///< The blocks accessed once (FIFO)
+    block_list<block_t> am;    ///< The blocks accessed several times (LRU)
+    block_list<block_t> dirty; ///< The dirty blocks, from the most recently dirtied to the oldest
+    block_list<ghost_t> a1out; ///< The keys recently evicted from A1in (FIFO)
+    block_list<ghost_t> free_ghosts; ///< The unused ghosts
 };
 
 #endif
@@ -0,0 +1,104 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef BLOCK_IO_HPP
+#define BLOCK_IO_HPP
+
+#include <types.hpp>
+
+#include "conc/semaphore.hpp"
+
+enum class block_operation : uint8_t {
+    READ,
+    WRITE,
+    CLEAR
+};
+
+struct block_io;
+
+/*!
+ * \brief The completion callback of an asynchronous block request
+ */
+using block_callback = void (*)(block_io& io);
+
+/*!
+ * \brief An asynchronous block request
+ *
+ * The request is started with block_queue::submit (or block_driver::submit)
+ * and completed once, either synchronously by the submitter or later by the
+ * block completion task when the device interrupts. The callback is called by
+ * the completing process, it can take locks, but it must not wait for block
+ * I/O nor submit requests. Without a callback, the submitter waits for the
+ * completion with wait().
+ */
+struct block_io {
+    block_operation operation; ///< The operation
+    uint64_t sector;           ///< The first sector
+    size_t count;              ///< The number of sectors
+    char* buffer;              ///< The data, nullptr for CLEAR
+
+    block_callback callback; ///< The completion callback, may be nullptr
+    void* data;              ///< Data for the callback
+
+    size_t result; ///< The result of the request, valid once completed
+
+    /*!
+     * \brief Prepare the request before submitting it
+     */
+    void init(block_operation operation, uint64_t sector, size_t count, char* buffer, block_callback callback = nullptr, void* data = nullptr);
+
+    /*!
+     * \brief Indicates if the request is completed
+     */
+    bool completed() const;
+
+    /*!
+     * \brief Wait for the completion of the request
+     * \return The result of the request
+     */
+    size_t wait();
+
+    /*!
+     * \brief Complete the request, from a process
+     */
+    void complete(size_t result);
+
+    /*!
+     * \brief Complete the request, from an IRQ handler
+     *
+     * The completion is deferred to the block completion task.
+     */
+    void complete_from_irq(size_t result);
+
+    /*!
+     * \brief Set the number of parts the request has been split into
+     */
+    void split(size_t parts);
+
+    /*!
+     * \brief Complete one part of a split request
+     * \return true if this was the last part and the request is now completed
+     */
+    bool complete_part(size_t result);
+
+    volatile bool done; ///< Indicates if the request is completed
+    semaphore waiter;   ///< Signaled on completion
+    size_t parts;       ///< The number of parts not yet completed
+    size_t error;       ///< The first error of the parts
+    block_io* next;     ///< The next request in the deferred completions
+};
+
+namespace block_completion {
+
+/*!
+ * \brief Start the block completion task
+ */
+void finalize();
+
+} // end of namespace block_completion
+
+#endif
@@ -0,0 +1,144 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef BLOCK_QUEUE_HPP
+#define BLOCK_QUEUE_HPP
+
+#include <types.hpp>
+#include <vector.hpp>
+#include <string.hpp>
+
+#include "conc/mutex.hpp"
+
+#include "block_io.hpp"
+#include "block_stats.hpp"
+
+/*!
+ * \brief The maximum number of sectors of a request issued by a queue (128KiB)
+ */
+constexpr const size_t MAX_REQUEST_SECTORS = 256;
+
+/*!
+ * \brief The sector interface of a block device driver
+ *
+ * The device is the descriptor of the disk inside the driver.
+ */
+struct block_driver {
+    /*!
+     * \brief Read sectors from the device
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read) = 0;
+
+    /*!
+     * \brief Write sectors to the device
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written) = 0;
+
+    /*!
+     * \brief Write zeroes to sectors of the device
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t clear_sectors(void* device, uint64_t start, size_t count, size_t& written) = 0;
+
+    /*!
+     * \brief Return the size of the device, in bytes
+     */
+    virtual size_t size(void* device) = 0;
+
+    /*!
+     * \brief Start a request without waiting for its completion
+     *
+     * The request is always completed, with an error result if it cannot be
+     * started. The driver completes it with io.complete() or, from its IRQ
+     * handler, with io.complete_from_irq(). By default, the request is done
+     * synchronously with the sector functions.
+     */
+    virtual void submit(void* device, block_io& io);
+};
+
+/*!
+ * \brief The policy used to order the requests of a queue
+ */
+enum class block_policy {
+    CLOOK,   ///< Serve in ascending sector order, then wrap around
+    DEADLINE ///< C-LOOK, but serve expired requests first
+};
+
+struct block_request;
+struct block_batch;
+
+/*!
+ * \brief A per-device queue of block requests.
+ *
+ * Adjacent requests for the same operation are merged and the batches are
+ * dispatched to the driver in the order of the policy. The first process to
+ * submit a request while no process is dispatching dispatches the requests
+ * until the queue is empty. The batches are submitted asynchronously, several
+ * of them can be in flight on the device.
+ *
+ * Overlapping requests are kept in arrival order unless both are reads: a
+ * batch is only dispatched once the earlier batches it overlaps are completed,
+ * and a request is never merged ahead of a later overlapping batch.
+ */
+struct block_queue {
+    /*!
+     * \brief Initialize the queue and register its sysfs values
+     * \param name The name of the device
+     * \param driver The driver of the device
+     * \param device The descriptor of the device inside the driver
+     */
+    void init(const std::string& name, block_driver* driver, void* device);
+
+    size_t read(uint64_t start, size_t count, void* destination, size_t& read);
+    size_t write(uint64_t start, size_t count, const void* source, size_t& written);
+    size_t clear(uint64_t start, size_t count, size_t& written);
+
+    /*!
+     * \brief Submit a request without waiting for its completion
+     *
+     * The request may be completed before the function returns.
+     */
+    void submit(block_io& io);
+
+    /*!
+     * \brief Return the size of the device, in bytes
+     */
+    size_t size();
+
+    block_policy policy() const;
+    void set_policy(block_policy policy);
+
+    block_stats stats; ///< The I/O counters of the device
+
+private:
+    size_t transfer(block_operation operation, uint64_t start, size_t count, char* buffer);
+    void enqueue(block_request& request);
+    block_batch* next_batch();
+    void dispatch(block_batch& batch);
+    void complete(block_batch& batch);
+
+    static void batch_done(block_io& command);
+
+    block_driver* driver = nullptr; ///< The driver of the device
+    void* device = nullptr;         ///< The descriptor of the device
+
+    mutex lock;                           ///< Protect the pending batches
+    std::vector<block_batch*> pending;    ///< The pending batches, in arrival order
+    std::vector<block_batch*> dispatched; ///< The batches in flight
+    uint64_t sequence = 0;                ///< The arrival number of the next batch
+    bool dispatching = false;             ///< Indicates if a process is dispatching
+    bool stalled = false;                 ///< Indicates if the dispatching process waits for a completion
+    semaphore progress;                   ///< Signaled when a batch completes while stalled
+    uint64_t busy_start = 0;              ///< The counter value when the device became busy
+
+    uint64_t head = 0; ///< The sector after the last dispatched batch
+    block_policy _policy = block_policy::DEADLINE;
+};
+
+#endif
@@ -0,0 +1,55 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef BLOCK_STATS_HPP
+#define BLOCK_STATS_HPP
+
+#include <types.hpp>
+#include <atomic.hpp>
+#include <string.hpp>
+
+/*!
+ * \brief The I/O counters of a disk or of a partition
+ *
+ * For a disk, the requests are counted when they reach the device, after the
+ * buffer cache. For a partition, they are counted when they are issued to the
+ * partition. The cache hits and misses are counted in sectors.
+ */
+struct block_stats {
+    std::atomic<uint64_t> reads{0};         ///< The number of read requests
+    std::atomic<uint64_t> writes{0};        ///< The number of write requests
+    std::atomic<uint64_t> read_sectors{0};  ///< The number of sectors read
+    std::atomic<uint64_t> write_sectors{0}; ///< The number of sectors written
+    std::atomic<uint64_t> merged{0};        ///< The number of requests merged into another one
+    std::atomic<uint64_t> hits{0};          ///< The number of sectors served by the cache
+    std::atomic<uint64_t> misses{0};        ///< The number of sectors read from the device
+    std::atomic<uint64_t> service{0};       ///< The time spent serving requests, in counter ticks
+    std::atomic<uint64_t> in_flight{0};     ///< The number of requests being served
+
+    /*!
+     * \brief Count a completed request, without its service time
+     * \param write Indicates if the request was a write
+     * \param sectors The number of sectors of the request
+     */
+    void count(bool write, size_t sectors);
+
+    /*!
+     * \brief Count a completed request
+     * \param write Indicates if the request was a write
+     * \param sectors The number of sectors of the request
+     * \param start The counter value at the start of the request
+     */
+    void account(bool write, size_t sectors, uint64_t start);
+
+    /*!
+     * \brief Publish the counters under /sys/block/<name>/
+     * \param merges Indicates if the merged counter is published
+     */
+    void publish(const std::string& name, bool merges);
+};
+
+#endif
@@ -0,0 +1,78 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef BUFFER_CACHE_HPP
+#define BUFFER_CACHE_HPP
+
+#include <types.hpp>
+
+#include "disks.hpp"
+
+/*!
+ * \brief The write-back cache of the sectors of the disks.
+ *
+ * Small writes only update the cache and mark the blocks dirty. The dirty
+ * blocks are written back, in sorted batches, by the flusher task once they
+ * are old enough, when the cache is full of dirty blocks or on sync. Large
+ * writes and clears are written through the disk directly.
+ */
+namespace buffer_cache {
+
+/*!
+ * \brief Initialize the cache and register its sysfs values
+ */
+void init();
+
+/*!
+ * \brief Start the flusher task
+ */
+void finalize();
+
+/*!
+ * \brief Read sectors through the cache
+ * \param partition The counters of the partition being read, if any
+ * \return 0 on success, an error code otherwise
+ */
+size_t read(disks::disk_descriptor& disk, uint64_t start, size_t count, void* destination, size_t& read, block_stats* partition = nullptr);
+
+/*!
+ * \brief Start reading the sectors missing from the cache, without waiting
+ */
+void prefetch(disks::disk_descriptor& disk, uint64_t start, size_t count);
+
+size_t write(disks::disk_descriptor& disk, uint64_t start, size_t count, const void* source, size_t& written);
+size_t clear(disks::disk_descriptor& disk, uint64_t start, size_t count, size_t& written);
+
+/*!
+ * \brief Read sectors from the disk directly into the destination
+ *
+ * The sectors are not inserted in the cache, but the cached copies are
+ * returned instead of the disk content.
+ *
+ * \return 0 on success, an error code otherwise
+ */
+size_t read_direct(disks::disk_descriptor& disk, uint64_t start, size_t count, void* destination, size_t& read);
+
+/*!
+ * \brief Write sectors directly to the disk
+ *
+ * The sectors are not inserted in the cache, but the cached copies are
+ * updated.
+ *
+ * \return 0 on success, an error code otherwise
+ */
+size_t write_direct(disks::disk_descriptor& disk, uint64_t start, size_t count, const void* source, size_t& written);
+
+/*!
+ * \brief Write back all the dirty blocks to the disks
+ * \return 0 on success, an error code otherwise
+ */
+size_t sync();
+
+} //end of namespace buffer_cache
+
+#endif
@@ -18,11 +18,15 @@
 #include "vfs/vfs.hpp"
 #include "vfs/file.hpp"
 
+#include "block_queue.hpp"
+
 namespace disks {
 
 enum class disk_type {
     ATA,
     ATAPI,
+    AHCI,
+    VIRTIO,
     RAM
 };
 
@@ -30,6 +34,7 @@ struct disk_descriptor {
     uint64_t uuid;
     disk_type type;
     void* descriptor;
+    block_queue* queue; ///< The request queue of the disk (nullptr for RAM disks)
 };
 
 struct partition_descriptor {
@@ -38,6 +43,7 @@ struct partition_descriptor {
     uint64_t start;
     uint64_t sectors;
     disk_descriptor* disk;
+    block_stats* stats; ///< The I/O counters of the partition
 };
 
 void detect_disks();
@@ -0,0 +1,49 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <types.hpp>
+#include <string.hpp>
+
+#include "block_queue.hpp"
+
+namespace ahci {
+
+struct port_state;
+
+struct drive_descriptor {
+    uint8_t port;        ///< The index of the port on the HBA
+    std::string model;
+    std::string serial;
+    std::string firmware;
+    size_t size;
+    bool ncq;            ///< Indicates if Native Command Queuing is used
+    uint8_t queue_depth; ///< The number of commands that can be in flight
+    port_state* state;   ///< The internal state of the port
+};
+
+void detect_disks();
+uint8_t number_of_disks();
+drive_descriptor& drive(uint8_t disk);
+
+size_t read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* destination, size_t& read);
+size_t write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written);
+size_t clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written);
+
+struct ahci_driver final : block_driver {
+    size_t read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read) override;
+    size_t write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written) override;
+    size_t clear_sectors(void* device, uint64_t start, size_t count, size_t& written) override;
+    size_t size(void* device) override;
+    void submit(void* device, block_io& io) override;
+};
+
+} // end of namespace ahci
+
+#endif
@@ -0,0 +1,80 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef AHCI_CONSTANTS_HPP
+#define AHCI_CONSTANTS_HPP
+
+#include <types.hpp>
+
+// Generic Host Control registers
+#define AHCI_CAP  0x00 // Host capabilities
+#define AHCI_GHC  0x04 // Global host control
+#define AHCI_IS   0x08 // Interrupt status
+#define AHCI_PI   0x0C // Ports implemented
+
+// Host capabilities bits
+#define AHCI_CAP_S64A (1U << 31) // 64-bit addressing
+#define AHCI_CAP_SNCQ (1U << 30) // Native Command Queuing
+
+// Global host control bits
+#define AHCI_GHC_AE (1U << 31) // AHCI enable
+#define AHCI_GHC_IE (1U << 1)  // Interrupt enable
+
+// Port registers
+#define AHCI_PORT_BASE   0x100
+#define AHCI_PORT_SIZE   0x80
+#define AHCI_PORT_CLB    0x00 // Command list base address
+#define AHCI_PORT_CLBU   0x04
+#define AHCI_PORT_FB     0x08 // FIS base address
+#define AHCI_PORT_FBU    0x0C
+#define AHCI_PORT_IS     0x10 // Interrupt status
+#define AHCI_PORT_IE     0x14 // Interrupt enable
+#define AHCI_PORT_CMD    0x18 // Command and status
+#define AHCI_PORT_TFD    0x20 // Task file data
+#define AHCI_PORT_SIG    0x24 // Signature
+#define AHCI_PORT_SSTS   0x28 // SATA status
+#define AHCI_PORT_SERR   0x30 // SATA error
+#define AHCI_PORT_SACT   0x34 // SATA active (NCQ tags)
+#define AHCI_PORT_CI     0x38 // Command issue
+
+// Port command bits
+#define AHCI_PORT_CMD_ST  (1U << 0)  // Start
+#define AHCI_PORT_CMD_FRE (1U << 4)  // FIS receive enable
+#define AHCI_PORT_CMD_FR  (1U << 14) // FIS receive running
+#define AHCI_PORT_CMD_CR  (1U << 15) // Command list running
+
+// Port interrupt bits
+#define AHCI_PORT_IS_DHRS (1U << 0)  // Device to Host Register FIS
+#define AHCI_PORT_IS_PSS  (1U << 1)  // PIO Setup FIS
+#define AHCI_PORT_IS_DSS  (1U << 2)  // DMA Setup FIS
+#define AHCI_PORT_IS_SDBS (1U << 3)  // Set Device Bits FIS (NCQ completion)
+#define AHCI_PORT_IS_TFES (1U << 30) // Task file error
+#define AHCI_PORT_IS_ERRORS 0x7DC00050
+
+// Task file data bits
+#define AHCI_TFD_ERR 0x01
+#define AHCI_TFD_DRQ 0x08
+#define AHCI_TFD_BSY 0x80
+
+// Signature of a SATA disk
+#define AHCI_SIG_ATA 0x00000101
+
+// FIS types
+#define AHCI_FIS_REG_H2D 0x27
+
+// Commands
+#define AHCI_IDENTIFY          0xEC
+#define AHCI_READ_DMA_EXT      0x25
+#define AHCI_WRITE_DMA_EXT     0x35
+#define AHCI_READ_FPDMA_QUEUED  0x60
+#define AHCI_WRITE_FPDMA_QUEUED 0x61
+
+// Limits of the hardware
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+#endif
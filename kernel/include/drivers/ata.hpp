@@ -11,7 +11,7 @@
 #include <types.hpp>
 #include <string.hpp>
 
-#include "fs/devfs.hpp"
+#include "block_queue.hpp"
 
 namespace ata {
 
@@ -25,28 +25,26 @@ struct drive_descriptor {
     std::string serial;
     std::string firmware;
     size_t size;
+    bool lba48;       ///< Indicates if the drive supports 48-bit addressing
+    uint16_t multiple; ///< The number of sectors per DRQ block (READ/WRITE MULTIPLE)
+    bool dma;         ///< Indicates if the transfers are done with bus master DMA
+    uint8_t dma_mode; ///< The DMA transfer mode set with SET FEATURES
 };
 
 void detect_disks();
 uint8_t number_of_disks();
 drive_descriptor& drive(uint8_t disk);
 
-size_t read_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, void* destination, size_t& read);
-size_t write_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, const void* source, size_t& written);
-size_t clear_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, size_t& written);
+size_t read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* destination, size_t& read);
+size_t write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written);
+size_t clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written);
 
-struct ata_driver final : devfs::dev_driver {
-    size_t read(void* data, char* buffer, size_t count, size_t offset, size_t& read) override;
-    size_t write(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override;
-    size_t clear(void* data, size_t count, size_t offset, size_t& written) override;
-    size_t size(void* data) override;
-};
-
-struct ata_part_driver final : devfs::dev_driver {
-    size_t read(void* data, char* buffer, size_t count, size_t offset, size_t& read) override;
-    size_t write(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override;
-    size_t clear(void* data, size_t count, size_t offset, size_t& written) override;
-    size_t size(void* data) override;
+struct ata_driver final : block_driver {
+    size_t read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read) override;
+    size_t write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written) override;
+    size_t clear_sectors(void* device, uint64_t start, size_t count, size_t& written) override;
+    size_t size(void* device) override;
+    void submit(void* device, block_io& io) override;
 };
 
 } // end of namespace ata
@@ -17,6 +17,7 @@
 // I/O Controllers ports
 #define ATA_DATA        0
 #define ATA_ERROR       1
+#define ATA_FEATURES    1 // The error register when read
 #define ATA_NSECTOR     2
 #define ATA_SECTOR      3
 #define ATA_LCYL        4
@@ -38,6 +39,45 @@
 #define ATAPI_IDENTIFY  0xA1
 #define ATA_READ_BLOCK  0x20
 #define ATA_WRITE_BLOCK 0x30
+#define ATA_READ_BLOCK_EXT  0x24
+#define ATA_WRITE_BLOCK_EXT 0x34
+#define ATA_READ_MULTIPLE      0xC4
+#define ATA_WRITE_MULTIPLE     0xC5
+#define ATA_READ_MULTIPLE_EXT  0x29
+#define ATA_WRITE_MULTIPLE_EXT 0x39
+#define ATA_SET_MULTIPLE 0xC6
+#define ATA_READ_DMA      0xC8
+#define ATA_WRITE_DMA     0xCA
+#define ATA_READ_DMA_EXT  0x25
+#define ATA_WRITE_DMA_EXT 0x35
+#define ATA_SET_FEATURES  0xEF
+
+// SET FEATURES subcommand selecting the transfer mode (in the sector count)
+#define ATA_FEATURE_TRANSFER_MODE 0x03
+#define ATA_MODE_MWDMA 0x20 // Multiword DMA mode N is ATA_MODE_MWDMA | N
+#define ATA_MODE_UDMA  0x40 // Ultra DMA mode N is ATA_MODE_UDMA | N
+
+// Limits of the number of sectors of one command
+#define ATA_MAX_SECTORS_LBA28 256
+#define ATA_MAX_SECTORS_LBA48 65536
+
+// Bus Master IDE registers (offsets from BAR4)
+#define BMIDE_COMMAND   0
+#define BMIDE_STATUS    2
+#define BMIDE_PRDT      4
+#define BMIDE_SECONDARY 8 // Offset of the secondary channel registers
+
+// Bus Master IDE command bits
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ  0x08 // Transfer from the device to memory
+
+// Bus Master IDE status bits
+#define BMIDE_STATUS_ACTIVE 0x01
+#define BMIDE_STATUS_ERR    0x02
+#define BMIDE_STATUS_IRQ    0x04
+
+// Last entry of a Physical Region Descriptor Table
+#define BMIDE_PRD_EOT 0x8000
 
 #define ATA_CTL_SRST    0x04
 #define ATA_CTL_nIEN    0x02
@@ -0,0 +1,45 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <types.hpp>
+
+#include "block_queue.hpp"
+
+namespace virtio_blk {
+
+struct queue_state;
+
+struct drive_descriptor {
+    uint16_t iobase;     ///< The base of the legacy virtio registers
+    size_t size;
+    uint16_t queue_size; ///< The number of descriptors of the virtqueue
+    uint8_t requests;    ///< The number of requests that can be in flight
+    queue_state* state;  ///< The internal state of the virtqueue
+};
+
+void detect_disks();
+uint8_t number_of_disks();
+drive_descriptor& drive(uint8_t disk);
+
+size_t read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* destination, size_t& read);
+size_t write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written);
+size_t clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written);
+
+struct virtio_blk_driver final : block_driver {
+    size_t read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read) override;
+    size_t write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written) override;
+    size_t clear_sectors(void* device, uint64_t start, size_t count, size_t& written) override;
+    size_t size(void* device) override;
+    void submit(void* device, block_io& io) override;
+};
+
+} // end of namespace virtio_blk
+
+#endif
@@ -0,0 +1,52 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef VIRTIO_CONSTANTS_HPP
+#define VIRTIO_CONSTANTS_HPP
+
+#include <types.hpp>
+
+// PCI identification
+#define VIRTIO_VENDOR_ID     0x1AF4
+#define VIRTIO_BLK_DEVICE_ID 0x1001 // Legacy (transitional) block device
+
+// Legacy I/O registers
+#define VIRTIO_DEVICE_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES  0x04
+#define VIRTIO_QUEUE_ADDRESS   0x08
+#define VIRTIO_QUEUE_SIZE      0x0C
+#define VIRTIO_QUEUE_SELECT    0x0E
+#define VIRTIO_QUEUE_NOTIFY    0x10
+#define VIRTIO_DEVICE_STATUS   0x12
+#define VIRTIO_ISR_STATUS      0x13
+#define VIRTIO_DEVICE_CONFIG   0x14 // Without MSI-X
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Block device configuration (offsets from the device config)
+#define VIRTIO_BLK_CAPACITY 0x00
+#define VIRTIO_BLK_SEG_MAX  0x0C
+
+// Block device features
+#define VIRTIO_BLK_F_SEG_MAX (1U << 2)
+
+// Virtqueue descriptor flags
+#define VIRTQ_DESC_F_NEXT  0x1
+#define VIRTQ_DESC_F_WRITE 0x2 // Written by the device
+
+// Block request types
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+
+// Block request status
+#define VIRTIO_BLK_S_OK 0
+
+#endif
@@ -0,0 +1,33 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef FILE_HANDLE_H
+#define FILE_HANDLE_H
+
+#include <types.hpp>
+#include <shared_ptr.hpp>
+
+#include "vfs/path.hpp"
+#include "vfs/open_file.hpp"
+
+namespace scheduler {
+
+/*!
+ * \brief A file handle (file descriptor) of a process
+ *
+ * The handles copied from another one share the same opened file.
+ */
+struct file_handle {
+    std::shared_ptr<vfs::open_file> file; ///< The opened file, empty once closed
+
+    file_handle(){}
+    file_handle(const path& file_path, size_t flags = 0) : file(std::make_shared<vfs::open_file>(file_path, flags)) {}
+};
+
+} //end of namespace scheduler
+
+#endif
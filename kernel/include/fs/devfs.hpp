@@ -12,6 +12,8 @@
 #include <string.hpp>
 #include <pair.hpp>
 
+#include <tlib/errors.hpp>
+
 #include "vfs/file_system.hpp"
 
 namespace devfs {
@@ -57,12 +59,49 @@ struct dev_driver {
      */
     virtual size_t clear(void* data, size_t count, size_t offset, size_t& written) = 0;
 
+    /*!
+     * \brief Read a block of data directly from the device, bypassing the cache
+     * \param data The driver data
+     * \param buffer The buffer into which to read
+     * \param count The amount of bytes to read
+     * \param offset The offset at which to start reading
+     * \param read output reference to indicate the number of bytes read
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t read_direct(void* data, char* buffer, size_t count, size_t offset, size_t& read){
+        return this->read(data, buffer, count, offset, read);
+    }
+
+    /*!
+     * \brief Write a block of data directly to the device, bypassing the cache
+     * \param data The driver data
+     * \param buffer The buffer from which to read
+     * \param count The amount of bytes to write
+     * \param offset The offset at which to start writing
+     * \param written output reference to indicate the number of bytes written
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t write_direct(void* data, const char* buffer, size_t count, size_t offset, size_t& written){
+        return write(data, buffer, count, offset, written);
+    }
+
     /*!
      * \brief Return the size of the device
      * \param data The driver data
      * \return The size of the device
      */
     virtual size_t size(void* data) = 0;
+
+    /*!
+     * \brief Start reading a block of data that will be read soon, without waiting
+     * \param data The driver data
+     * \param count The amount of bytes to prefetch
+     * \param offset The offset at which to start prefetching
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t prefetch(void* /*data*/, size_t /*count*/, size_t /*offset*/){
+        return std::ERROR_UNSUPPORTED;
+    }
 };
 
 /*!
@@ -125,6 +164,16 @@ struct devfs_file_system final : vfs::file_system {
      */
     size_t write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) override;
 
+    /*!
+     * \copydoc vfs::file_system::read_direct
+     */
+    size_t read_direct(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read) override;
+
+    /*!
+     * \copydoc vfs::file_system::write_direct
+     */
+    size_t write_direct(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) override;
+
     /*!
      * \copydoc vfs::file_system::clear
      */
@@ -168,6 +217,10 @@ void register_device(std::string_view mp, const std::string& name, device_type t
 void deregister_device(std::string_view mp, const std::string& name);
 
 uint64_t get_device_size(const path& device_name, size_t& size);
+uint64_t prefetch_device(const path& device_name, size_t count, size_t offset);
+uint64_t clear_device(const path& device_name, size_t count, size_t offset, size_t& written);
+uint64_t read_device_direct(const path& device_name, char* buffer, size_t count, size_t offset, size_t& read);
+uint64_t write_device_direct(const path& device_name, const char* buffer, size_t count, size_t offset, size_t& written);
 
 } //end of namespace devfs
 
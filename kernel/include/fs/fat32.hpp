@@ -9,6 +9,7 @@
 #define FAT32_H
 
 #include <vector.hpp>
+#include <array.hpp>
 #include <string.hpp>
 #include <pair.hpp>
 #include <function.hpp>
@@ -16,12 +17,65 @@
 #include <tlib/fat32_specs.hpp>
 
 #include "disks.hpp"
+#include "conc/mutex.hpp"
 #include "vfs/file_system.hpp"
+#include "vfs/dentry_cache.hpp"
 
 namespace fat32 {
 
 typedef const disks::disk_descriptor& dd;
 
+/*!
+ * \brief A run of clusters of a chain that are contiguous on disk
+ */
+struct cluster_extent {
+    uint32_t index;   ///< The index of the first cluster in the chain
+    uint32_t cluster; ///< The first cluster of the run
+    uint32_t length;  ///< The number of clusters of the run
+};
+
+/*!
+ * \brief The cluster chain of a file, as a sorted list of extents
+ *
+ * The chain is followed in the FAT only as far as it has been accessed.
+ */
+struct cluster_map {
+    uint32_t start = 0;    ///< The first cluster of the chain, 0 if the map is unused
+    size_t clusters = 0;   ///< The number of clusters mapped so far
+    bool complete = false; ///< Indicates if the end of the chain has been reached
+    size_t last_use = 0;   ///< The time of the last use of the map
+    std::vector<cluster_extent> extents;
+};
+
+/*!
+ * \brief An index of the entries of a directory, by name
+ *
+ * The removed entries keep their place with an empty name until the table is
+ * rebuilt.
+ */
+struct directory_index {
+    uint32_t cluster = 0;          ///< The first cluster of the directory, 0 if the index is unused
+    size_t last_use = 0;           ///< The time of the last use of the index
+    size_t removed = 0;            ///< The number of removed entries
+    std::vector<vfs::file> files;  ///< The entries of the directory
+    std::vector<uint32_t> buckets; ///< Open addressing table of the entries (index + 1), 0 if empty
+};
+
+/*!
+ * \brief A sector of the FAT modified in memory and not yet written to the disk
+ */
+struct fat_sector {
+    uint64_t sector = 0;  ///< The index of the sector in the FAT
+    uint32_t entries[128]; ///< The entries of the sector
+};
+
+/*!
+ * \brief A FAT32 file system
+ *
+ * All the operations are serialized by the lock of the file system. The
+ * cluster maps, the directory indexes and the modified FAT sectors are shared
+ * between the operations and remain in use while waiting for the disk.
+ */
 struct fat32_file_system final : vfs::file_system {
     fat32_file_system(path mount_point, path device);
     ~fat32_file_system();
@@ -48,6 +102,16 @@ struct fat32_file_system final : vfs::file_system {
      */
     size_t write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) override;
 
+    /*!
+     * \copydoc vfs::file_system::read_direct
+     */
+    size_t read_direct(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read) override;
+
+    /*!
+     * \copydoc vfs::file_system::write_direct
+     */
+    size_t write_direct(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) override;
+
     /*!
      * \copydoc vfs::file_system::clear
      */
@@ -58,6 +122,21 @@ struct fat32_file_system final : vfs::file_system {
      */
     size_t truncate(const path& file_path, size_t size) override;
 
+    /*!
+     * \copydoc vfs::file_system::cacheable
+     */
+    bool cacheable() const override;
+
+    /*!
+     * \copydoc vfs::file_system::sync
+     */
+    size_t sync() override;
+
+    /*!
+     * \copydoc vfs::file_system::fallocate
+     */
+    size_t fallocate(const path& file_path, size_t size) override;
+
     /*!
      * \copydoc vfs::file_system::get_file
      */
@@ -84,6 +163,11 @@ struct fat32_file_system final : vfs::file_system {
     size_t rm(const path& file_path) override;
 
 private:
+    size_t get_file_unlocked(const path& file_path, vfs::file& file);
+    size_t clear_unlocked(const path& file_path, size_t count, size_t offset, size_t& written);
+    size_t read_file(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read, bool direct);
+    size_t write_file(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written, bool direct);
+
     size_t rm_dir(uint32_t parent_cluster_number, size_t position, uint32_t cluster_number);
     size_t rm_file(uint32_t parent_cluster_number, size_t position, uint32_t cluster_number);
 
@@ -95,22 +179,61 @@ private:
     std::vector<vfs::file> files(const path& path, size_t last = 0);
     std::pair<bool, uint32_t> find_cluster_number(const path& path, size_t last = 0);
     std::vector<vfs::file> files(uint32_t cluster_number);
+    void decode_entry(const cluster_entry& entry, vfs::file& file);
+
+    directory_index& get_directory_index(uint32_t cluster);
+    directory_index* find_directory_index(uint32_t cluster);
+    bool find_entry(uint32_t directory, std::string_view name, vfs::file& file);
+    void index_entry(uint32_t directory, const vfs::file& file);
+    void unindex_entry(uint32_t directory, size_t position);
+    void reindex_entry(uint32_t directory, size_t position, const cluster_entry& entry);
+    void drop_directory_index(uint32_t cluster);
+    size_t entry_position(uint32_t directory, uint32_t cluster, const cluster_entry* entry, std::unique_heap_array<cluster_entry>& directory_cluster);
 
     bool write_is();
     uint64_t cluster_lba(uint64_t cluster);
     uint32_t read_fat_value(uint32_t cluster);
     bool write_fat_value(uint32_t cluster, uint32_t value);
+    fat_sector* find_fat_sector(uint64_t sector);
+    bool flush_fat();
     uint32_t next_cluster(uint32_t cluster);
     uint32_t find_free_cluster();
-
-    bool read_sectors(uint64_t start, uint8_t count, void* destination);
-    bool write_sectors(uint64_t start, uint8_t count, void* source);
+    uint32_t find_free_run(size_t wanted, uint32_t hint, size_t& length);
+    size_t reserve_clusters(uint32_t parent_cluster_number, const vfs::file& file, size_t size);
+    uint32_t chain_cluster(uint32_t start, size_t index);
+    cluster_map& get_cluster_map(uint32_t start);
+    void invalidate_cluster_maps(uint32_t cluster);
+    bool load_free_bitmap();
+    void set_cluster_free(uint32_t cluster, bool free);
+
+    bool read_sectors(uint64_t start, size_t count, void* destination);
+    void prefetch_sectors(uint64_t start, size_t count);
+    bool clear_sectors(uint64_t start, size_t count);
+    bool write_sectors(uint64_t start, size_t count, const void* source);
+    bool read_sectors_direct(uint64_t start, size_t count, void* destination);
+    bool write_sectors_direct(uint64_t start, size_t count, const void* source);
 
     path mount_point;
     path device;
 
+    mutex fs_lock; ///< Serialize the operations on the file system
+
     fat_bs_t* fat_bs = nullptr;
     fat_is_t* fat_is = nullptr;
+
+    std::unique_heap_array<uint64_t> free_bitmap; ///< One bit per cluster, set if the cluster is free
+    uint32_t clusters = 0; ///< The number of clusters in the bitmap, including the two reserved ones
+
+    std::vector<fat_sector> dirty_fat; ///< The FAT sectors modified and not yet written back, under fs_lock
+    bool is_dirty = false;            ///< Indicates if the FSInfo must be written back
+
+    std::array<directory_index, 8> directory_indexes; ///< The indexes of the recently accessed directories
+    size_t directory_indexes_clock = 0;
+
+    std::array<cluster_map, 8> cluster_maps; ///< The cluster maps of the recently accessed files
+    size_t cluster_maps_clock = 0;
+
+    vfs::dentry_cache dentries; ///< The cached directory entries
 };
 
 }
@@ -81,11 +81,27 @@ private:
 
 using dynamic_fun_t = std::string (*)();
 using dynamic_fun_data_t = std::string (*)(void*);
+using writable_fun_data_t = size_t (*)(void*, const std::string&);
 
 void set_constant_value(const path& mount_point, const path& file_path, const std::string& value);
 void set_dynamic_value(const path& mount_point, const path& file_path, dynamic_fun_t fun);
 void set_dynamic_value_data(const path& mount_point, const path& file_path, dynamic_fun_data_t fun, void* data);
 
+/*!
+ * \brief Set a value that can be written to by the user.
+ *
+ * Each write of the file calls the setter with the written value. The setter
+ * returns 0 on success and an error code otherwise.
+ */
+void set_writable_value_data(const path& mount_point, const path& file_path, dynamic_fun_data_t getter, writable_fun_data_t setter, void* data);
+
+/*!
+ * \brief Parse a value written by the user as a number.
+ *
+ * \return 0 on success, an error code if the value is empty or not a number
+ */
+size_t parse_value(const std::string& value, size_t& result);
+
 void delete_value(const path& mount_point, const path& file_path);
 void delete_folder(const path& mount_point, const path& file_path);
 
@@ -62,6 +62,7 @@ constexpr const uint8_t USER           = 0x4;  ///< Paging flag for user page
 constexpr const uint8_t WRITE_THROUGH  = 0x8;  ///< Paging flag for write-through page
 constexpr const uint8_t CACHE_DISABLED = 0x10; ///< Paging flag for cache disabled page
 constexpr const uint8_t ACCESSED       = 0x20; ///< Paging flag for assessed page
+constexpr const uint8_t DIRTY          = 0x40; ///< Paging flag for written page
 
 /*!
  * \brief Test if an address is aligned on a page boundary
@@ -174,9 +175,17 @@ void map_kernel_inside_user(scheduler::process_t& process);
  * \brief Map the given virtual page to the given physical page for the given process
  * \param virt The virtual page
  * \param physical The physical page
+ * \param flags The paging flags of the page
  * \return true if paging is possible, false otherwise
  */
-bool user_map(scheduler::process_t& process, size_t virt, size_t physical);
+bool user_map(scheduler::process_t& process, size_t virt, size_t physical, uint8_t flags = PRESENT | WRITE | USER);
+
+/*!
+ * \brief Unmap the given virtual page of the given process
+ * \param virt The virtual page
+ * \return The page entry before the unmapping, 0 if the page was not mapped
+ */
+size_t user_unmap(scheduler::process_t& process, size_t virt);
 
 /*!
  * \brief Map the given virtual pages to the given physical page for the given process
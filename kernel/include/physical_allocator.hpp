@@ -12,6 +12,18 @@
 
 namespace physical_allocator {
 
+/*!
+ * \brief A function releasing memory when physical memory runs low.
+ *
+ * It is called from inside the allocator, possibly in the middle of an update
+ * of the page tables or of the virtual allocator. It must not allocate memory,
+ * map or unmap pages, or block. It may defer the release of the memory.
+ *
+ * \param pages The number of pages to release
+ * \return The number of pages actually released
+ */
+using shrinker_t = size_t (*)(size_t pages);
+
 /*!
  * \brief Early initialization of the physical allocator.
  *
@@ -40,10 +52,18 @@ void finalize();
 /*!
  * \brief Allocate several pages of physical memory
  * \param pages The number of pages
- * \return The physical addres of the allocated pages
+ * \return The physical addres of the allocated pages, 0 if there is not enough memory
  */
 size_t allocate(size_t pages);
 
+/*!
+ * \brief Register a function to call when physical memory runs low
+ *
+ * The kalloc heap grows through the physical allocator, so the shrinkers are
+ * also called when kalloc runs out of memory.
+ */
+void register_shrinker(shrinker_t shrinker);
+
 /*!
  * \brief Free the allocated physical memory
  * \param address The address of the allocated physical memory
@@ -11,12 +11,15 @@
 #include <types.hpp>
 #include <vector.hpp>
 #include <deque.hpp>
+#include <shared_ptr.hpp>
 
 #include "paging.hpp"
 #include "interrupts.hpp"
 #include "conc/wait_list.hpp"
+#include "file_handle.hpp"
 
 #include "vfs/path.hpp"
+#include "vfs/open_file.hpp"
 
 namespace network {
 
@@ -55,6 +58,32 @@ struct segment_t {
     size_t size; ///< The size of allocated memory
 };
 
+/*!
+ * \brief A file mapped in the address space of a process
+ *
+ * The pages are read from the file on the first access and the modified
+ * pages are written back when the file is unmapped.
+ */
+struct mapping_t {
+    size_t virtual_start; ///< The virtual address of the first page
+    size_t size;          ///< The size of the mapping, in bytes
+    size_t offset;        ///< The offset of the first page in the file
+    size_t file_size;     ///< The size of the file when it was mapped
+    bool writable;        ///< Indicates if the process can modify the pages
+
+    std::shared_ptr<vfs::open_file> file; ///< The mapped file, shared with the file descriptor it was mapped from
+
+    std::vector<size_t> pages; ///< The physical address of each page, 0 if not read yet
+};
+
+/*!
+ * \brief A range of the memory mapped area released by munmap
+ */
+struct mmap_range_t {
+    size_t virtual_start; ///< The virtual address of the first page
+    size_t size;          ///< The size of the range, in bytes
+};
+
 struct process_t {
     pid_t pid;  ///< The process id
     pid_t ppid; ///< The parent's process id
@@ -76,6 +105,7 @@ struct process_t {
 
     size_t brk_start; ///< The start of the brk section
     size_t brk_end; ///< The end of the brk section
+    size_t mmap_end; ///< The end of the memory mapped files
 
     // Only for system kernels
     char* user_stack; ///< Pointer to the user stack
@@ -86,12 +116,15 @@ struct process_t {
     wait_node wait; ///< The process's wait node
 
     std::vector<segment_t> segments; ///< The physical segments
+    std::vector<mapping_t> mappings; ///< The memory mapped files
+    std::vector<mmap_range_t> mmap_free; ///< The released ranges below mmap_end
 
     std::string name; ///< The name of the process
 };
 
 constexpr const size_t program_base = 0x8000000000; ///< The virtual address of a program start
 constexpr const size_t program_break = 0x9000000000; ///< The virtual address of a program break start
+constexpr const size_t program_mmap = 0xA000000000; ///< The virtual address of the first memory mapped file
 
 constexpr const auto user_stack_size = 2 * paging::PAGE_SIZE; ///< The size of the user stack
 constexpr const auto kernel_stack_size = 2 * paging::PAGE_SIZE; ///< The size of the kernel stack
@@ -107,7 +140,7 @@ struct process_control_t {
     scheduler::process_state state; ///< The state of the process
     size_t rounds; ///< The number of rounds remaining
     size_t sleep_timeout; ///< The sleep timeout (in ticks)
-    std::vector<path> handles; ///< The file handles
+    std::vector<file_handle> handles; ///< The file handles
     std::deque<network::socket> sockets; ///< The socket handles
     path working_directory; ///< The current working directory
 };
@@ -87,6 +87,52 @@ void await_termination(pid_t pid);
  */
 void sbrk(size_t inc);
 
+/*!
+ * \brief Map a file in the memory of the current process
+ *
+ * The pages are read from the file on the first access.
+ *
+ * \param fd The file descriptor of the file
+ * \param offset The offset of the mapping in the file, aligned on a page
+ * \param size The size of the mapping
+ * \param prot The protection of the mapping (std::MMAP_WRITE)
+ * \return The virtual address of the mapping, or an error code
+ */
+std::expected<size_t> mmap(size_t fd, size_t offset, size_t size, size_t prot);
+
+/*!
+ * \brief Unmap a file from the memory of the current process
+ *
+ * The modified pages are written back to the file.
+ *
+ * \param address The virtual address of the mapping
+ */
+std::expected<void> munmap(size_t address);
+
+/*!
+ * \brief Unmap all the files from the memory of the current process
+ */
+void munmap_all();
+
+/*!
+ * \brief Try to resolve a page fault of the current process
+ * \param address The faulting address
+ * \param write Indicates if the access was a write
+ * \return true if the page is now mapped, false otherwise
+ */
+bool page_fault(size_t address, bool write);
+
+/*!
+ * \brief Read the missing pages of the mapped files in the given range
+ *
+ * The kernel must populate the buffers it gives to the file systems, the
+ * pages cannot be read from a file while the file system holds its locks.
+ *
+ * \param write Indicates if the range will be written
+ * \return An error if the range cannot be accessed or a page cannot be read
+ */
+std::expected<void> populate(size_t address, size_t size, bool write);
+
 /*!
  * \brief Let the scheduler know of a timer tick
  */
@@ -125,14 +171,20 @@ void sleep_ms(pid_t pid, size_t time);
 
 /*!
  * \brief Register a new handle (file descriptor) for the current process
+ * \param flags The flags the file is opened with
  */
-size_t register_new_handle(const path& p);
+size_t register_new_handle(const path& p, size_t flags = 0);
 
 /*!
  * \brief Get the path of the given file descriptor
  */
 const path& get_handle(size_t fd);
 
+/*!
+ * \brief Get the opened file of the given file descriptor
+ */
+vfs::open_file& get_open_file(size_t fd);
+
 /*!
  * \brief Indicates if the current process has the given file descriptor
  */
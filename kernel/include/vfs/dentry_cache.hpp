@@ -0,0 +1,85 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef VFS_DENTRY_CACHE_H
+#define VFS_DENTRY_CACHE_H
+
+#include <types.hpp>
+#include <vector.hpp>
+#include <string.hpp>
+#include <array.hpp>
+
+#include "conc/mutex.hpp"
+
+#include "file.hpp"
+#include "path.hpp"
+
+namespace vfs {
+
+/*!
+ * \brief The result of a lookup in the directory entry cache
+ */
+enum class dentry_state {
+    UNKNOWN,   ///< The path is not cached
+    EXISTS,    ///< The path exists
+    NOT_EXISTS ///< The path is known not to exist
+};
+
+/*!
+ * \brief A cache of the directory entries of a file system
+ *
+ * The entries are indexed by their path in the file system. A negative entry
+ * remembers that a path does not exist. The cache is direct-mapped, a new
+ * entry simply replaces the entry of its slot.
+ *
+ * The file system must invalidate the entries it modifies.
+ */
+struct dentry_cache {
+    dentry_cache();
+
+    /*!
+     * \brief Look for the given path in the cache
+     * \param file The entry to fill if the path exists
+     */
+    dentry_state lookup(const path& file_path, vfs::file& file);
+
+    /*!
+     * \brief Cache the entry of an existing path
+     */
+    void insert(const path& file_path, const vfs::file& file);
+
+    /*!
+     * \brief Cache the fact that the given path does not exist
+     */
+    void insert_negative(const path& file_path);
+
+    /*!
+     * \brief Cache all the entries of a directory
+     */
+    void insert_directory(const path& directory, const std::vector<vfs::file>& files);
+
+    /*!
+     * \brief Forget the entries of the given path and of all the paths under it
+     */
+    void invalidate(const path& file_path);
+
+private:
+    struct dentry {
+        std::string key; ///< The path of the entry, empty if unused
+        bool exists;     ///< Indicates if the path exists
+        vfs::file file;  ///< The entry, if the path exists
+    };
+
+    dentry& slot(std::string_view key);
+
+    mutex lock; ///< Protect the entries
+    std::unique_heap_array<dentry> entries;
+};
+
+} //end of namespace vfs
+
+#endif
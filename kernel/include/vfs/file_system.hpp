@@ -12,6 +12,7 @@
 #include <string.hpp>
 
 #include <tlib/statfs_info.hpp>
+#include <tlib/errors.hpp>
 
 #include "file.hpp"
 #include "path.hpp"
@@ -72,6 +73,38 @@ struct file_system {
      */
     virtual size_t write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) = 0;
 
+    /*!
+     * \brief Read a file directly from the device, bypassing the cache when possible
+     *
+     * By default, the file is read through the cache.
+     *
+     * \param file_path The path to the file to read
+     * \param buffer The buffer into which to read
+     * \param count The amount of bytes to read
+     * \param offset The offset at which to start reading
+     * \param read output reference to indicate the number of bytes read
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t read_direct(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read){
+        return this->read(file_path, buffer, count, offset, read);
+    }
+
+    /*!
+     * \brief Write to a file directly to the device, bypassing the cache when possible
+     *
+     * By default, the file is written through the cache.
+     *
+     * \param file_path The path to the file to write
+     * \param buffer The buffer from which to read
+     * \param count The amount of bytes to write
+     * \param offset The offset at which to start writing
+     * \param written output reference to indicate the number of bytes written
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t write_direct(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written){
+        return write(file_path, buffer, count, offset, written);
+    }
+
     /*!
      * \brief Clear a portion of a file (write zeroes)
      * \param file_path The path to the file to write
@@ -90,6 +123,33 @@ struct file_system {
      */
     virtual size_t truncate(const path& file_path, size_t size) = 0;
 
+    /*!
+     * \brief Reserve the space of a file on the disk, without changing its size
+     * \param file_path The path to the file to modify
+     * \param size The size to reserve
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t fallocate(const path& /*file_path*/, size_t /*size*/){
+        return std::ERROR_UNSUPPORTED;
+    }
+
+    /*!
+     * \brief Indicates if the content of the files can be kept in the page cache
+     *
+     * The content of the files must only change through the file system.
+     */
+    virtual bool cacheable() const {
+        return false;
+    }
+
+    /*!
+     * \brief Write back the metadata the file system keeps in memory
+     * \return 0 on success, an error code otherwise
+     */
+    virtual size_t sync(){
+        return 0;
+    }
+
     /*!
      * \brief Get informations about a file
      * \param file_path The path to the file
@@ -0,0 +1,43 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef VFS_OPEN_FILE_H
+#define VFS_OPEN_FILE_H
+
+#include <types.hpp>
+
+#include "vfs/path.hpp"
+
+namespace vfs {
+
+struct file_system;
+
+/*!
+ * \brief An opened file, shared by all the file descriptors referring to it
+ *
+ * The file system of the file and the path of the file inside it are resolved
+ * once, the operations on the file descriptor use them directly.
+ *
+ * The location and the size of the file are not kept here: the file systems
+ * are addressed by path and the size changes with the writes and truncates
+ * made through the other descriptors of the file. The file systems cache
+ * their own lookups instead (the directory index and the cluster maps of
+ * FAT32). There is no current offset either, every read and write system
+ * call gives its offset.
+ */
+struct open_file {
+    path file_path;                    ///< The absolute path of the file
+    size_t flags;                      ///< The flags the file was opened with
+    vfs::file_system* file_system;     ///< The file system of the file, nullptr until resolved
+    path fs_path;                      ///< The path of the file inside its file system
+
+    open_file(const path& file_path, size_t flags) : file_path(file_path), flags(flags), file_system(nullptr) {}
+};
+
+} //end of namespace vfs
+
+#endif
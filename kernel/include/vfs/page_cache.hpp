@@ -0,0 +1,69 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#ifndef VFS_PAGE_CACHE_H
+#define VFS_PAGE_CACHE_H
+
+#include <types.hpp>
+
+#include "file_system.hpp"
+#include "path.hpp"
+
+/*!
+ * \brief The cache of the pages of the files
+ *
+ * The pages are indexed by their file, identified by its file system and its
+ * path in the file system, and their index in the file. They are filled by
+ * the reads and reclaimed in LRU order, either when the cache is full or when
+ * the physical allocator runs low on memory.
+ *
+ * The cache is write-through: the writes go to the file system, which writes
+ * back its own dirty blocks, and the cached pages are updated afterwards. The
+ * VFS must report all the modifications of the cached files.
+ *
+ * The buffers given to the cache may be user memory. They are only accessed
+ * without the lock of the cache, since a fault on them may need to read a
+ * mapped file through the cache.
+ */
+namespace page_cache {
+
+/*!
+ * \brief Initialize the cache and register its sysfs values
+ */
+void init();
+
+/*!
+ * \brief Read from a file through the cache
+ * \return 0 on success, an error code otherwise
+ */
+size_t read(vfs::file_system& fs, const path& file_path, char* buffer, size_t count, size_t offset, size_t& read);
+
+/*!
+ * \brief Return the size of a file, if the cache knows it
+ * \return true if the size is known, false otherwise
+ */
+bool size(vfs::file_system& fs, const path& file_path, size_t& size);
+
+/*!
+ * \brief Update the cached pages after a write to a file
+ * \param buffer The data written, nullptr if the range was cleared
+ */
+void write(vfs::file_system& fs, const path& file_path, const char* buffer, size_t count, size_t offset);
+
+/*!
+ * \brief Update the cached pages after the truncation of a file
+ */
+void truncate(vfs::file_system& fs, const path& file_path, size_t size);
+
+/*!
+ * \brief Drop the cached pages of a file and of all the files under it
+ */
+void invalidate(vfs::file_system& fs, const path& file_path);
+
+} //end of namespace page_cache
+
+#endif
@@ -19,6 +19,8 @@ namespace vfs {
 
 using fd_t = size_t;
 
+struct open_file;
+
 /*!
  * \brief Enumeration for all supported partition types
  */
@@ -109,6 +111,30 @@ std::expected<size_t> read(fd_t fd, char* buffer, size_t count, size_t offset, s
  */
 std::expected<size_t> write(fd_t fd, const char* buffer, size_t count, size_t offset = 0);
 
+/*!
+ * \brief Read from an opened file, with the flags it was opened with
+ *
+ * This is used by the kernel to access a file independently of the file
+ * descriptors of the current process.
+ *
+ * \param file The opened file
+ * \param buffer The buffer to write to
+ * \param count The number of bytes to read
+ * \param offset The index where to start reading the file
+ * \return a status code
+ */
+std::expected<size_t> read(open_file& file, char* buffer, size_t count, size_t offset);
+
+/*!
+ * \brief Write to an opened file, with the flags it was opened with
+ * \param file The opened file
+ * \param buffer The buffer to read from
+ * \param count The number of bytes to write
+ * \param offset The index where to start writting the file
+ * \return a status code
+ */
+std::expected<size_t> write(open_file& file, const char* buffer, size_t count, size_t offset);
+
 /*!
  * \brief Clear parts of a file content
  * \param fd The file descriptor to the file
@@ -126,6 +152,14 @@ std::expected<size_t> clear(fd_t fd, size_t count, size_t offset = 0);
  */
 std::expected<void> truncate(fd_t fd, size_t size);
 
+/*!
+ * \brief Reserve the space of a file on the disk, without changing its size
+ * \param fd The file descriptor
+ * \param size The size to reserve
+ * \return a status code
+ */
+std::expected<void> fallocate(fd_t fd, size_t size);
+
 /*!
  * \brief List entries in the given directory
  * \param fd The file descriptor
@@ -164,6 +198,12 @@ std::expected<void> mount(partition_type type, fd_t mp_fd, fd_t dev_fd);
  */
 std::expected<void> mount(partition_type type, const char* mount_point, const char* device);
 
+/*!
+ * \brief Write back all the modified data to the disks
+ * \return a status code
+ */
+std::expected<void> sync();
+
 /*!
  * \brief Directly read a file into a std::string buffer
  *
@@ -6,153 +6,536 @@
 //=======================================================================
 
 #include "block_cache.hpp"
-#include "kalloc.hpp"
-#include "assert.hpp"
+#include "physical_allocator.hpp"
+#include "virtual_allocator.hpp"
+#include "paging.hpp"
+
+namespace {
+
+// The cache does not grow when less memory is free
+constexpr const size_t GROW_RESERVE = 16 * 1024 * 1024;
+
+// Mix the device and the sector into a 64-bit hash, with the finalizer of MurmurHash3
+uint64_t block_key(uint16_t device, uint64_t sector){
+    uint64_t h = sector ^ (uint64_t(device) * 0x9E3779B97F4A7C15ULL);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// The number of buckets for the given number of entries, at most one entry per two buckets
+size_t table_size(size_t entries){
+    size_t size = 16;
+
+    while(size < entries * 2){
+        size *= 2;
+    }
+
+    return size;
+}
+
+template<typename T>
+void bucket_insert(T** table, size_t buckets, T* entry){
+    auto& head = table[entry->key & (buckets - 1)];
+
+    entry->hash_prev = nullptr;
+    entry->hash_next = head;
+
+    if(head){
+        head->hash_prev = entry;
+    }
+
+    head = entry;
+}
+
+template<typename T>
+void bucket_remove(T** table, size_t buckets, T* entry){
+    if(entry->hash_prev){
+        entry->hash_prev->hash_next = entry->hash_next;
+    } else {
+        table[entry->key & (buckets - 1)] = entry->hash_next;
+    }
+
+    if(entry->hash_next){
+        entry->hash_next->hash_prev = entry->hash_prev;
+    }
+
+    entry->hash_next = nullptr;
+    entry->hash_prev = nullptr;
+}
+
+block_t* block_of(char* payload){
+    return reinterpret_cast<block_t*>(payload - block_align(sizeof(block_t)));
+}
+
+} //end of anonymous namespace
 
 void block_cache::init(uint64_t payload_size, uint64_t blocks){
     this->payload_size = payload_size;
-    this->blocks = blocks;
+    this->block_size = block_align(block_align(sizeof(block_t)) + payload_size);
+    this->slab_blocks = (paging::PAGE_SIZE - block_align(sizeof(block_slab))) / block_size;
+
+    // The hash table is sized for the initial number of blocks, it grows with the cache
+    resize_table(table_size(blocks));
+
+    grow(blocks);
+}
+
+size_t block_cache::capacity() const {
+    return blocks;
+}
+
+size_t block_cache::blocks_per_page() const {
+    return slab_blocks;
+}
+
+bool block_cache::grow(size_t target){
+    while(blocks < target){
+        // Leave enough memory to the rest of the system
+        if(physical_allocator::free() < GROW_RESERVE){
+            break;
+        }
 
-    auto block_size = payload_size + 4 * sizeof(uint64_t);
+        // Reuse the slabs removed from the cache and not yet released
+        auto* slab = retired.head;
 
-    // Allocate the necessary memory
-    this->hash_table = new block_t*[blocks * 2];
-    this->blocks_memory = kalloc::k_malloc(blocks * block_size);
+        if(slab){
+            retired.remove(slab);
+        } else {
+            auto physical = physical_allocator::allocate(1);
+            if(!physical){
+                break;
+            }
+
+            auto virt = virtual_allocator::allocate(1);
+            if(!virt || !paging::map_pages(virt, physical, 1)){
+                physical_allocator::free(physical, 1);
+                break;
+            }
+
+            slab = reinterpret_cast<block_slab*>(virt);
+            slab->physical = physical;
+        }
+
+        slabs.push_front(slab);
+
+        for(size_t i = 0; i < slab_blocks; ++i){
+            auto* block = slab_block(slab, i);
+
+            block->key = 0;                        // The key
+            block->queue = block_queue_type::FREE; // The block holds no sector
+            block->dirty = false;                  // The block is clean
+            block->writeback = false;              // The block is not being written
+            block->hash_next = nullptr;            // The hash pointers
+            block->hash_prev = nullptr;
+
+            free.push_front(block);
+        }
 
-    // The table is empty to start with
-    for(size_t i = 0; i < blocks * 2; ++i){
-        hash_table[i] = nullptr;
+        blocks += slab_blocks;
     }
 
-    front = reinterpret_cast<block_t*>(blocks_memory);
+    // Keep at most one block per bucket on average
+    if(blocks > buckets){
+        resize_table(table_size(blocks));
+    }
+
+    // A1in holds a quarter of the blocks, A1out remembers half of them
+    a1in_max = blocks / 4 ? blocks / 4 : 1;
+
+    if(!ghosts_memory || blocks / 2 > a1out_max){
+        init_ghosts(blocks / 2 ? blocks / 2 : 1);
+    }
 
-    block_t* previous = nullptr;
+    return blocks >= target;
+}
 
-    for(size_t i = 0; i < blocks; ++i){
-        auto block = reinterpret_cast<block_t*>(reinterpret_cast<size_t>(blocks_memory) + i * block_size);
+size_t block_cache::shrink(size_t target){
+    size_t retired_slabs = 0;
 
-        block->key = 0;             // The key
-        block->hash_next = nullptr; // The hash pointer
+    auto* slab = slabs.tail;
 
-        // The next block in the free list
-        if(i < blocks - 1){
-            block->free_next = reinterpret_cast<block_t*>(reinterpret_cast<size_t>(blocks_memory) + (i + 1) * block_size);
-        } else {
-            block->free_next = nullptr;
+    while(slab && blocks > target){
+        auto* prev = slab->prev;
+
+        // Only the slabs without dirty blocks can be released
+        bool clean = true;
+        for(size_t i = 0; i < slab_blocks; ++i){
+            if(slab_block(slab, i)->dirty){
+                clean = false;
+                break;
+            }
         }
 
-        // The previous block in the free list
-        block->free_prev = previous;
+        if(clean){
+            retire_slab(slab);
+            ++retired_slabs;
+        }
 
-        previous = block;
+        slab = prev;
     }
 
-    rear = previous;
+    a1in_max = blocks / 4 ? blocks / 4 : 1;
+
+    return retired_slabs;
 }
 
-char* block_cache::block_if_present(uint16_t device, uint64_t sector){
-    return block_if_present((uint64_t(device) << 16) + sector);
+size_t block_cache::release(){
+    size_t released = 0;
+
+    while(auto* slab = retired.head){
+        retired.remove(slab);
+
+        auto virt = reinterpret_cast<size_t>(slab);
+        auto physical = slab->physical;
+
+        paging::unmap_pages(virt, 1);
+        virtual_allocator::free(virt, 1);
+        physical_allocator::free(physical, 1);
+
+        ++released;
+    }
+
+    return released;
 }
 
-char* block_cache::block_if_present(uint64_t orig_key){
-    auto key = orig_key % (blocks * 2);
+block_t* block_cache::slab_block(block_slab* slab, size_t i){
+    return reinterpret_cast<block_t*>(reinterpret_cast<size_t>(slab) + block_align(sizeof(block_slab)) + i * block_size);
+}
 
-    if(hash_table[key]){
-        auto* entry = hash_table[key];
+void block_cache::retire_slab(block_slab* slab){
+    for(size_t i = 0; i < slab_blocks; ++i){
+        auto* block = slab_block(slab, i);
 
-        if(entry->key == orig_key){
-            return &entry->payload;
+        if(block->queue == block_queue_type::FREE){
+            free.remove(block);
         } else {
-            while(entry->hash_next){
-               entry = entry->hash_next;
+            queue_of(block).remove(block);
 
-               if(entry->key == orig_key){
-                    return &entry->payload;
-               }
-            }
+            hash_remove(block);
+
+            ++_evictions;
+        }
+    }
+
+    slabs.remove(slab);
+    retired.push_front(slab);
+
+    blocks -= slab_blocks;
+}
+
+void block_cache::resize_table(size_t new_buckets){
+    auto* new_table = new block_t*[new_buckets];
+
+    // Keep the current table if there is no memory for a bigger one
+    if(!new_table){
+        return;
+    }
+
+    for(size_t i = 0; i < new_buckets; ++i){
+        new_table[i] = nullptr;
+    }
+
+    // The keys are stored in the blocks, they are simply redistributed
+    for(size_t i = 0; i < buckets; ++i){
+        auto* entry = hash_table[i];
+
+        while(entry){
+            auto* next = entry->hash_next;
+            bucket_insert(new_table, new_buckets, entry);
+            entry = next;
+        }
+    }
+
+    delete[] hash_table;
+
+    hash_table = new_table;
+    buckets = new_buckets;
+}
+
+void block_cache::init_ghosts(size_t ghosts){
+    // The previous ghosts are simply forgotten
+    delete[] ghost_table;
+    delete[] ghosts_memory;
+
+    a1out = block_list<ghost_t>();
+    free_ghosts = block_list<ghost_t>();
+
+    a1out_max = ghosts;
+    ghost_buckets = table_size(a1out_max);
+
+    this->ghost_table = new ghost_t*[ghost_buckets];
+    this->ghosts_memory = new ghost_t[a1out_max];
+
+    for(size_t i = 0; i < ghost_buckets; ++i){
+        ghost_table[i] = nullptr;
+    }
+
+    for(size_t i = 0; i < a1out_max; ++i){
+        ghosts_memory[i].hash_next = nullptr;
+        ghosts_memory[i].hash_prev = nullptr;
+
+        free_ghosts.push_front(&ghosts_memory[i]);
+    }
+}
+
+block_t* block_cache::find(uint16_t device, uint64_t sector){
+    auto entry = hash_table[block_key(device, sector) & (buckets - 1)];
+
+    while(entry){
+        if(entry->device == device && entry->sector == sector){
+            return entry;
         }
+
+        entry = entry->hash_next;
     }
 
     return nullptr;
 }
 
-char* block_cache::block(uint16_t device, uint64_t sector, bool& valid){
-    return block((uint64_t(device) << 16) + sector, valid);
+void block_cache::touch(block_t* block){
+    ++_hits;
+
+    // Only the blocks of Am are promoted, A1in is a FIFO
+    if(block->queue == block_queue_type::AM && !block->dirty && am.head != block){
+        am.remove(block);
+        am.push_front(block);
+    }
+}
+
+char* block_cache::block_if_present(uint16_t device, uint64_t sector){
+    auto* entry = find(device, sector);
+
+    if(entry){
+        touch(entry);
+
+        return entry->payload();
+    }
+
+    return nullptr;
 }
 
-char* block_cache::block(uint64_t orig_key, bool& valid){
-    auto key = orig_key % (blocks * 2);
+bool block_cache::contains(uint16_t device, uint64_t sector){
+    return find(device, sector);
+}
+
+char* block_cache::peek(uint16_t device, uint64_t sector){
+    auto* entry = find(device, sector);
+
+    return entry ? entry->payload() : nullptr;
+}
 
+char* block_cache::block(uint16_t device, uint64_t sector, bool& valid){
     // First, try to get it directly from the hash table
 
-    auto direct = block_if_present(orig_key);
+    auto direct = find(device, sector);
 
     if(direct){
+        touch(direct);
+
         valid = true;
-        return direct;
+        return direct->payload();
     }
 
     // At this point, we will allocate a new block
     valid = false;
 
-    auto* block = front;
+    auto* block = reclaim();
 
-    // If the block was used, remove it from the hash table
-    if(block->key){
-        auto previous_key = block->key % (blocks * 2);
+    if(!block){
+        return nullptr;
+    }
 
-        if(hash_table[previous_key] == block){
-            // Use the next block in the bucket list as the first block in the chain
-            hash_table[previous_key] = block->hash_next;
-        } else {
-            auto* entry = block;
-            bool found = false;
+    ++_misses;
 
-            while(entry->hash_next){
-                auto next = entry->hash_next;
+    // Inserts the block in the hash table
 
-                if(entry->hash_next == block){
-                    entry->hash_next = block->hash_next;
-                    found = true;
-                    break;
-                }
+    block->key = block_key(device, sector);
+    block->device = device;
+    block->sector = sector;
 
-                entry = next;
-            }
+    hash_insert(block);
 
-            thor_assert(found, "The hash table chain did not contain the used block");
-        }
+    // A block evicted from A1in recently is hot, it goes to Am directly
+
+    auto* ghost = find_ghost(device, sector);
+
+    if(ghost){
+        remove_ghost(ghost);
+
+        block->queue = block_queue_type::AM;
+        am.push_front(block);
+    } else {
+        block->queue = block_queue_type::A1IN;
+        a1in.push_front(block);
     }
 
-    // Inserts the block in the hash table
+    return block->payload();
+}
+
+// Take a block out of its queue to hold a new sector
+block_t* block_cache::reclaim(){
+    if(free.tail){
+        auto* block = free.tail;
+        free.remove(block);
+        return block;
+    }
+
+    block_t* block = nullptr;
 
-    block->key = orig_key; // Sets the key
+    // Evict from A1in while it is larger than its target, from Am otherwise
+    if(a1in.size > a1in_max){
+        block = a1in.tail;
+    }
 
-    if(!hash_table[key]){
-        // Directly sets the head of the table
-        block->hash_next = nullptr;
-        hash_table[key] = block;
+    if(!block){
+        block = am.tail;
+    }
+
+    if(!block){
+        block = a1in.tail;
+    }
+
+    if(!block){
+        return nullptr;
+    }
+
+    if(block->queue == block_queue_type::A1IN){
+        a1in.remove(block);
+        add_ghost(block);
     } else {
-        // Insert at the end of the chain
+        am.remove(block);
+    }
+
+    hash_remove(block);
 
-        auto* entry = hash_table[key];
+    ++_evictions;
 
-        while(entry->hash_next){
-            entry = entry->hash_next;
+    return block;
+}
+
+// The queue currently holding the given cached block
+block_list<block_t>& block_cache::queue_of(block_t* block){
+    if(block->dirty){
+        return dirty;
+    }
+
+    return block->queue == block_queue_type::A1IN ? a1in : am;
+}
+
+void block_cache::hash_insert(block_t* block){
+    bucket_insert(hash_table, buckets, block);
+}
+
+void block_cache::hash_remove(block_t* block){
+    bucket_remove(hash_table, buckets, block);
+}
+
+ghost_t* block_cache::find_ghost(uint16_t device, uint64_t sector){
+    auto entry = ghost_table[block_key(device, sector) & (ghost_buckets - 1)];
+
+    while(entry){
+        if(entry->device == device && entry->sector == sector){
+            return entry;
         }
 
-        entry->hash_next = block;
-        block->hash_next = nullptr;
+        entry = entry->hash_next;
+    }
+
+    return nullptr;
+}
+
+void block_cache::add_ghost(block_t* block){
+    // Forget the oldest key when A1out is full
+    if(!free_ghosts.tail){
+        remove_ghost(a1out.tail);
+    }
+
+    auto* ghost = free_ghosts.tail;
+    free_ghosts.remove(ghost);
+
+    ghost->key = block->key;
+    ghost->device = block->device;
+    ghost->sector = block->sector;
+
+    bucket_insert(ghost_table, ghost_buckets, ghost);
+
+    a1out.push_front(ghost);
+}
+
+void block_cache::remove_ghost(ghost_t* ghost){
+    bucket_remove(ghost_table, ghost_buckets, ghost);
+
+    a1out.remove(ghost);
+    free_ghosts.push_front(ghost);
+}
+
+void block_cache::mark_dirty(char* payload, uint64_t time){
+    auto* block = block_of(payload);
+
+    // The copy being written back, if any, is now stale
+    block->writeback = false;
+
+    if(!block->dirty){
+        queue_of(block).remove(block);
+
+        block->dirty = true;
+        block->dirty_time = time;
+
+        dirty.push_front(block);
+    }
+}
+
+void block_cache::mark_writeback(block_t* block){
+    block->writeback = true;
+}
+
+void block_cache::mark_written(block_t* block, bool success, uint64_t time){
+    if(!block->writeback){
+        // The block has been modified during the write, it is written back again later
+        return;
     }
 
-    // Puts the block at the bottom of the free
+    block->writeback = false;
 
-    front = front->free_next;
-    front->free_prev = nullptr;
+    dirty.remove(block);
+
+    if(success){
+        block->dirty = false;
+
+        queue_of(block).push_front(block);
+    } else {
+        // Retry once the block expires again
+        block->dirty_time = time;
 
-    rear->free_next = block;
-    block->free_prev = rear;
-    rear = block;
+        dirty.push_front(block);
+    }
+}
+
+void block_cache::dirty_blocks(std::vector<block_t*>& dirty_blocks, uint64_t before){
+    // The dirty queue is ordered by dirty time, the oldest at the tail
+    for(auto* block = dirty.tail; block && block->dirty_time <= before; block = block->prev){
+        dirty_blocks.push_back(block);
+    }
+}
+
+size_t block_cache::dirty_count() const {
+    return dirty.size;
+}
+
+size_t block_cache::hits() const {
+    return _hits;
+}
+
+size_t block_cache::misses() const {
+    return _misses;
+}
 
-    return &block->payload;
+size_t block_cache::evictions() const {
+    return _evictions;
 }
@@ -0,0 +1,143 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include "block_io.hpp"
+#include "scheduler.hpp"
+
+#include "conc/int_lock.hpp"
+#include "conc/deferred_unique_semaphore.hpp"
+
+namespace {
+
+// The requests completed by IRQ handlers, in completion order
+block_io* completed_head = nullptr;
+block_io* completed_tail = nullptr;
+
+deferred_unique_semaphore completed_sem; ///< Count of the deferred completions
+
+void completion_task(){
+    completed_sem.claim();
+
+    while(true){
+        completed_sem.wait();
+
+        block_io* io;
+
+        {
+            direct_int_lock lock;
+
+            io = completed_head;
+
+            if(!io){
+                continue;
+            }
+
+            completed_head = io->next;
+
+            if(!completed_head){
+                completed_tail = nullptr;
+            }
+        }
+
+        io->next = nullptr;
+        io->complete(io->result);
+    }
+}
+
+} //end of anonymous namespace
+
+void block_io::init(block_operation operation, uint64_t sector, size_t count, char* buffer, block_callback callback, void* data){
+    this->operation = operation;
+    this->sector = sector;
+    this->count = count;
+    this->buffer = buffer;
+    this->callback = callback;
+    this->data = data;
+
+    result = 0;
+    done = false;
+    parts = 0;
+    error = 0;
+    next = nullptr;
+
+    waiter.init(0);
+}
+
+bool block_io::completed() const {
+    return done;
+}
+
+size_t block_io::wait(){
+    waiter.lock();
+
+    return result;
+}
+
+void block_io::complete(size_t result){
+    this->result = result;
+
+    // The request may not be used after the callback, it may release it
+    if(callback){
+        callback(*this);
+        return;
+    }
+
+    done = true;
+    waiter.unlock();
+}
+
+void block_io::complete_from_irq(size_t result){
+    this->result = result;
+
+    direct_int_lock lock;
+
+    next = nullptr;
+
+    if(completed_tail){
+        completed_tail->next = this;
+    } else {
+        completed_head = this;
+    }
+
+    completed_tail = this;
+
+    completed_sem.notify();
+}
+
+void block_io::split(size_t parts){
+    this->parts = parts;
+    this->error = 0;
+}
+
+bool block_io::complete_part(size_t result){
+    {
+        direct_int_lock lock;
+
+        if(result && !error){
+            error = result;
+        }
+
+        if(--parts){
+            return false;
+        }
+    }
+
+    complete(error);
+
+    return true;
+}
+
+void block_completion::finalize(){
+    auto* user_stack   = new char[scheduler::user_stack_size];
+    auto* kernel_stack = new char[scheduler::kernel_stack_size];
+
+    auto& completion_process    = scheduler::create_kernel_task("block_io", user_stack, kernel_stack, &completion_task);
+    completion_process.ppid     = 1;
+    completion_process.priority = scheduler::DEFAULT_PRIORITY;
+
+    scheduler::queue_system_process(completion_process.pid);
+}
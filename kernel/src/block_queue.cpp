@@ -0,0 +1,458 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <array.hpp>
+#include <algorithms.hpp>
+#include <lock_guard.hpp>
+
+#include <tlib/errors.hpp>
+
+#include "block_queue.hpp"
+
+#include "fs/sysfs.hpp"
+
+#include "timer.hpp"
+#include "logging.hpp"
+
+namespace {
+
+static constexpr const size_t BLOCK_SIZE = 512;
+
+// Expiration time of the requests with the deadline policy
+static constexpr const uint64_t READ_EXPIRE  = 500;  // ms
+static constexpr const uint64_t WRITE_EXPIRE = 5000; // ms
+
+std::string policy_name(block_policy policy){
+    switch(policy){
+        case block_policy::CLOOK:
+            return "clook";
+        case block_policy::DEADLINE:
+            return "deadline";
+    }
+
+    return "unknown";
+}
+
+std::string sysfs_policy(void* data){
+    auto* queue = reinterpret_cast<block_queue*>(data);
+
+    return policy_name(queue->policy());
+}
+
+size_t sysfs_set_policy(void* data, const std::string& value){
+    auto* queue = reinterpret_cast<block_queue*>(data);
+
+    if(value == "clook"){
+        queue->set_policy(block_policy::CLOOK);
+    } else if(value == "deadline"){
+        queue->set_policy(block_policy::DEADLINE);
+    } else {
+        return std::ERROR_INVALID_REQUEST;
+    }
+
+    return 0;
+}
+
+} //end of anonymous namespace
+
+/*!
+ * \brief A part of a submitted request, at most one batch long
+ */
+struct block_request {
+    block_operation operation;
+    uint64_t sector;
+    size_t count;
+    char* buffer;
+    block_io* io; ///< The submitted request
+};
+
+/*!
+ * \brief A set of contiguous requests for the same operation
+ */
+struct block_batch {
+    block_queue* queue;
+    block_operation operation;
+    uint64_t sector;
+    size_t count;
+    uint64_t deadline; ///< The earliest deadline of the requests
+    uint64_t sequence; ///< The arrival number of the batch
+
+    std::vector<block_request*> requests; ///< The requests, in sector order
+    std::unique_heap_array<char> buffer;  ///< The data of the merged requests
+
+    block_io command; ///< The request submitted to the driver
+
+    /*!
+     * \brief Indicates if the batch and the given sectors must stay in order:
+     * they overlap and one of them modifies the sectors
+     */
+    bool conflicts(block_operation operation, uint64_t sector, size_t count) const {
+        if(this->operation == block_operation::READ && operation == block_operation::READ){
+            return false;
+        }
+
+        return sector < this->sector + this->count && this->sector < sector + count;
+    }
+};
+
+void block_driver::submit(void* device, block_io& io){
+    size_t transferred = 0;
+    size_t result;
+
+    if(io.operation == block_operation::READ){
+        result = read_sectors(device, io.sector, io.count, io.buffer, transferred);
+    } else if(io.operation == block_operation::WRITE){
+        result = write_sectors(device, io.sector, io.count, io.buffer, transferred);
+    } else {
+        result = clear_sectors(device, io.sector, io.count, transferred);
+    }
+
+    io.complete(result);
+}
+
+void block_queue::init(const std::string& name, block_driver* driver, void* device){
+    this->driver = driver;
+    this->device = device;
+
+    lock.init();
+    progress.init(0);
+
+    sysfs::set_writable_value_data(sysfs::get_sys_path(), path("/block") / name / "scheduler", &sysfs_policy, &sysfs_set_policy, this);
+
+    stats.publish(name, true);
+}
+
+size_t block_queue::read(uint64_t start, size_t count, void* destination, size_t& read){
+    auto result = transfer(block_operation::READ, start, count, reinterpret_cast<char*>(destination));
+
+    if(!result){
+        read += count * BLOCK_SIZE;
+    }
+
+    return result;
+}
+
+size_t block_queue::write(uint64_t start, size_t count, const void* source, size_t& written){
+    auto result = transfer(block_operation::WRITE, start, count, reinterpret_cast<char*>(const_cast<void*>(source)));
+
+    if(!result){
+        written += count * BLOCK_SIZE;
+    }
+
+    return result;
+}
+
+size_t block_queue::clear(uint64_t start, size_t count, size_t& written){
+    auto result = transfer(block_operation::CLEAR, start, count, nullptr);
+
+    if(!result){
+        written += count * BLOCK_SIZE;
+    }
+
+    return result;
+}
+
+size_t block_queue::transfer(block_operation operation, uint64_t start, size_t count, char* buffer){
+    block_io io;
+    io.init(operation, start, count, buffer);
+
+    submit(io);
+
+    return io.wait();
+}
+
+size_t block_queue::size(){
+    return driver->size(device);
+}
+
+block_policy block_queue::policy() const {
+    return _policy;
+}
+
+void block_queue::set_policy(block_policy policy){
+    _policy = policy;
+}
+
+void block_queue::submit(block_io& io){
+    if(!io.count){
+        io.complete(0);
+        return;
+    }
+
+    ++stats.in_flight;
+
+    // Large requests are split in parts that fit in a batch
+    auto parts = (io.count + MAX_REQUEST_SECTORS - 1) / MAX_REQUEST_SECTORS;
+
+    io.split(parts);
+
+    lock.lock();
+
+    for(size_t i = 0; i < parts; ++i){
+        auto offset = i * MAX_REQUEST_SECTORS;
+
+        auto* request = new block_request;
+        request->operation = io.operation;
+        request->sector = io.sector + offset;
+        request->count = std::min(io.count - offset, MAX_REQUEST_SECTORS);
+        request->buffer = io.buffer ? io.buffer + offset * BLOCK_SIZE : nullptr;
+        request->io = &io;
+
+        enqueue(*request);
+    }
+
+    // Another process is dispatching, it will dispatch these requests too
+    if(dispatching){
+        lock.unlock();
+        return;
+    }
+
+    dispatching = true;
+
+    // Dispatch all the batches, including the ones of this request
+    while(!pending.empty()){
+        auto* batch = next_batch();
+
+        // The pending batches wait for overlapping batches in flight
+        if(!batch){
+            stalled = true;
+
+            lock.unlock();
+            progress.lock();
+            lock.lock();
+
+            continue;
+        }
+
+        if(dispatched.empty()){
+            busy_start = timer::counter();
+        }
+
+        dispatched.push_back(batch);
+
+        lock.unlock();
+
+        // The driver may block until it can accept another request
+        dispatch(*batch);
+
+        lock.lock();
+    }
+
+    dispatching = false;
+
+    lock.unlock();
+}
+
+// Must be called with the lock held
+void block_queue::enqueue(block_request& request){
+    auto expire = request.operation == block_operation::READ ? READ_EXPIRE : WRITE_EXPIRE;
+    auto deadline = timer::milliseconds() + expire;
+
+    // Merging into a batch must not move the request ahead of a later batch it overlaps
+    auto mergeable = [&](block_batch& batch){
+        for(auto* other : pending){
+            if(other->sequence > batch.sequence && other->conflicts(request.operation, request.sector, request.count)){
+                return false;
+            }
+        }
+
+        for(auto* other : dispatched){
+            if(other->sequence > batch.sequence && other->conflicts(request.operation, request.sector, request.count)){
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    // Try to merge the request at the front or the back of a pending batch
+    for(auto* batch : pending){
+        if(batch->operation != request.operation || batch->count + request.count > MAX_REQUEST_SECTORS){
+            continue;
+        }
+
+        if(batch->sector + batch->count != request.sector && request.sector + request.count != batch->sector){
+            continue;
+        }
+
+        if(!mergeable(*batch)){
+            continue;
+        }
+
+        if(batch->sector + batch->count == request.sector){
+            ++stats.merged;
+
+            batch->requests.push_back(&request);
+            batch->count += request.count;
+            batch->deadline = std::min(batch->deadline, deadline);
+
+            return;
+        }
+
+        if(request.sector + request.count == batch->sector){
+            ++stats.merged;
+
+            batch->requests.push_front(&request);
+            batch->sector = request.sector;
+            batch->count += request.count;
+            batch->deadline = std::min(batch->deadline, deadline);
+
+            return;
+        }
+    }
+
+    auto* batch = new block_batch;
+
+    batch->queue = this;
+    batch->operation = request.operation;
+    batch->sector = request.sector;
+    batch->count = request.count;
+    batch->deadline = deadline;
+    batch->sequence = sequence++;
+    batch->requests.push_back(&request);
+
+    pending.push_back(batch);
+}
+
+// Returns nullptr if all the pending batches wait for an earlier batch
+// Must be called with the lock held
+block_batch* block_queue::next_batch(){
+    // A batch can only be dispatched once the earlier batches it overlaps are completed
+    auto ready = [&](size_t i){
+        auto& batch = *pending[i];
+
+        for(auto* other : dispatched){
+            if(other->conflicts(batch.operation, batch.sector, batch.count)){
+                return false;
+            }
+        }
+
+        for(auto* other : pending){
+            if(other->sequence < batch.sequence && other->conflicts(batch.operation, batch.sector, batch.count)){
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    size_t selected = pending.size();
+
+    if(_policy == block_policy::DEADLINE){
+        auto now = timer::milliseconds();
+
+        // Serve the most urgent expired batch first
+        for(size_t i = 0; i < pending.size(); ++i){
+            if(pending[i]->deadline <= now && ready(i) && (selected == pending.size() || pending[i]->deadline < pending[selected]->deadline)){
+                selected = i;
+            }
+        }
+    }
+
+    if(selected == pending.size()){
+        // C-LOOK: the closest batch after the head, or the lowest one
+        size_t lowest = pending.size();
+
+        for(size_t i = 0; i < pending.size(); ++i){
+            if(!ready(i)){
+                continue;
+            }
+
+            if(lowest == pending.size() || pending[i]->sector < pending[lowest]->sector){
+                lowest = i;
+            }
+
+            if(pending[i]->sector >= head && (selected == pending.size() || pending[i]->sector < pending[selected]->sector)){
+                selected = i;
+            }
+        }
+
+        if(selected == pending.size()){
+            selected = lowest;
+        }
+    }
+
+    if(selected == pending.size()){
+        return nullptr;
+    }
+
+    auto* batch = pending[selected];
+    pending.erase(pending.begin() + selected);
+
+    head = batch->sector + batch->count;
+
+    return batch;
+}
+
+void block_queue::dispatch(block_batch& batch){
+    char* buffer = nullptr;
+
+    if(batch.operation != block_operation::CLEAR){
+        if(batch.requests.size() == 1){
+            buffer = batch.requests.front()->buffer;
+        } else {
+            // The merged requests are transferred with a single command
+            batch.buffer = std::unique_heap_array<char>(batch.count * BLOCK_SIZE);
+            buffer = batch.buffer.get();
+
+            if(batch.operation == block_operation::WRITE){
+                for(auto* request : batch.requests){
+                    std::copy_n(request->buffer, request->count * BLOCK_SIZE, buffer + (request->sector - batch.sector) * BLOCK_SIZE);
+                }
+            }
+        }
+    }
+
+    batch.command.init(batch.operation, batch.sector, batch.count, buffer, &batch_done, &batch);
+
+    driver->submit(device, batch.command);
+}
+
+void block_queue::batch_done(block_io& command){
+    auto* batch = reinterpret_cast<block_batch*>(command.data);
+
+    batch->queue->complete(*batch);
+}
+
+void block_queue::complete(block_batch& batch){
+    auto result = batch.command.result;
+
+    if(!result && batch.operation == block_operation::READ && batch.requests.size() > 1){
+        for(auto* request : batch.requests){
+            std::copy_n(batch.buffer.get() + (request->sector - batch.sector) * BLOCK_SIZE, request->count * BLOCK_SIZE, request->buffer);
+        }
+    }
+
+    stats.count(batch.operation != block_operation::READ, batch.count);
+
+    {
+        std::lock_guard<mutex> l(lock);
+
+        dispatched.erase(std::find(dispatched.begin(), dispatched.end(), &batch));
+
+        // The service time is the time during which the device was busy
+        if(dispatched.empty()){
+            stats.service += timer::counter() - busy_start;
+        }
+
+        // The batches overlapping this one can now be dispatched
+        if(stalled){
+            stalled = false;
+            progress.unlock();
+        }
+    }
+
+    for(auto* request : batch.requests){
+        if(request->io->complete_part(result)){
+            --stats.in_flight;
+        }
+
+        delete request;
+    }
+
+    delete &batch;
+}
@@ -0,0 +1,95 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include "block_stats.hpp"
+#include "timer.hpp"
+
+#include "fs/sysfs.hpp"
+
+namespace {
+
+block_stats& stats_of(void* data){
+    return *reinterpret_cast<block_stats*>(data);
+}
+
+std::string sysfs_reads(void* data){
+    return std::to_string(stats_of(data).reads.load());
+}
+
+std::string sysfs_writes(void* data){
+    return std::to_string(stats_of(data).writes.load());
+}
+
+std::string sysfs_read_sectors(void* data){
+    return std::to_string(stats_of(data).read_sectors.load());
+}
+
+std::string sysfs_write_sectors(void* data){
+    return std::to_string(stats_of(data).write_sectors.load());
+}
+
+std::string sysfs_merged(void* data){
+    return std::to_string(stats_of(data).merged.load());
+}
+
+std::string sysfs_hits(void* data){
+    return std::to_string(stats_of(data).hits.load());
+}
+
+std::string sysfs_misses(void* data){
+    return std::to_string(stats_of(data).misses.load());
+}
+
+std::string sysfs_service_time(void* data){
+    auto frequency = timer::counter_frequency();
+
+    if(!frequency){
+        return "0";
+    }
+
+    // Published in milliseconds
+    return std::to_string(stats_of(data).service.load() * 1000 / frequency);
+}
+
+std::string sysfs_in_flight(void* data){
+    return std::to_string(stats_of(data).in_flight.load());
+}
+
+} //end of anonymous namespace
+
+void block_stats::count(bool write, size_t sectors){
+    if(write){
+        ++writes;
+        write_sectors += sectors;
+    } else {
+        ++reads;
+        read_sectors += sectors;
+    }
+}
+
+void block_stats::account(bool write, size_t sectors, uint64_t start){
+    count(write, sectors);
+
+    service += timer::counter() - start;
+}
+
+void block_stats::publish(const std::string& name, bool merges){
+    auto p = path("/block") / name;
+
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "reads", &sysfs_reads, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "writes", &sysfs_writes, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "read_sectors", &sysfs_read_sectors, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "write_sectors", &sysfs_write_sectors, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "hits", &sysfs_hits, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "misses", &sysfs_misses, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "service_time", &sysfs_service_time, this);
+    sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "in_flight", &sysfs_in_flight, this);
+
+    if(merges){
+        sysfs::set_dynamic_value_data(sysfs::get_sys_path(), p / "merged", &sysfs_merged, this);
+    }
+}
@@ -0,0 +1,710 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <array.hpp>
+#include <vector.hpp>
+#include <algorithms.hpp>
+#include <lock_guard.hpp>
+
+#include <tlib/errors.hpp>
+
+#include "buffer_cache.hpp"
+#include "block_cache.hpp"
+#include "scheduler.hpp"
+#include "physical_allocator.hpp"
+#include "timer.hpp"
+#include "logging.hpp"
+
+#include "conc/mutex.hpp"
+
+#include "fs/sysfs.hpp"
+
+namespace {
+
+static constexpr const size_t BLOCK_SIZE = 512;
+
+// The minimum number of blocks of the cache at boot (128KiB)
+static constexpr const size_t MIN_CACHE_BLOCKS = 256;
+
+// Writes of at least this number of sectors bypass the cache
+static constexpr const size_t WRITE_THROUGH_SECTORS = 64;
+
+// The maximum number of sectors written back at once (128KiB)
+static constexpr const size_t MAX_FLUSH_SECTORS = 256;
+
+// The period of the flusher task
+static constexpr const size_t FLUSH_INTERVAL = 1000; // ms
+
+// The maximum number of asynchronous requests of a read or a flush
+static constexpr const size_t MAX_RUNS = 8;
+
+// The readahead window starts at 8KiB and doubles up to the maximum
+static constexpr const size_t MIN_READAHEAD = 16;
+static constexpr const size_t MAX_READAHEAD = 256;
+
+block_cache cache;
+
+mutex cache_lock; ///< Protect the cache
+mutex flush_lock; ///< Serialize the write backs with the direct writes
+
+// The age after which the dirty blocks are written back
+uint64_t dirty_expire = 5000; // ms
+
+// The number of blocks the cache should hold, it can be temporarily smaller
+// after giving memory back to the system
+size_t target_blocks = 0;
+
+// Incremented by every write, to the cache or to the disk, and by every write
+// back. The data read from the disk during a write may be stale, it is not
+// inserted in the cache
+size_t write_generation = 0;
+
+/*!
+ * \brief A stream of sequential reads on a disk
+ */
+struct readahead_stream {
+    uint16_t device; ///< The disk of the stream
+    uint64_t next;   ///< The sector expected by the next sequential read
+    uint64_t end;    ///< The end of the sectors already prefetched
+    size_t window;   ///< The current readahead window, in sectors
+    size_t last;     ///< The time of the last read of the stream, 0 if unused
+};
+
+/*!
+ * \brief An asynchronous read of sectors missing from the cache
+ */
+struct prefetch_request {
+    disks::disk_descriptor* disk;
+    size_t generation; ///< The write generation at submission
+    std::unique_heap_array<char> buffer;
+    block_io io;
+};
+
+mutex readahead_lock; ///< Protect the streams
+
+std::array<readahead_stream, 8> streams;
+size_t readahead_clock = 0;
+
+// The maximum readahead window, in sectors, 0 to disable readahead
+size_t readahead_max = MAX_READAHEAD;
+
+std::string sysfs_dirty_expire(void*){
+    return std::to_string(dirty_expire);
+}
+
+size_t sysfs_set_dirty_expire(void*, const std::string& value){
+    size_t expire;
+    if(auto status = sysfs::parse_value(value, expire)){
+        return status;
+    }
+
+    dirty_expire = expire;
+
+    return 0;
+}
+
+std::string sysfs_blocks(void*){
+    std::lock_guard<mutex> l(cache_lock);
+
+    return std::to_string(cache.capacity());
+}
+
+size_t sysfs_set_blocks(void*, const std::string& value){
+    size_t blocks;
+    if(auto status = sysfs::parse_value(value, blocks)){
+        return status;
+    }
+
+    target_blocks = blocks;
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+
+        if(target_blocks >= cache.capacity()){
+            return cache.grow(target_blocks) ? 0 : std::ERROR_FAILED;
+        }
+
+        cache.shrink(target_blocks);
+        cache.release();
+
+        if(cache.capacity() <= target_blocks){
+            return 0;
+        }
+    }
+
+    // Dirty blocks prevent the cache from shrinking
+    buffer_cache::sync();
+
+    std::lock_guard<mutex> l(cache_lock);
+    cache.shrink(target_blocks);
+    cache.release();
+
+    return 0;
+}
+
+// Called by the physical allocator when memory runs low
+// The allocation may come from the middle of a page table or virtual allocator
+// update, so the pages are only removed from the cache here. The flusher task
+// gives them back to the system
+size_t shrink_cache(size_t pages){
+    // The allocation may come from a process holding the lock
+    if(!cache_lock.try_lock()){
+        return 0;
+    }
+
+    auto capacity = cache.capacity();
+    auto blocks = pages * cache.blocks_per_page();
+
+    auto removed = cache.shrink(capacity > blocks ? capacity - blocks : 0);
+
+    cache_lock.unlock();
+
+    if(removed){
+        logging::logf(logging::log_level::DEBUG, "buffer_cache: Removed %u pages\n", removed);
+    }
+
+    return 0;
+}
+
+std::string sysfs_readahead(void*){
+    return std::to_string(readahead_max);
+}
+
+size_t sysfs_set_readahead(void*, const std::string& value){
+    size_t readahead;
+    if(auto status = sysfs::parse_value(value, readahead)){
+        return status;
+    }
+
+    readahead_max = std::min(readahead, MAX_READAHEAD);
+
+    return 0;
+}
+
+std::string sysfs_dirty(){
+    std::lock_guard<mutex> l(cache_lock);
+
+    return std::to_string(cache.dirty_count());
+}
+
+std::string sysfs_hits(){
+    return std::to_string(cache.hits());
+}
+
+std::string sysfs_misses(){
+    return std::to_string(cache.misses());
+}
+
+std::string sysfs_evictions(){
+    return std::to_string(cache.evictions());
+}
+
+// Write back the blocks that became dirty at or before the given time
+size_t flush(uint64_t before){
+    std::lock_guard<mutex> flush_guard(flush_lock);
+
+    std::vector<block_t*> dirty;
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+        cache.dirty_blocks(dirty, before);
+    }
+
+    if(dirty.empty()){
+        return 0;
+    }
+
+    // Only this function cleans blocks and dirty blocks are never evicted, so
+    // the collected blocks remain valid until they are written back
+    std::sort(dirty.begin(), dirty.end(), [](block_t* a, block_t* b){
+        return a->device < b->device || (a->device == b->device && a->sector < b->sector);
+    });
+
+    std::array<block_io, MAX_RUNS> ios;
+    std::array<std::unique_heap_array<char>, MAX_RUNS> buffers;
+    std::array<size_t, MAX_RUNS> firsts; // The index of the first block of each run
+    size_t runs = 0;
+
+    size_t result = 0;
+
+    // Wait for the writes in flight, the blocks become clean only once written
+    auto complete = [&](){
+        for(size_t r = 0; r < runs; ++r){
+            auto status = ios[r].wait();
+
+            if(status){
+                logging::logf(logging::log_level::ERROR, "buffer_cache: Failed to write back %u sectors at %u\n", ios[r].count, ios[r].sector);
+                result = status;
+            }
+
+            auto now = timer::milliseconds();
+
+            std::lock_guard<mutex> l(cache_lock);
+
+            // A block may now be evicted, a read started before must not insert it again
+            ++write_generation;
+
+            for(size_t j = 0; j < ios[r].count; ++j){
+                cache.mark_written(dirty[firsts[r] + j], !status, now);
+            }
+        }
+
+        runs = 0;
+    };
+
+    size_t i = 0;
+    while(i < dirty.size()){
+        auto device = dirty[i]->device;
+        auto sector = dirty[i]->sector;
+
+        // Collect the run of contiguous dirty sectors
+        size_t run = 1;
+        while(i + run < dirty.size() && run < MAX_FLUSH_SECTORS && dirty[i + run]->device == device && dirty[i + run]->sector == sector + run){
+            ++run;
+        }
+
+        buffers[runs] = std::unique_heap_array<char>(run * BLOCK_SIZE);
+        firsts[runs] = i;
+
+        {
+            std::lock_guard<mutex> l(cache_lock);
+
+            for(size_t j = 0; j < run; ++j){
+                std::copy_n(dirty[i + j]->payload(), BLOCK_SIZE, buffers[runs].get() + j * BLOCK_SIZE);
+                cache.mark_writeback(dirty[i + j]);
+            }
+        }
+
+        // The runs are written asynchronously, several of them in flight
+        ios[runs].init(block_operation::WRITE, sector, run, buffers[runs].get());
+        disks::disk_by_uuid(device).queue->submit(ios[runs]);
+
+        if(++runs == MAX_RUNS){
+            complete();
+        }
+
+        i += run;
+    }
+
+    complete();
+
+    return result;
+}
+
+void flusher_task(){
+    while(true){
+        scheduler::sleep_ms(FLUSH_INTERVAL);
+
+        auto now = timer::milliseconds();
+
+        if(now >= dirty_expire){
+            flush(now - dirty_expire);
+        }
+
+        // Grow back after memory has been given back to the system, the
+        // removed pages are reused first, the others are released
+        std::lock_guard<mutex> l(cache_lock);
+
+        if(cache.capacity() < target_blocks){
+            cache.grow(target_blocks);
+        }
+
+        auto released = cache.release();
+
+        if(released){
+            logging::logf(logging::log_level::DEBUG, "buffer_cache: Released %u pages\n", released);
+        }
+    }
+}
+
+// Insert sectors read from the disk in the cache
+void populate(disks::disk_descriptor& disk, uint64_t start, size_t count, char* data, size_t generation){
+    std::lock_guard<mutex> l(cache_lock);
+
+    // The disk may have been written during the transfer, only the cached
+    // copies, more recent, are used
+    if(generation != write_generation){
+        for(size_t i = 0; i < count; ++i){
+            auto block = cache.peek(disk.uuid, start + i);
+            if(block){
+                std::copy_n(block, BLOCK_SIZE, data + i * BLOCK_SIZE);
+            }
+        }
+
+        return;
+    }
+
+    for(size_t i = 0; i < count; ++i){
+        auto* target = data + i * BLOCK_SIZE;
+
+        bool valid;
+        auto block = cache.block(disk.uuid, start + i, valid);
+
+        if(!block){
+            // The cache is full of dirty blocks
+            break;
+        }
+
+        if(valid){
+            // The block was written during the transfer, it is more recent
+            std::copy_n(block, BLOCK_SIZE, target);
+        } else {
+            std::copy_n(target, BLOCK_SIZE, block);
+        }
+    }
+}
+
+// Called by the completion task once a prefetch is read
+void prefetch_done(block_io& io){
+    auto* request = reinterpret_cast<prefetch_request*>(io.data);
+
+    if(!io.result){
+        populate(*request->disk, io.sector, io.count, request->buffer.get(), request->generation);
+    }
+
+    delete request;
+}
+
+// Detect sequential reads and prefetch the next sectors
+void readahead(disks::disk_descriptor& disk, uint64_t start, size_t count){
+    if(!readahead_max){
+        return;
+    }
+
+    uint64_t first;
+    size_t window;
+
+    {
+        std::lock_guard<mutex> l(readahead_lock);
+
+        ++readahead_clock;
+
+        readahead_stream* stream = nullptr;
+
+        for(auto& s : streams){
+            if(s.device == disk.uuid && s.next == start && s.last){
+                stream = &s;
+                break;
+            }
+        }
+
+        if(!stream){
+            // Start a new stream, replacing the least recently used one
+            stream = &streams[0];
+            for(auto& s : streams){
+                if(s.last < stream->last){
+                    stream = &s;
+                }
+            }
+
+            stream->device = disk.uuid;
+            stream->next = start + count;
+            stream->end = start + count;
+            stream->window = 0;
+            stream->last = readahead_clock;
+
+            return;
+        }
+
+        stream->next = start + count;
+        stream->last = readahead_clock;
+
+        // Prefetch again once the reader is inside the second half of the window
+        if(stream->window && stream->next + stream->window / 2 < stream->end){
+            return;
+        }
+
+        stream->window = stream->window ? std::min(stream->window * 2, readahead_max) : std::min(std::max(2 * count, MIN_READAHEAD), readahead_max);
+
+        first = std::max(stream->end, stream->next);
+        auto sectors = disk.queue->size() / BLOCK_SIZE;
+
+        if(first >= sectors){
+            return;
+        }
+
+        window = std::min(stream->window, sectors - first);
+
+        stream->end = first + window;
+    }
+
+    buffer_cache::prefetch(disk, first, window);
+}
+
+// Write through the disk, updating the cached copies
+size_t write_through(disks::disk_descriptor& disk, uint64_t start, size_t count, const char* source, size_t& written){
+    std::lock_guard<mutex> flush_guard(flush_lock);
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+
+        ++write_generation;
+
+        // The dirty copies remain dirty, they are written back again later
+        for(size_t i = 0; i < count; ++i){
+            auto block = cache.peek(disk.uuid, start + i);
+            if(block){
+                if(source){
+                    std::copy_n(source + i * BLOCK_SIZE, BLOCK_SIZE, block);
+                } else {
+                    std::fill_n(block, BLOCK_SIZE, 0);
+                }
+            }
+        }
+    }
+
+    if(source){
+        return disk.queue->write(start, count, source, written);
+    } else {
+        return disk.queue->clear(start, count, written);
+    }
+}
+
+} //end of anonymous namespace
+
+void buffer_cache::init(){
+    cache_lock.init();
+    flush_lock.init();
+    readahead_lock.init();
+
+    for(auto& stream : streams){
+        stream.last = 0;
+    }
+
+    // Use a sixteenth of the memory for the cache
+    target_blocks = std::max(physical_allocator::available() / 16 / BLOCK_SIZE, MIN_CACHE_BLOCKS);
+
+    cache.init(BLOCK_SIZE, target_blocks);
+
+    physical_allocator::register_shrinker(&shrink_cache);
+
+    logging::logf(logging::log_level::TRACE, "buffer_cache: %u blocks\n", cache.capacity());
+
+    sysfs::set_writable_value_data(sysfs::get_sys_path(), path("/block/cache/dirty_expire"), &sysfs_dirty_expire, &sysfs_set_dirty_expire, nullptr);
+    sysfs::set_writable_value_data(sysfs::get_sys_path(), path("/block/cache/blocks"), &sysfs_blocks, &sysfs_set_blocks, nullptr);
+    sysfs::set_writable_value_data(sysfs::get_sys_path(), path("/block/cache/readahead"), &sysfs_readahead, &sysfs_set_readahead, nullptr);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/block/cache/dirty"), &sysfs_dirty);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/block/cache/hits"), &sysfs_hits);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/block/cache/misses"), &sysfs_misses);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/block/cache/evictions"), &sysfs_evictions);
+}
+
+void buffer_cache::finalize(){
+    auto* user_stack   = new char[scheduler::user_stack_size];
+    auto* kernel_stack = new char[scheduler::kernel_stack_size];
+
+    auto& flusher_process    = scheduler::create_kernel_task("flusher", user_stack, kernel_stack, &flusher_task);
+    flusher_process.ppid     = 1;
+    flusher_process.priority = scheduler::DEFAULT_PRIORITY;
+
+    scheduler::queue_system_process(flusher_process.pid);
+}
+
+size_t buffer_cache::read(disks::disk_descriptor& disk, uint64_t start, size_t count, void* destination, size_t& read, block_stats* partition){
+    auto buffer = reinterpret_cast<char*>(destination);
+
+    std::array<block_io, MAX_RUNS> ios;
+    size_t runs = 0;
+
+    size_t generation = 0;
+    size_t result = 0;
+
+    // Wait for the runs in flight and insert them in the cache
+    auto complete = [&](){
+        for(size_t r = 0; r < runs; ++r){
+            auto status = ios[r].wait();
+
+            if(status){
+                result = status;
+            } else {
+                populate(disk, ios[r].sector, ios[r].count, ios[r].buffer, generation);
+
+                read += ios[r].count * BLOCK_SIZE;
+            }
+        }
+
+        runs = 0;
+    };
+
+    size_t i = 0;
+    while(i < count){
+        size_t run = 0;
+
+        {
+            std::lock_guard<mutex> l(cache_lock);
+
+            if(!runs){
+                generation = write_generation;
+            }
+
+            // Serve the block directly from the cache if possible
+            auto block = cache.block_if_present(disk.uuid, start + i);
+            if(block){
+                std::copy_n(block, BLOCK_SIZE, buffer + i * BLOCK_SIZE);
+
+                ++disk.queue->stats.hits;
+                if(partition){
+                    ++partition->hits;
+                }
+
+                read += BLOCK_SIZE;
+                ++i;
+
+                continue;
+            }
+
+            // Collect the run of contiguous blocks missing from the cache
+            run = 1;
+            while(i + run < count && !cache.contains(disk.uuid, start + i + run)){
+                ++run;
+            }
+        }
+
+        disk.queue->stats.misses += run;
+        if(partition){
+            partition->misses += run;
+        }
+
+        // The runs are read asynchronously, several of them in flight
+        ios[runs].init(block_operation::READ, start + i, run, buffer + i * BLOCK_SIZE);
+        disk.queue->submit(ios[runs]);
+
+        if(++runs == MAX_RUNS){
+            complete();
+        }
+
+        i += run;
+    }
+
+    // The next sectors are prefetched while the missing ones are read
+    readahead(disk, start, count);
+
+    complete();
+
+    return result;
+}
+
+size_t buffer_cache::write(disks::disk_descriptor& disk, uint64_t start, size_t count, const void* source, size_t& written){
+    auto buffer = reinterpret_cast<const char*>(source);
+
+    if(count >= WRITE_THROUGH_SECTORS){
+        return write_through(disk, start, count, buffer, written);
+    }
+
+    bool flushed = false;
+
+    size_t i = 0;
+    while(i < count){
+        {
+            std::lock_guard<mutex> l(cache_lock);
+
+            auto now = timer::milliseconds();
+
+            ++write_generation;
+
+            for(; i < count; ++i){
+                bool valid;
+                auto block = cache.block(disk.uuid, start + i, valid);
+
+                if(!block){
+                    break;
+                }
+
+                std::copy_n(buffer + i * BLOCK_SIZE, BLOCK_SIZE, block);
+                cache.mark_dirty(block, now);
+
+                written += BLOCK_SIZE;
+            }
+        }
+
+        if(i < count){
+            // The cache has no room even when clean, bypass it
+            if(flushed){
+                return write_through(disk, start + i, count - i, buffer + i * BLOCK_SIZE, written);
+            }
+
+            // All the blocks are dirty, write them back to make some room
+            auto status = flush(timer::milliseconds());
+            if(status){
+                return status;
+            }
+
+            flushed = true;
+        }
+    }
+
+    return 0;
+}
+
+size_t buffer_cache::read_direct(disks::disk_descriptor& disk, uint64_t start, size_t count, void* destination, size_t& read){
+    auto buffer = reinterpret_cast<char*>(destination);
+
+    auto result = disk.queue->read(start, count, buffer, read);
+
+    if(result){
+        return result;
+    }
+
+    // The cached copies are at least as recent as the disk, the dirty ones are
+    // not written back yet
+    std::lock_guard<mutex> l(cache_lock);
+
+    for(size_t i = 0; i < count; ++i){
+        auto block = cache.peek(disk.uuid, start + i);
+        if(block){
+            std::copy_n(block, BLOCK_SIZE, buffer + i * BLOCK_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+size_t buffer_cache::write_direct(disks::disk_descriptor& disk, uint64_t start, size_t count, const void* source, size_t& written){
+    return write_through(disk, start, count, reinterpret_cast<const char*>(source), written);
+}
+
+size_t buffer_cache::clear(disks::disk_descriptor& disk, uint64_t start, size_t count, size_t& written){
+    return write_through(disk, start, count, nullptr, written);
+}
+
+size_t buffer_cache::sync(){
+    return flush(timer::milliseconds());
+}
+
+void buffer_cache::prefetch(disks::disk_descriptor& disk, uint64_t start, size_t count){
+    size_t i = 0;
+    while(i < count){
+        size_t run = 0;
+        size_t generation;
+
+        {
+            std::lock_guard<mutex> l(cache_lock);
+
+            if(cache.contains(disk.uuid, start + i)){
+                ++i;
+                continue;
+            }
+
+            run = 1;
+            while(i + run < count && !cache.contains(disk.uuid, start + i + run)){
+                ++run;
+            }
+
+            generation = write_generation;
+        }
+
+        auto* request = new prefetch_request;
+        request->disk = &disk;
+        request->generation = generation;
+        request->buffer = std::unique_heap_array<char>(run * BLOCK_SIZE);
+        request->io.init(block_operation::READ, start + i, run, request->buffer.get(), &prefetch_done, request);
+
+        disk.queue->submit(request->io);
+
+        i += run;
+    }
+}
@@ -9,13 +9,19 @@
 #include <array.hpp>
 #include <string.hpp>
 
+#include <tlib/errors.hpp>
+
 #include "disks.hpp"
+#include "buffer_cache.hpp"
 #include "thor.hpp"
 #include "print.hpp"
 #include "logging.hpp"
+#include "timer.hpp"
 
 // The disks implementation
 #include "drivers/ata.hpp"
+#include "drivers/ahci.hpp"
+#include "drivers/virtio_blk.hpp"
 #include "drivers/ramdisk.hpp"
 
 #include "fs/devfs.hpp"
@@ -23,8 +29,8 @@
 
 namespace {
 
-//For now, 5 is enough as only the ata driver and ramdisk are implemented
-std::array<disks::disk_descriptor, 5> _disks;
+//4 ATA disks, a few AHCI and virtio disks and the ramdisk
+std::array<disks::disk_descriptor, 16> _disks;
 
 uint64_t number_of_disks = 0;
 
@@ -47,15 +53,232 @@ struct boot_record_t {
 
 static_assert(sizeof(boot_record_t) == 512, "The boot record is 512 bytes long");
 
+static constexpr const size_t BLOCK_SIZE = 512;
+
+// The devices are read and written by whole sectors
+size_t check_sectors(size_t count, size_t offset){
+    if(count % BLOCK_SIZE != 0){
+        return std::ERROR_INVALID_COUNT;
+    }
+
+    if(offset % BLOCK_SIZE != 0){
+        return std::ERROR_INVALID_OFFSET;
+    }
+
+    return 0;
+}
+
+// Count a request of a partition in its statistics
+template<typename Functor>
+size_t account(disks::partition_descriptor& partition, bool write, size_t count, Functor functor){
+    auto& stats = *partition.stats;
+
+    auto start = timer::counter();
+    ++stats.in_flight;
+
+    auto result = functor();
+
+    --stats.in_flight;
+    stats.account(write, count / BLOCK_SIZE, start);
+
+    return result;
+}
+
+// The devfs interface of a whole disk, through the buffer cache
+struct disk_driver final : devfs::dev_driver {
+    size_t read(void* data, char* buffer, size_t count, size_t offset, size_t& read) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        read = 0;
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return buffer_cache::read(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, read);
+    }
+
+    size_t write(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return buffer_cache::write(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, written);
+    }
+
+    size_t clear(void* data, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return buffer_cache::clear(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE, written);
+    }
+
+    size_t read_direct(void* data, char* buffer, size_t count, size_t offset, size_t& read) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        read = 0;
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return buffer_cache::read_direct(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, read);
+    }
+
+    size_t write_direct(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return buffer_cache::write_direct(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, written);
+    }
+
+    size_t size(void* data) override {
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        return disk->queue->size();
+    }
+
+    size_t prefetch(void* data, size_t count, size_t offset) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        auto* disk = reinterpret_cast<disks::disk_descriptor*>(data);
+        buffer_cache::prefetch(*disk, offset / BLOCK_SIZE, count / BLOCK_SIZE);
+
+        return 0;
+    }
+};
+
+// The devfs interface of a partition, through the buffer cache
+struct partition_driver final : devfs::dev_driver {
+    size_t read(void* data, char* buffer, size_t count, size_t offset, size_t& read) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        read = 0;
+
+        auto& partition = *reinterpret_cast<disks::partition_descriptor*>(data);
+        return account(partition, false, count, [&](){
+            return buffer_cache::read(*partition.disk, partition.start + offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, read, partition.stats);
+        });
+    }
+
+    size_t write(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto& partition = *reinterpret_cast<disks::partition_descriptor*>(data);
+        return account(partition, true, count, [&](){
+            return buffer_cache::write(*partition.disk, partition.start + offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, written);
+        });
+    }
+
+    size_t clear(void* data, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto& partition = *reinterpret_cast<disks::partition_descriptor*>(data);
+        return account(partition, true, count, [&](){
+            return buffer_cache::clear(*partition.disk, partition.start + offset / BLOCK_SIZE, count / BLOCK_SIZE, written);
+        });
+    }
+
+    size_t read_direct(void* data, char* buffer, size_t count, size_t offset, size_t& read) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        read = 0;
+
+        auto& partition = *reinterpret_cast<disks::partition_descriptor*>(data);
+        return account(partition, false, count, [&](){
+            return buffer_cache::read_direct(*partition.disk, partition.start + offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, read);
+        });
+    }
+
+    size_t write_direct(void* data, const char* buffer, size_t count, size_t offset, size_t& written) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        written = 0;
+
+        auto& partition = *reinterpret_cast<disks::partition_descriptor*>(data);
+        return account(partition, true, count, [&](){
+            return buffer_cache::write_direct(*partition.disk, partition.start + offset / BLOCK_SIZE, count / BLOCK_SIZE, buffer, written);
+        });
+    }
+
+    size_t size(void* data) override {
+        auto* partition = reinterpret_cast<disks::partition_descriptor*>(data);
+        return partition->sectors * BLOCK_SIZE;
+    }
+
+    size_t prefetch(void* data, size_t count, size_t offset) override {
+        if(auto status = check_sectors(count, offset)){
+            return status;
+        }
+
+        auto* partition = reinterpret_cast<disks::partition_descriptor*>(data);
+        buffer_cache::prefetch(*partition->disk, partition->start + offset / BLOCK_SIZE, count / BLOCK_SIZE);
+
+        return 0;
+    }
+};
+
 ata::ata_driver ata_driver_impl;
-ata::ata_part_driver ata_part_driver_impl;
+ahci::ahci_driver ahci_driver_impl;
+virtio_blk::virtio_blk_driver virtio_driver_impl;
 ramdisk::ramdisk_driver ramdisk_driver_impl;
+disk_driver disk_driver_impl;
+partition_driver partition_driver_impl;
 
-devfs::dev_driver* ata_driver = &ata_driver_impl;
-devfs::dev_driver* ata_part_driver = &ata_part_driver_impl;
 devfs::dev_driver* ramdisk_driver = &ramdisk_driver_impl;
 devfs::dev_driver* atapi_driver = nullptr;
 
+// Register a disk with a request queue and its partitions
+disks::disk_descriptor& register_disk(const std::string& name, disks::disk_type type, block_driver* driver, void* descriptor){
+    auto& disk = _disks[number_of_disks];
+
+    disk = {number_of_disks, type, descriptor, new block_queue};
+    disk.queue->init(name, driver, descriptor);
+
+    devfs::register_device("/dev/", name, devfs::device_type::BLOCK_DEVICE, &disk_driver_impl, &disk);
+
+    char part = '1';
+
+    for(auto& partition : disks::partitions(disk)){
+        auto part_name = name + part++;
+
+        auto* descriptor = new disks::partition_descriptor(partition);
+
+        descriptor->stats = new block_stats;
+        descriptor->stats->publish(part_name, false);
+
+        devfs::register_device("/dev/", part_name, devfs::device_type::BLOCK_DEVICE, &partition_driver_impl, descriptor);
+    }
+
+    ++number_of_disks;
+
+    return disk;
+}
+
 void make_ram_disk(){
     auto* descriptor = ramdisk::make_disk(1024 * 1024); //1MiB
 
@@ -64,7 +287,7 @@ void make_ram_disk(){
         return;
     }
 
-    _disks[number_of_disks] = {number_of_disks, disks::disk_type::RAM, descriptor};
+    _disks[number_of_disks] = {number_of_disks, disks::disk_type::RAM, descriptor, nullptr};
 
     devfs::register_device("/dev/", "ram0", devfs::device_type::BLOCK_DEVICE, ramdisk_driver, &_disks[number_of_disks]);
 
@@ -85,37 +308,61 @@ void disks::detect_disks(){
         if(descriptor.present){
             std::string name;
             if(descriptor.atapi){
-                _disks[number_of_disks] = {number_of_disks, disks::disk_type::ATAPI, &descriptor};
+                _disks[number_of_disks] = {number_of_disks, disks::disk_type::ATAPI, &descriptor, nullptr};
 
                 name = "cd";
                 name += cdrom++;
 
                 devfs::register_device("/dev/", name, devfs::device_type::BLOCK_DEVICE, atapi_driver, &_disks[number_of_disks]);
-            } else {
-                _disks[number_of_disks] = {number_of_disks, disks::disk_type::ATA, &descriptor};
 
+                ++number_of_disks;
+            } else {
                 name = "hd";
                 name += disk++;
 
-                devfs::register_device("/dev/", name, devfs::device_type::BLOCK_DEVICE, ata_driver, &_disks[number_of_disks]);
-
-                char part = '1';
-
-                for(auto& partition : partitions(_disks[number_of_disks])){
-                    auto part_name = name + part++;
-
-                    devfs::register_device("/dev/", part_name, devfs::device_type::BLOCK_DEVICE, ata_part_driver, new partition_descriptor(partition));
-                }
+                register_disk(name, disks::disk_type::ATA, &ata_driver_impl, &descriptor);
             }
 
             sysfs::set_constant_value(sysfs::get_sys_path(), path("/ata") / name / "model", descriptor.model);
             sysfs::set_constant_value(sysfs::get_sys_path(), path("/ata") / name / "serial", descriptor.serial);
             sysfs::set_constant_value(sysfs::get_sys_path(), path("/ata") / name / "firmware", descriptor.firmware);
-
-            ++number_of_disks;
         }
     }
 
+    ahci::detect_disks();
+
+    char sata_disk = 'a';
+
+    for(uint8_t i = 0; i < ahci::number_of_disks() && number_of_disks + 1 < _disks.size(); ++i){
+        auto& descriptor = ahci::drive(i);
+
+        std::string name = "sd";
+        name += sata_disk++;
+
+        register_disk(name, disks::disk_type::AHCI, &ahci_driver_impl, &descriptor);
+
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/ahci") / name / "model", descriptor.model);
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/ahci") / name / "serial", descriptor.serial);
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/ahci") / name / "firmware", descriptor.firmware);
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/ahci") / name / "queue_depth", std::to_string(descriptor.queue_depth));
+    }
+
+    virtio_blk::detect_disks();
+
+    char virtio_disk = 'a';
+
+    for(uint8_t i = 0; i < virtio_blk::number_of_disks() && number_of_disks + 1 < _disks.size(); ++i){
+        auto& descriptor = virtio_blk::drive(i);
+
+        std::string name = "vd";
+        name += virtio_disk++;
+
+        register_disk(name, disks::disk_type::VIRTIO, &virtio_driver_impl, &descriptor);
+
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/virtio") / name / "queue_size", std::to_string(descriptor.queue_size));
+        sysfs::set_constant_value(sysfs::get_sys_path(), path("/virtio") / name / "requests", std::to_string(descriptor.requests));
+    }
+
     make_ram_disk();
 }
 
@@ -141,8 +388,8 @@ std::unique_heap_array<disks::partition_descriptor> disks::partitions(disk_descr
 
     auto boot_record = std::make_unique<boot_record_t>();
 
-    size_t read;
-    if(ata::read_sectors(*static_cast<ata::drive_descriptor*>(disk.descriptor), 0, 1, boot_record.get(), read) > 0){
+    size_t read = 0;
+    if(disk.queue->read(0, 1, boot_record.get(), read) > 0){
         k_print_line("Read Boot Record failed");
 
         return {};
@@ -172,7 +419,7 @@ std::unique_heap_array<disks::partition_descriptor> disks::partitions(disk_descr
                     type = vfs::partition_type::UNKNOWN;
                 }
 
-                partitions[p] = {p, type, boot_record->partitions[i].lba_begin, boot_record->partitions[i].sectors, &disk};
+                partitions[p] = {p, type, boot_record->partitions[i].lba_begin, boot_record->partitions[i].sectors, &disk, nullptr};
 
                 ++p;
             }
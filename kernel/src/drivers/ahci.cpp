@@ -0,0 +1,762 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <array.hpp>
+
+#include <tlib/errors.hpp>
+
+#include "drivers/ahci.hpp"
+#include "drivers/ahci_constants.hpp"
+#include "drivers/pci.hpp"
+
+#include "conc/semaphore.hpp"
+#include "conc/int_lock.hpp"
+#include "conc/deferred_unique_mutex.hpp"
+
+#include "kernel_utils.hpp"
+#include "logging.hpp"
+#include "interrupts.hpp"
+#include "scheduler.hpp"
+#include "physical_allocator.hpp"
+#include "virtual_allocator.hpp"
+#include "paging.hpp"
+
+#ifdef THOR_CONFIG_AHCI_VERBOSE
+#define verbose_logf(...) logging::logf(__VA_ARGS__)
+#else
+#define verbose_logf(...)
+#endif
+
+namespace {
+
+static constexpr const size_t BLOCK_SIZE = 512;
+
+// Each command slot has a bounce buffer large enough for the largest request
+// of the queue, so that a merged request is issued as a single command
+static constexpr const size_t SLOT_MAX_SECTORS = MAX_REQUEST_SECTORS;
+static constexpr const size_t SLOT_BUFFER_PAGES = SLOT_MAX_SECTORS * BLOCK_SIZE / paging::PAGE_SIZE;
+
+// Size of a command table (with a single PRD), aligned on 128 bytes
+static constexpr const size_t COMMAND_TABLE_SIZE = 256;
+
+struct command_header_t {
+    uint16_t flags; ///< Command FIS length, direction, ...
+    uint16_t prdtl; ///< Number of PRDT entries
+    volatile uint32_t prdbc; ///< Number of bytes transferred
+    uint32_t ctba;  ///< Command table base address
+    uint32_t ctbau; ///< Command table base address (upper 32 bits)
+    uint32_t reserved[4];
+} __attribute__((packed));
+
+static_assert(sizeof(command_header_t) == 32, "A command header is 32 bytes long");
+
+struct prd_entry_t {
+    uint32_t dba;  ///< Data base address
+    uint32_t dbau; ///< Data base address (upper 32 bits)
+    uint32_t reserved;
+    uint32_t dbc;  ///< Byte count - 1 and interrupt bit
+} __attribute__((packed));
+
+struct command_table_t {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    prd_entry_t prdt[1];
+} __attribute__((packed));
+
+static_assert(sizeof(command_table_t) <= COMMAND_TABLE_SIZE, "A command table must fit in its slot");
+
+struct slot_state {
+    deferred_unique_mutex lock; ///< Used to wait for the completion
+    volatile bool failed;       ///< Indicates if the command failed
+    command_table_t* table;
+    char* buffer;               ///< The bounce buffer (virtual)
+    size_t buffer_phys;         ///< The bounce buffer (physical)
+
+    ahci::port_state* port; ///< The port of the slot
+    size_t index;           ///< The index of the slot
+
+    block_io* io = nullptr; ///< The asynchronous request, nullptr for synchronous commands
+    char* data;             ///< The data of the asynchronous request in this slot
+    size_t bytes;           ///< The number of bytes of the asynchronous request in this slot
+    block_io command;       ///< Completes the part of the asynchronous request
+};
+
+} //end of anonymous namespace
+
+struct ahci::port_state {
+    volatile uint32_t* registers;    ///< The registers of the port
+    command_header_t* command_list;  ///< The command list (32 headers)
+
+    slot_state slots[AHCI_MAX_SLOTS];
+
+    semaphore slots_sem;             ///< Count of the free slots
+    volatile uint32_t free_slots;    ///< Bitmask of the free slots
+    volatile uint32_t active;        ///< Bitmask of the issued commands
+
+    bool ncq;
+    uint8_t slots_count;
+};
+
+namespace {
+
+volatile uint32_t* abar;
+bool s64a = false;
+bool irq_mode = false;
+uint8_t hba_slots = 1;
+bool hba_ncq = false;
+
+ahci::drive_descriptor* drives;
+uint8_t number_of_drives = 0;
+
+uint32_t read_register(ahci::port_state& port, size_t offset){
+    return port.registers[offset / 4];
+}
+
+void write_register(ahci::port_state& port, size_t offset, uint32_t value){
+    port.registers[offset / 4] = value;
+}
+
+// Allocate physically contiguous memory usable by the HBA
+char* allocate_dma(size_t pages, size_t& phys){
+    phys = physical_allocator::allocate(pages);
+
+    if(!phys){
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to allocate DMA memory\n");
+        return nullptr;
+    }
+
+    if(!s64a && phys + pages * paging::PAGE_SIZE > 0x100000000){
+        logging::logf(logging::log_level::ERROR, "ahci: DMA memory is not addressable by the HBA\n");
+        return nullptr;
+    }
+
+    auto virt = virtual_allocator::allocate(pages);
+    if(!paging::map_pages(virt, phys, pages)){
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to map DMA memory\n");
+        return nullptr;
+    }
+
+    auto memory = reinterpret_cast<char*>(virt);
+    std::fill_n(memory, pages * paging::PAGE_SIZE, 0);
+    return memory;
+}
+
+bool wait_for_port(ahci::port_state& port, size_t offset, uint32_t mask, uint32_t value, size_t timeout){
+    while((read_register(port, offset) & mask) != value){
+        if(!--timeout){
+            return false;
+        }
+
+        asm volatile ("pause");
+    }
+
+    return true;
+}
+
+bool stop_port(ahci::port_state& port){
+    auto command = read_register(port, AHCI_PORT_CMD);
+    write_register(port, AHCI_PORT_CMD, command & ~(AHCI_PORT_CMD_ST | AHCI_PORT_CMD_FRE));
+
+    return wait_for_port(port, AHCI_PORT_CMD, AHCI_PORT_CMD_CR | AHCI_PORT_CMD_FR, 0, 10000000);
+}
+
+void start_port(ahci::port_state& port){
+    write_register(port, AHCI_PORT_CMD, read_register(port, AHCI_PORT_CMD) | AHCI_PORT_CMD_FRE);
+
+    wait_for_port(port, AHCI_PORT_TFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, 10000000);
+
+    write_register(port, AHCI_PORT_CMD, read_register(port, AHCI_PORT_CMD) | AHCI_PORT_CMD_ST);
+}
+
+// Restart the command engine after a task file error
+void recover_port(ahci::port_state& port){
+    auto command = read_register(port, AHCI_PORT_CMD);
+    write_register(port, AHCI_PORT_CMD, command & ~AHCI_PORT_CMD_ST);
+    wait_for_port(port, AHCI_PORT_CMD, AHCI_PORT_CMD_CR, 0, 10000000);
+
+    write_register(port, AHCI_PORT_SERR, 0xFFFFFFFF);
+    write_register(port, AHCI_PORT_IS, 0xFFFFFFFF);
+
+    write_register(port, AHCI_PORT_CMD, read_register(port, AHCI_PORT_CMD) | AHCI_PORT_CMD_ST);
+}
+
+// Collect the completed commands of the port, must be called with interrupts disabled
+uint32_t check_port(ahci::port_state& port){
+    auto status = read_register(port, AHCI_PORT_IS);
+    write_register(port, AHCI_PORT_IS, status);
+
+    uint32_t done;
+
+    if(status & AHCI_PORT_IS_ERRORS){
+        logging::logf(logging::log_level::ERROR, "ahci: Port error (IS=%h TFD=%h)\n", size_t(status), size_t(read_register(port, AHCI_PORT_TFD)));
+
+        // With NCQ, an error aborts all the outstanding commands
+        done = port.active;
+
+        for(size_t i = 0; i < AHCI_MAX_SLOTS; ++i){
+            if(done & (1U << i)){
+                port.slots[i].failed = true;
+            }
+        }
+
+        recover_port(port);
+    } else {
+        auto busy = read_register(port, AHCI_PORT_SACT) | read_register(port, AHCI_PORT_CI);
+        done = port.active & ~busy;
+    }
+
+    port.active &= ~done;
+
+    return done;
+}
+
+void ahci_irq_handler(interrupt::syscall_regs*, void*){
+    auto pending = abar[AHCI_IS / 4];
+
+    for(size_t i = 0; i < number_of_drives; ++i){
+        auto& port = *drives[i].state;
+
+        if(!(pending & (1U << drives[i].port))){
+            continue;
+        }
+
+        auto done = check_port(port);
+
+        if(scheduler::is_started()){
+            for(size_t slot = 0; slot < AHCI_MAX_SLOTS; ++slot){
+                if(done & (1U << slot)){
+                    auto& state = port.slots[slot];
+
+                    if(state.io){
+                        state.command.complete_from_irq(state.failed ? std::ERROR_FAILED : 0);
+                    } else {
+                        state.lock.notify();
+                    }
+                }
+            }
+        }
+    }
+
+    abar[AHCI_IS / 4] = pending;
+}
+
+// Try to reserve a free command slot of the port
+bool try_acquire_slot(ahci::port_state& port, size_t& slot){
+    if(!port.slots_sem.try_lock()){
+        return false;
+    }
+
+    direct_int_lock lock;
+
+    slot = __builtin_ctz(port.free_slots);
+    port.free_slots &= ~(1U << slot);
+
+    return true;
+}
+
+// Reserve a command slot of the port, waiting if necessary
+size_t acquire_slot(ahci::port_state& port){
+    port.slots_sem.lock();
+
+    direct_int_lock lock;
+
+    auto slot = __builtin_ctz(port.free_slots);
+    port.free_slots &= ~(1U << slot);
+
+    return slot;
+}
+
+void release_slot(ahci::port_state& port, size_t slot){
+    {
+        direct_int_lock lock;
+
+        port.free_slots |= 1U << slot;
+    }
+
+    port.slots_sem.unlock();
+}
+
+// Send a command in the given slot, the data goes through the bounce buffer of the slot
+void issue_command(ahci::port_state& port, size_t slot, uint8_t command, uint64_t lba, size_t count, size_t bytes, bool write){
+    auto& state = port.slots[slot];
+    auto& header = port.command_list[slot];
+    auto* table = state.table;
+
+    std::fill_n(table->cfis, sizeof(table->cfis), 0);
+
+    auto* fis = table->cfis;
+    fis[0] = AHCI_FIS_REG_H2D;
+    fis[1] = 0x80; // This is a command
+    fis[2] = command;
+
+    if(command != AHCI_IDENTIFY){
+        fis[4] = lba & 0xFF;
+        fis[5] = (lba >> 8) & 0xFF;
+        fis[6] = (lba >> 16) & 0xFF;
+        fis[7] = 1 << 6; // LBA mode
+        fis[8] = (lba >> 24) & 0xFF;
+        fis[9] = (lba >> 32) & 0xFF;
+        fis[10] = (lba >> 40) & 0xFF;
+    }
+
+    if(command == AHCI_READ_FPDMA_QUEUED || command == AHCI_WRITE_FPDMA_QUEUED){
+        // With NCQ, the count is in the features and the tag in the count
+        fis[3] = count & 0xFF;
+        fis[11] = (count >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = count & 0xFF;
+        fis[13] = (count >> 8) & 0xFF;
+    }
+
+    table->prdt[0].dba = state.buffer_phys & 0xFFFFFFFF;
+    table->prdt[0].dbau = state.buffer_phys >> 32;
+    table->prdt[0].reserved = 0;
+    table->prdt[0].dbc = bytes - 1;
+
+    header.flags = 5 | (write ? 1 << 6 : 0); // The FIS is 5 dwords long
+    header.prdtl = 1;
+    header.prdbc = 0;
+
+    state.failed = false;
+    state.lock.claim();
+
+    direct_int_lock lock;
+
+    port.active |= 1U << slot;
+
+    if(port.ncq){
+        write_register(port, AHCI_PORT_SACT, 1U << slot);
+    }
+
+    write_register(port, AHCI_PORT_CI, 1U << slot);
+}
+
+// Wait for the completion of the command in the given slot
+bool wait_slot(ahci::port_state& port, size_t slot){
+    if(irq_mode && scheduler::is_started()){
+        port.slots[slot].lock.wait();
+    } else {
+        while(true){
+            {
+                direct_int_lock lock;
+
+                check_port(port);
+
+                if(!(port.active & (1U << slot))){
+                    break;
+                }
+            }
+
+            asm volatile ("pause");
+        }
+    }
+
+    return !port.slots[slot].failed;
+}
+
+using sector_operation = block_operation;
+
+uint8_t sectors_command(const ahci::port_state& port, sector_operation operation){
+    if(port.ncq){
+        return operation == sector_operation::READ ? AHCI_READ_FPDMA_QUEUED : AHCI_WRITE_FPDMA_QUEUED;
+    } else {
+        return operation == sector_operation::READ ? AHCI_READ_DMA_EXT : AHCI_WRITE_DMA_EXT;
+    }
+}
+
+// Complete the part of an asynchronous request in a slot, in the completion task
+void slot_done(block_io& command){
+    auto& state = *reinterpret_cast<slot_state*>(command.data);
+
+    auto* io = state.io;
+    auto result = command.result;
+
+    if(!result && io->operation == block_operation::READ){
+        std::copy_n(state.buffer, state.bytes, state.data);
+    }
+
+    state.io = nullptr;
+    release_slot(*state.port, state.index);
+
+    io->complete_part(result);
+}
+
+struct pending_command {
+    size_t slot;
+    char* data;
+    size_t bytes;
+};
+
+// Transfer count sectors, spreading the transfer over as many slots as possible
+bool read_write_sectors(ahci::drive_descriptor& drive, uint64_t start, size_t count, char* data, sector_operation operation){
+    auto& port = *drive.state;
+
+    std::array<pending_command, AHCI_MAX_SLOTS> pending;
+    size_t first = 0;
+    size_t inflight = 0;
+
+    bool success = true;
+
+    auto complete_oldest = [&]() {
+        auto& command = pending[first];
+
+        if(!wait_slot(port, command.slot)){
+            success = false;
+        } else if(operation == sector_operation::READ){
+            std::copy_n(port.slots[command.slot].buffer, command.bytes, command.data);
+        }
+
+        release_slot(port, command.slot);
+
+        first = (first + 1) % AHCI_MAX_SLOTS;
+        --inflight;
+    };
+
+    for(size_t done = 0; done < count && success; done += SLOT_MAX_SECTORS){
+        auto sectors = std::min(count - done, SLOT_MAX_SECTORS);
+        auto bytes = sectors * BLOCK_SIZE;
+
+        // Only block on the slots when no command of ours is in flight
+        size_t slot;
+        while(!try_acquire_slot(port, slot)){
+            if(inflight){
+                complete_oldest();
+            } else {
+                slot = acquire_slot(port);
+                break;
+            }
+        }
+
+        auto& state = port.slots[slot];
+
+        if(operation == sector_operation::WRITE){
+            std::copy_n(data + done * BLOCK_SIZE, bytes, state.buffer);
+        } else if(operation == sector_operation::CLEAR){
+            std::fill_n(state.buffer, bytes, 0);
+        }
+
+        issue_command(port, slot, sectors_command(port, operation), start + done, sectors, bytes, operation != sector_operation::READ);
+
+        pending[(first + inflight) % AHCI_MAX_SLOTS] = {slot, data ? data + done * BLOCK_SIZE : nullptr, bytes};
+        ++inflight;
+    }
+
+    while(inflight){
+        complete_oldest();
+    }
+
+    return success;
+}
+
+void ata_string_into(std::string& target, uint16_t* info, size_t start, size_t size){
+    char buffer[50];
+
+    //Copy the characters, swapping the bytes of each word
+    auto t = reinterpret_cast<char*>(&info[start]);
+    for(size_t i = 0; i < size; i += 2){
+        buffer[i] = t[i + 1];
+        buffer[i + 1] = t[i];
+    }
+
+    //Cleanup the output
+    size_t end = size;
+    while(end > 0 && (buffer[end - 1] <= 32 || buffer[end - 1] >= 127)){
+        --end;
+    }
+
+    buffer[end] = '\0';
+    target = buffer;
+}
+
+bool identify(ahci::drive_descriptor& drive){
+    auto& port = *drive.state;
+
+    auto slot = acquire_slot(port);
+
+    issue_command(port, slot, AHCI_IDENTIFY, 0, 0, BLOCK_SIZE, false);
+
+    if(!wait_slot(port, slot)){
+        release_slot(port, slot);
+        return false;
+    }
+
+    auto info = reinterpret_cast<uint16_t*>(port.slots[slot].buffer);
+
+    ata_string_into(drive.model, info, 27, 40);
+    ata_string_into(drive.serial, info, 10, 20);
+    ata_string_into(drive.firmware, info, 23, 8);
+
+    // AHCI disks always support 48-bit addressing
+    drive.size = *reinterpret_cast<uint64_t*>(&info[100]) * BLOCK_SIZE;
+
+    // Word 76 bit 8 indicates NCQ support, word 75 the queue depth
+    drive.ncq = hba_ncq && (info[76] & (1 << 8));
+    drive.queue_depth = drive.ncq ? std::min(size_t(hba_slots), size_t((info[75] & 0x1F) + 1)) : 1;
+
+    release_slot(port, slot);
+
+    return true;
+}
+
+bool init_port(ahci::drive_descriptor& drive, volatile uint32_t* registers){
+    auto* port = new ahci::port_state;
+
+    port->registers = registers;
+
+    if(!stop_port(*port)){
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to stop port %u\n", size_t(drive.port));
+        return false;
+    }
+
+    // The command list (1KiB) and the received FIS (256B) share one page
+    size_t list_phys;
+    auto list = allocate_dma(1, list_phys);
+
+    size_t tables_phys;
+    auto tables = allocate_dma(AHCI_MAX_SLOTS * COMMAND_TABLE_SIZE / paging::PAGE_SIZE, tables_phys);
+
+    if(!list || !tables){
+        return false;
+    }
+
+    port->command_list = reinterpret_cast<command_header_t*>(list);
+
+    for(size_t i = 0; i < hba_slots; ++i){
+        auto& slot = port->slots[i];
+
+        slot.port = port;
+        slot.index = i;
+        slot.table = reinterpret_cast<command_table_t*>(tables + i * COMMAND_TABLE_SIZE);
+        slot.buffer = allocate_dma(SLOT_BUFFER_PAGES, slot.buffer_phys);
+
+        if(!slot.buffer){
+            return false;
+        }
+
+        auto table_phys = tables_phys + i * COMMAND_TABLE_SIZE;
+        port->command_list[i].ctba = table_phys & 0xFFFFFFFF;
+        port->command_list[i].ctbau = table_phys >> 32;
+    }
+
+    write_register(*port, AHCI_PORT_CLB, list_phys & 0xFFFFFFFF);
+    write_register(*port, AHCI_PORT_CLBU, list_phys >> 32);
+    write_register(*port, AHCI_PORT_FB, (list_phys + 1024) & 0xFFFFFFFF);
+    write_register(*port, AHCI_PORT_FBU, (list_phys + 1024) >> 32);
+
+    write_register(*port, AHCI_PORT_SERR, 0xFFFFFFFF);
+    write_register(*port, AHCI_PORT_IS, 0xFFFFFFFF);
+
+    start_port(*port);
+
+    port->active = 0;
+    port->ncq = false;
+    port->slots_count = 1;
+    port->free_slots = 1;
+    port->slots_sem.init(1);
+
+    drive.state = port;
+
+    // Identify the disk with a single slot
+    if(!identify(drive)){
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to identify disk on port %u\n", size_t(drive.port));
+        return false;
+    }
+
+    // Open the queue to its full depth
+    port->ncq = drive.ncq;
+    port->slots_count = drive.queue_depth;
+    port->free_slots = drive.queue_depth == 32 ? 0xFFFFFFFF : (1U << drive.queue_depth) - 1;
+    port->slots_sem.init(drive.queue_depth);
+
+    write_register(*port, AHCI_PORT_IE, AHCI_PORT_IS_DHRS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_DSS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERRORS);
+
+    logging::logf(logging::log_level::TRACE, "ahci: Disk on port %u (size:%u ncq:%u depth:%u)\n",
+        size_t(drive.port), drive.size, size_t(drive.ncq), size_t(drive.queue_depth));
+
+    return true;
+}
+
+void init_controller(pci::device_descriptor& pci_device){
+    // Enable memory space and bus mastering
+    auto command_register = pci::read_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04);
+    pci::write_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04, command_register | 0x6);
+
+    // BAR5 is the AHCI Base Address (ABAR)
+    size_t abar_phys = pci::read_config_dword(pci_device.bus, pci_device.device, pci_device.function, 0x24) & ~0xF;
+
+    auto offset = abar_phys % paging::PAGE_SIZE;
+    auto pages = paging::pages(offset + AHCI_PORT_BASE + AHCI_MAX_PORTS * AHCI_PORT_SIZE);
+
+    auto virt = virtual_allocator::allocate(pages);
+    if(!paging::map_pages(virt, abar_phys - offset, pages, paging::PRESENT | paging::WRITE | paging::CACHE_DISABLED)){
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to map the HBA registers\n");
+        return;
+    }
+
+    abar = reinterpret_cast<volatile uint32_t*>(virt + offset);
+
+    // Switch to AHCI mode
+    abar[AHCI_GHC / 4] = abar[AHCI_GHC / 4] | AHCI_GHC_AE;
+
+    auto cap = abar[AHCI_CAP / 4];
+    s64a = cap & AHCI_CAP_S64A;
+    hba_ncq = cap & AHCI_CAP_SNCQ;
+    hba_slots = ((cap >> 8) & 0x1F) + 1;
+
+    auto implemented = abar[AHCI_PI / 4];
+
+    for(uint8_t i = 0; i < AHCI_MAX_PORTS; ++i){
+        if(!(implemented & (1U << i))){
+            continue;
+        }
+
+        auto registers = abar + (AHCI_PORT_BASE + i * AHCI_PORT_SIZE) / 4;
+
+        // A device must be present and the link established
+        auto ssts = registers[AHCI_PORT_SSTS / 4];
+        if((ssts & 0xF) != 3 || ((ssts >> 8) & 0xF) != 1){
+            continue;
+        }
+
+        // Only SATA disks are supported
+        if(registers[AHCI_PORT_SIG / 4] != AHCI_SIG_ATA){
+            continue;
+        }
+
+        auto& drive = drives[number_of_drives];
+        drive.port = i;
+
+        if(init_port(drive, registers)){
+            ++number_of_drives;
+        }
+    }
+
+    auto irq = pci::read_config_byte(pci_device.bus, pci_device.device, pci_device.function, 0x3C);
+
+    if(irq <= 15 && interrupt::register_irq_handler(irq, ahci_irq_handler, nullptr)){
+        irq_mode = true;
+    } else {
+        logging::logf(logging::log_level::ERROR, "ahci: Unable to register IRQ handler %u, polling\n", size_t(irq));
+    }
+
+    abar[AHCI_IS / 4] = 0xFFFFFFFF;
+    abar[AHCI_GHC / 4] = abar[AHCI_GHC / 4] | AHCI_GHC_IE;
+}
+
+} //end of anonymous namespace
+
+void ahci::detect_disks(){
+    drives = new drive_descriptor[AHCI_MAX_PORTS];
+
+    for(size_t i = 0; i < pci::number_of_devices(); ++i){
+        auto& pci_device = pci::device(i);
+
+        if(pci_device.class_type == pci::device_class_type::MASS_STORAGE && pci_device.sub_class == 0x6){
+            init_controller(pci_device);
+
+            // Only one controller is supported
+            return;
+        }
+    }
+}
+
+uint8_t ahci::number_of_disks(){
+    return number_of_drives;
+}
+
+ahci::drive_descriptor& ahci::drive(uint8_t disk){
+    return drives[disk];
+}
+
+size_t ahci::read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* target, size_t& read){
+    if(!read_write_sectors(drive, start, count, reinterpret_cast<char*>(target), sector_operation::READ)){
+        return std::ERROR_FAILED;
+    }
+
+    read += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t ahci::write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written){
+    auto buffer = reinterpret_cast<char*>(const_cast<void*>(source));
+
+    if(!read_write_sectors(drive, start, count, buffer, sector_operation::WRITE)){
+        return std::ERROR_FAILED;
+    }
+
+    written += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t ahci::clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written){
+    if(!read_write_sectors(drive, start, count, nullptr, sector_operation::CLEAR)){
+        return std::ERROR_FAILED;
+    }
+
+    written += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t ahci::ahci_driver::read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read){
+    verbose_logf(logging::log_level::TRACE, "ahci: read_sectors(start=%u, count=%u)\n", start, count);
+
+    return ahci::read_sectors(*reinterpret_cast<ahci::drive_descriptor*>(device), start, count, destination, read);
+}
+
+size_t ahci::ahci_driver::write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written){
+    return ahci::write_sectors(*reinterpret_cast<ahci::drive_descriptor*>(device), start, count, source, written);
+}
+
+size_t ahci::ahci_driver::clear_sectors(void* device, uint64_t start, size_t count, size_t& written){
+    return ahci::clear_sectors(*reinterpret_cast<ahci::drive_descriptor*>(device), start, count, written);
+}
+
+size_t ahci::ahci_driver::size(void* device){
+    return reinterpret_cast<ahci::drive_descriptor*>(device)->size;
+}
+
+void ahci::ahci_driver::submit(void* device, block_io& io){
+    auto& drive = *reinterpret_cast<ahci::drive_descriptor*>(device);
+
+    // Without interrupts, the commands are polled synchronously
+    if(!irq_mode || !scheduler::is_started()){
+        block_driver::submit(device, io);
+        return;
+    }
+
+    auto& port = *drive.state;
+
+    // Each slot completes one part of the request
+    io.split((io.count + SLOT_MAX_SECTORS - 1) / SLOT_MAX_SECTORS);
+
+    for(size_t done = 0; done < io.count; done += SLOT_MAX_SECTORS){
+        auto sectors = std::min(io.count - done, SLOT_MAX_SECTORS);
+        auto bytes = sectors * BLOCK_SIZE;
+
+        auto slot = acquire_slot(port);
+        auto& state = port.slots[slot];
+
+        state.data = io.buffer ? io.buffer + done * BLOCK_SIZE : nullptr;
+        state.bytes = bytes;
+
+        if(io.operation == block_operation::WRITE){
+            std::copy_n(state.data, bytes, state.buffer);
+        } else if(io.operation == block_operation::CLEAR){
+            std::fill_n(state.buffer, bytes, 0);
+        }
+
+        state.command.init(io.operation, io.sector + done, sectors, state.data, &slot_done, &state);
+        state.io = &io;
+
+        issue_command(port, slot, sectors_command(port, io.operation), io.sector + done, sectors, bytes, io.operation != block_operation::READ);
+    }
+}
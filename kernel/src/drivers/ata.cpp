@@ -11,6 +11,7 @@
 
 #include "drivers/ata.hpp"
 #include "drivers/ata_constants.hpp"
+#include "drivers/pci.hpp"
 
 #include "conc/mutex.hpp"
 #include "conc/deferred_unique_mutex.hpp"
@@ -21,7 +22,9 @@
 #include "interrupts.hpp"
 #include "console.hpp"
 #include "disks.hpp"
-#include "block_cache.hpp"
+#include "physical_allocator.hpp"
+#include "virtual_allocator.hpp"
+#include "paging.hpp"
 
 #ifdef THOR_CONFIG_ATA_VERBOSE
 #define verbose_logf(...) logging::logf(__VA_ARGS__)
@@ -33,19 +36,72 @@ namespace {
 
 static constexpr const size_t BLOCK_SIZE = 512;
 
-ata::drive_descriptor* drives;
+// Each channel has a 64KiB bounce buffer for the DMA transfers that cannot
+// use the buffer of the caller
+static constexpr const size_t DMA_BUFFER_PAGES = 16;
+static constexpr const size_t DMA_MAX_SECTORS = DMA_BUFFER_PAGES * paging::PAGE_SIZE / BLOCK_SIZE;
+
+// Physical Region Descriptor
+struct prd_t {
+    uint32_t address;
+    uint16_t bytes; ///< Size of the region (0 means 64KiB)
+    uint16_t flags;
+} __attribute__((packed));
+
+// Bus Master DMA state of one IDE channel
+struct dma_channel {
+    uint16_t iobase;     ///< The base of the bus master registers
+    prd_t* prdt;         ///< The Physical Region Descriptor Table (virtual)
+    size_t prdt_phys;    ///< The Physical Region Descriptor Table (physical)
+    char* buffer;        ///< The bounce buffer (virtual)
+    size_t buffer_phys;  ///< The bounce buffer (physical)
+    bool enabled;
+    bool direct;         ///< Indicates if the current command uses the buffer of the caller
+
+    mutex lock; ///< Serializes the commands of the channel, PIO or DMA
+
+    block_io* volatile io;       ///< The asynchronous request, nullptr for synchronous transfers
+    ata::drive_descriptor* drive; ///< The drive of the asynchronous request
+    size_t done;                  ///< The number of sectors already transferred
+    size_t run;                   ///< The number of sectors of the current command
+    block_io command;             ///< Completes the current command
+};
 
-mutex ata_lock;
+dma_channel dma_channels[2];
+
+ata::drive_descriptor* drives;
 
 deferred_unique_mutex primary_lock;
 deferred_unique_mutex secondary_lock;
 
-block_cache cache;
-
 volatile bool primary_invoked = false;
 volatile bool secondary_invoked = false;
 
+bool dma_stop(ata::drive_descriptor& drive);
+
+// Complete the asynchronous command of a channel, if any
+bool dma_interrupt(dma_channel& channel){
+    if(!channel.io){
+        return false;
+    }
+
+    // The engine did not raise this interrupt
+    if(!(in_byte(channel.iobase + BMIDE_STATUS) & BMIDE_STATUS_IRQ)){
+        return false;
+    }
+
+    channel.command.complete_from_irq(dma_stop(*channel.drive) ? 0 : std::ERROR_FAILED);
+
+    return true;
+}
+
+// An asynchronous command holds the channel lock, so no PIO command waits for
+// the interrupts received in the meantime
 void primary_controller_handler(interrupt::syscall_regs*, void*){
+    if(dma_interrupt(dma_channels[0]) || dma_channels[0].io){
+        return;
+    }
+
     if(scheduler::is_started()){
         primary_lock.notify();
     } else {
@@ -54,6 +110,10 @@ void primary_controller_handler(interrupt::syscall_regs*, void*){
 }
 
 void secondary_controller_handler(interrupt::syscall_regs*, void*){
+    if(dma_interrupt(dma_channels[1]) || dma_channels[1].io){
+        return;
+    }
+
     if(scheduler::is_started()){
         secondary_lock.notify();
     } else {
@@ -139,13 +199,53 @@ bool select_device(ata::drive_descriptor& drive){
     return true;
 }
 
-enum class sector_operation {
-    READ,
-    WRITE,
-    CLEAR
-};
+using sector_operation = block_operation;
+
+// Wait for the controller to signal the end of a data block
+void ata_wait_irq(uint16_t controller){
+    if(controller == ATA_PRIMARY){
+        ata_wait_irq_primary();
+    } else {
+        ata_wait_irq_secondary();
+    }
+}
+
+// Returns the maximum number of sectors that can be transferred with one command
+size_t max_sectors(const ata::drive_descriptor& drive){
+    if(drive.dma){
+        return drive.lba48 ? DMA_MAX_SECTORS : std::min(DMA_MAX_SECTORS, size_t(ATA_MAX_SECTORS_LBA28));
+    }
+
+    return drive.lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+}
+
+uint8_t sectors_command(const ata::drive_descriptor& drive, sector_operation operation){
+    if(operation == sector_operation::READ){
+        if(drive.multiple > 1){
+            return drive.lba48 ? ATA_READ_MULTIPLE_EXT : ATA_READ_MULTIPLE;
+        } else {
+            return drive.lba48 ? ATA_READ_BLOCK_EXT : ATA_READ_BLOCK;
+        }
+    } else {
+        if(drive.multiple > 1){
+            return drive.lba48 ? ATA_WRITE_MULTIPLE_EXT : ATA_WRITE_MULTIPLE;
+        } else {
+            return drive.lba48 ? ATA_WRITE_BLOCK_EXT : ATA_WRITE_BLOCK;
+        }
+    }
+}
+
+// Select the device and send a command addressing count sectors from start
+bool issue_command(ata::drive_descriptor& drive, uint64_t start, size_t count, uint8_t command){
+    if(!count || count > max_sectors(drive)){
+        return false;
+    }
+
+    //LBA28 can only address the first 128GiB of the disk
+    if(!drive.lba48 && start + count > (uint64_t(1) << 28)){
+        return false;
+    }
 
-bool read_write_sector(ata::drive_descriptor& drive, uint64_t start, void* data, sector_operation operation){
     //Select the device
     if(!select_device(drive)){
         return false;
@@ -153,61 +253,274 @@ bool read_write_sector(ata::drive_descriptor& drive, uint64_t start, void* data,
 
     auto controller = drive.controller;
 
-    uint8_t sc = start & 0xFF;
-    uint8_t cl = (start >> 8) & 0xFF;
-    uint8_t ch = (start >> 16) & 0xFF;
-    uint8_t hd = (start >> 24) & 0x0F;
+    if(drive.lba48){
+        //The high order bytes are written first (count of 0 means 65536 sectors)
+        out_byte(controller + ATA_NSECTOR, (count >> 8) & 0xFF);
+        out_byte(controller + ATA_SECTOR, (start >> 24) & 0xFF);
+        out_byte(controller + ATA_LCYL, (start >> 32) & 0xFF);
+        out_byte(controller + ATA_HCYL, (start >> 40) & 0xFF);
+
+        out_byte(controller + ATA_NSECTOR, count & 0xFF);
+        out_byte(controller + ATA_SECTOR, start & 0xFF);
+        out_byte(controller + ATA_LCYL, (start >> 8) & 0xFF);
+        out_byte(controller + ATA_HCYL, (start >> 16) & 0xFF);
+        out_byte(controller + ATA_DRV_HEAD, (1 << 6) | (drive.slave << 4));
+    } else {
+        uint8_t sc = start & 0xFF;
+        uint8_t cl = (start >> 8) & 0xFF;
+        uint8_t ch = (start >> 16) & 0xFF;
+        uint8_t hd = (start >> 24) & 0x0F;
 
-    auto command = operation == sector_operation::READ ? ATA_READ_BLOCK : ATA_WRITE_BLOCK;
+        //A count of 0 means 256 sectors
+        out_byte(controller + ATA_NSECTOR, count & 0xFF);
+        out_byte(controller + ATA_SECTOR, sc);
+        out_byte(controller + ATA_LCYL, cl);
+        out_byte(controller + ATA_HCYL, ch);
+        out_byte(controller + ATA_DRV_HEAD, (1 << 6) | (drive.slave << 4) | hd);
+    }
 
     //Process the command
-    out_byte(controller + ATA_NSECTOR, 1);
-    out_byte(controller + ATA_SECTOR, sc);
-    out_byte(controller + ATA_LCYL, cl);
-    out_byte(controller + ATA_HCYL, ch);
-    out_byte(controller + ATA_DRV_HEAD, (1 << 6) | (drive.slave << 4) | hd);
     out_byte(controller + ATA_COMMAND, command);
 
-    //Wait at most 30 seconds for BSY flag to be cleared
-    if(!wait_for_controller(controller, ATA_STATUS_BSY, 0, 30000)){
+    return true;
+}
+
+dma_channel& channel_of(const ata::drive_descriptor& drive){
+    return dma_channels[drive.controller == ATA_PRIMARY ? 0 : 1];
+}
+
+// Append a physical region to the PRDT, a region cannot cross a 64KiB boundary
+void prdt_append(dma_channel& channel, size_t& prd, size_t address, size_t bytes){
+    while(bytes){
+        auto size = std::min(bytes, 0x10000 - (address & 0xFFFF));
+
+        channel.prdt[prd].address = address;
+        channel.prdt[prd].bytes = size & 0xFFFF;
+        channel.prdt[prd].flags = 0;
+
+        address += size;
+        bytes -= size;
+        ++prd;
+    }
+}
+
+// Fill the PRDT with the physical pages of the buffer of the caller
+// Returns false if the controller cannot transfer directly to the buffer
+bool prdt_direct(dma_channel& channel, const void* data, size_t bytes){
+    auto address = reinterpret_cast<size_t>(data);
+
+    // Only the kernel memory is mapped in every process, a user buffer may not
+    // be mapped when the completion task starts the next command
+    if(!data || (address & 1) || address + bytes > virtual_allocator::kernel_virtual_size){
+        return false;
+    }
+
+    size_t prd = 0;
+    for(size_t offset = 0; offset < bytes;){
+        auto virt = address + offset;
+        auto page_offset = virt & (paging::PAGE_SIZE - 1);
+        auto size = std::min(bytes - offset, paging::PAGE_SIZE - page_offset);
+
+        // The controller only addresses the first 4GiB of physical memory
+        auto physical = paging::physical_address(paging::page_align(virt));
+        if(!physical || physical + paging::PAGE_SIZE > 0x100000000){
+            return false;
+        }
+
+        prdt_append(channel, prd, physical + page_offset, size);
+
+        offset += size;
+    }
+
+    channel.prdt[prd - 1].flags = BMIDE_PRD_EOT;
+
+    return true;
+}
+
+// Start a bus master DMA command for count contiguous sectors
+// The data is transferred directly from and to the buffer of the caller when
+// possible, through the bounce buffer of the channel otherwise. The CPU is
+// free during the transfer
+bool dma_start(ata::drive_descriptor& drive, uint64_t start, size_t count, const void* data, sector_operation operation){
+    auto& channel = channel_of(drive);
+
+    auto bytes = count * BLOCK_SIZE;
+
+    channel.direct = operation != sector_operation::CLEAR && prdt_direct(channel, data, bytes);
+
+    if(!channel.direct){
+        size_t prd = 0;
+        prdt_append(channel, prd, channel.buffer_phys, bytes);
+        channel.prdt[prd - 1].flags = BMIDE_PRD_EOT;
+
+        if(operation == sector_operation::WRITE){
+            std::copy_n(reinterpret_cast<const char*>(data), bytes, channel.buffer);
+        } else if(operation == sector_operation::CLEAR){
+            std::fill_n(channel.buffer, bytes, 0);
+        }
+    }
+
+    // Stop the engine, clear the status and set the PRDT
+    out_byte(channel.iobase + BMIDE_COMMAND, 0);
+    out_byte(channel.iobase + BMIDE_STATUS, BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+    out_dword(channel.iobase + BMIDE_PRDT, channel.prdt_phys);
+
+    uint8_t direction = operation == sector_operation::READ ? BMIDE_CMD_READ : 0;
+    out_byte(channel.iobase + BMIDE_COMMAND, direction);
+
+    uint8_t command;
+    if(operation == sector_operation::READ){
+        command = drive.lba48 ? ATA_READ_DMA_EXT : ATA_READ_DMA;
+    } else {
+        command = drive.lba48 ? ATA_WRITE_DMA_EXT : ATA_WRITE_DMA;
+    }
+
+    if(!issue_command(drive, start, count, command)){
         return false;
     }
 
+    // Start the transfer
+    out_byte(channel.iobase + BMIDE_COMMAND, direction | BMIDE_CMD_START);
+
+    return true;
+}
+
+// Stop the engine after the interrupt of a DMA command
+// Returns false if the transfer failed
+bool dma_stop(ata::drive_descriptor& drive){
+    auto& channel = channel_of(drive);
+
+    // Stop the engine and acknowledge the interrupt
+    out_byte(channel.iobase + BMIDE_COMMAND, 0);
+    auto dma_status = in_byte(channel.iobase + BMIDE_STATUS);
+    out_byte(channel.iobase + BMIDE_STATUS, BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+
     //Verify if there are errors
-    if(in_byte(controller + ATA_STATUS) & ATA_STATUS_ERR){
+    return !(dma_status & BMIDE_STATUS_ERR) && !(in_byte(drive.controller + ATA_STATUS) & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+// Transfer count contiguous sectors with a bus master DMA command
+bool dma_read_write_sectors(ata::drive_descriptor& drive, uint64_t start, size_t count, void* data, sector_operation operation){
+    if(!dma_start(drive, start, count, data, operation)){
         return false;
     }
 
-    uint16_t* buffer = reinterpret_cast<uint16_t*>(data);
+    //Wait the IRQ to happen
+    ata_wait_irq(drive.controller);
+
+    if(!dma_stop(drive)){
+        return false;
+    }
+
+    auto& channel = channel_of(drive);
+
+    if(operation == sector_operation::READ && !channel.direct){
+        std::copy_n(channel.buffer, count * BLOCK_SIZE, reinterpret_cast<char*>(data));
+    }
+
+    return true;
+}
+
+// Start the next DMA command of the asynchronous request of the channel
+bool dma_next(dma_channel& channel);
 
-    if(operation == sector_operation::WRITE){
-        //Send the data to the controller
-        for(int i = 0; i < 256; ++i){
-            out_word(controller + ATA_DATA, *buffer++);
+// Complete a DMA command of an asynchronous request, in the completion task
+void dma_done(block_io& command){
+    auto& channel = *reinterpret_cast<dma_channel*>(command.data);
+
+    auto* io = channel.io;
+    auto result = command.result;
+
+    if(!result){
+        if(io->operation == sector_operation::READ && !channel.direct){
+            std::copy_n(channel.buffer, channel.run * BLOCK_SIZE, io->buffer + channel.done * BLOCK_SIZE);
         }
-    } else if(operation == sector_operation::CLEAR){
-        //Send the data to the controller
-        for(int i = 0; i < 256; ++i){
-            out_word(controller + ATA_DATA, 0);
+
+        channel.done += channel.run;
+
+        // The lock is kept until the whole request is transferred
+        if(channel.done < io->count){
+            if(dma_next(channel)){
+                return;
+            }
+
+            result = std::ERROR_FAILED;
         }
     }
 
-    //Wait the IRQ to happen
-    if(controller == ATA_PRIMARY){
-        ata_wait_irq_primary();
-    } else {
-        ata_wait_irq_secondary();
+    channel.io = nullptr;
+    channel.lock.unlock();
+
+    io->complete(result);
+}
+
+bool dma_next(dma_channel& channel){
+    auto& drive = *channel.drive;
+    auto* io = channel.io;
+
+    channel.run = std::min(io->count - channel.done, max_sectors(drive));
+    channel.command.init(io->operation, io->sector + channel.done, channel.run, nullptr, &dma_done, &channel);
+
+    auto data = io->buffer ? io->buffer + channel.done * BLOCK_SIZE : nullptr;
+
+    return dma_start(drive, io->sector + channel.done, channel.run, data, io->operation);
+}
+
+// Transfer count contiguous sectors with a single command
+// The device interrupts once per DRQ block (drive.multiple sectors)
+bool read_write_sectors(ata::drive_descriptor& drive, uint64_t start, size_t count, void* data, sector_operation operation){
+    if(drive.dma){
+        return dma_read_write_sectors(drive, start, count, data, operation);
     }
 
-    //The device can report an error after the IRQ
-    if(in_byte(controller + ATA_STATUS) & ATA_STATUS_ERR){
+    if(!issue_command(drive, start, count, sectors_command(drive, operation))){
         return false;
     }
 
-    if(operation == sector_operation::READ){
-        //Read the disk sectors
-        for(int i = 0; i < 256; ++i){
-            *buffer++ = in_word(controller + ATA_DATA);
+    auto controller = drive.controller;
+
+    uint16_t* buffer = reinterpret_cast<uint16_t*>(data);
+
+    size_t block = drive.multiple > 1 ? drive.multiple : 1;
+
+    for(size_t done = 0; done < count; done += block){
+        auto words = std::min(block, count - done) * 256;
+
+        //Wait at most 30 seconds for BSY flag to be cleared
+        if(!wait_for_controller(controller, ATA_STATUS_BSY, 0, 30000)){
+            return false;
+        }
+
+        //Verify if there are errors
+        if(in_byte(controller + ATA_STATUS) & ATA_STATUS_ERR){
+            return false;
+        }
+
+        if(operation == sector_operation::WRITE){
+            //Send the data to the controller
+            for(size_t i = 0; i < words; ++i){
+                out_word(controller + ATA_DATA, *buffer++);
+            }
+        } else if(operation == sector_operation::CLEAR){
+            //Send the data to the controller
+            for(size_t i = 0; i < words; ++i){
+                out_word(controller + ATA_DATA, 0);
+            }
+        }
+
+        //Wait the IRQ to happen
+        ata_wait_irq(controller);
+
+        //The device can report an error after the IRQ
+        if(in_byte(controller + ATA_STATUS) & ATA_STATUS_ERR){
+            return false;
+        }
+
+        if(operation == sector_operation::READ){
+            //Read the disk sectors
+            for(size_t i = 0; i < words; ++i){
+                *buffer++ = in_word(controller + ATA_DATA);
+            }
         }
     }
 
@@ -271,6 +584,62 @@ void ide_string_into(std::string& target, uint16_t* info, size_t start, size_t s
     target = buffer;
 }
 
+// Configure the number of sectors per DRQ block for READ/WRITE MULTIPLE
+void set_multiple_mode(ata::drive_descriptor& drive){
+    if(drive.multiple <= 1){
+        drive.multiple = 1;
+        return;
+    }
+
+    if(!select_device(drive)){
+        drive.multiple = 1;
+        return;
+    }
+
+    out_byte(drive.controller + ATA_NSECTOR, drive.multiple);
+    out_byte(drive.controller + ATA_COMMAND, ATA_SET_MULTIPLE);
+
+    //Fall back to single-sector transfers if the device refuses
+    if(!wait_for_controller(drive.controller, ATA_STATUS_BSY, 0, 10000) || (in_byte(drive.controller + ATA_STATUS) & ATA_STATUS_ERR)){
+        drive.multiple = 1;
+        return;
+    }
+
+    logging::logf(logging::log_level::TRACE, "ata: Using %u sectors per DRQ block \n", size_t(drive.multiple));
+}
+
+// Returns the highest mode of the given bit set of supported modes
+uint8_t highest_mode(uint16_t modes){
+    uint8_t mode = 0;
+
+    while(modes >>= 1){
+        ++mode;
+    }
+
+    return mode;
+}
+
+// Set the DMA transfer mode of the drive with SET FEATURES
+// The timings of the controller are left as configured by the firmware
+bool set_dma_mode(ata::drive_descriptor& drive){
+    if(!select_device(drive)){
+        return false;
+    }
+
+    out_byte(drive.controller + ATA_FEATURES, ATA_FEATURE_TRANSFER_MODE);
+    out_byte(drive.controller + ATA_NSECTOR, drive.dma_mode);
+    out_byte(drive.controller + ATA_COMMAND, ATA_SET_FEATURES);
+
+    if(!wait_for_controller(drive.controller, ATA_STATUS_BSY, 0, 10000) || (in_byte(drive.controller + ATA_STATUS) & ATA_STATUS_ERR)){
+        logging::logf(logging::log_level::ERROR, "ata: The drive refused the DMA mode %h\n", size_t(drive.dma_mode));
+        return false;
+    }
+
+    logging::logf(logging::log_level::TRACE, "ata: Using DMA mode %h\n", size_t(drive.dma_mode));
+
+    return true;
+}
+
 void identify(ata::drive_descriptor& drive){
     //First, test that the ATA controller of this drive is enabled
     //For that, test if data is resilient on the port
@@ -336,273 +705,263 @@ void identify(ata::drive_descriptor& drive){
         info[b] = in_word(drive.controller + ATA_DATA);
     }
 
-    //INFO: LBA and DMA feature can be tested here
-
     ide_string_into(drive.model, info, 27, 40);
     ide_string_into(drive.serial, info, 10, 20);
     ide_string_into(drive.firmware, info, 23, 8);
 
-    // Get the size of the disk
-    size_t sectors = *reinterpret_cast<uint32_t*>(reinterpret_cast<size_t>(&info[0]) + 114);
-    drive.size = sectors * BLOCK_SIZE;
+    // Word 49 bit 8 indicates DMA support
+    drive.dma = !drive.atapi && (info[49] & (1 << 8));
 
-    logging::logf(logging::log_level::TRACE, "ata: Identified disk of size: %u \n", drive.size);
-}
+    // Word 88 has the supported Ultra DMA modes, valid if word 53 bit 2 is set.
+    // The modes above 2 need the 80-conductor cable indicated by word 93 bit 13.
+    // Word 63 has the supported multiword DMA modes
+    uint16_t udma_modes = (info[53] & (1 << 2)) ? info[88] & ((info[93] & (1 << 13)) ? 0x7F : 0x07) : 0;
+    uint16_t mwdma_modes = info[63] & 0x07;
 
-} //end of anonymous namespace
-
-void ata::detect_disks(){
-    ata_lock.init();
-
-    // Init the cache with 256 blocks
-    cache.init(BLOCK_SIZE, 256);
-
-    drives = new drive_descriptor[4];
-
-    drives[0] = {ATA_PRIMARY, 0xE0, false, MASTER_BIT, false, "", "", "", 0};
-    drives[1] = {ATA_PRIMARY, 0xF0, false, SLAVE_BIT, false, "", "", "", 0};
-    drives[2] = {ATA_SECONDARY, 0xE0, false, MASTER_BIT, false, "", "", "", 0};
-    drives[3] = {ATA_SECONDARY, 0xF0, false, SLAVE_BIT, false, "", "", "", 0};
-
-    out_byte(ATA_PRIMARY + ATA_DEV_CTL, ATA_CTL_nIEN);
-    out_byte(ATA_SECONDARY + ATA_DEV_CTL, ATA_CTL_nIEN);
-
-    for(uint8_t i = 0; i < 4; ++i){
-        auto& drive = drives[i];
-
-        identify(drive);
+    if(udma_modes){
+        drive.dma_mode = ATA_MODE_UDMA | highest_mode(udma_modes);
+    } else if(mwdma_modes){
+        drive.dma_mode = ATA_MODE_MWDMA | highest_mode(mwdma_modes);
+    } else {
+        drive.dma = false;
     }
 
-    out_byte(ATA_PRIMARY + ATA_DEV_CTL, 0);
-    out_byte(ATA_SECONDARY + ATA_DEV_CTL, 0);
+    // Word 83 bit 10 indicates support for the 48-bit feature set
+    drive.lba48 = info[83] & (1 << 10);
 
-    if(!interrupt::register_irq_handler(14, primary_controller_handler, nullptr)){
-        logging::logf(logging::log_level::ERROR, "ata: Unable to register IRQ handler 14\n");
+    // Get the size of the disk, words 100-103 (LBA48) or 60-61, least significant first
+    size_t sectors;
+    if(drive.lba48){
+        sectors = uint64_t(info[100]) | uint64_t(info[101]) << 16 | uint64_t(info[102]) << 32 | uint64_t(info[103]) << 48;
+    } else {
+        sectors = uint64_t(info[60]) | uint64_t(info[61]) << 16;
     }
 
-    if(!interrupt::register_irq_handler(15, secondary_controller_handler, nullptr)){
-        logging::logf(logging::log_level::ERROR, "ata: Unable to register IRQ handler 15\n");
-    }
-}
+    drive.size = sectors * BLOCK_SIZE;
 
-uint8_t ata::number_of_disks(){
-    return 4;
-}
+    // Word 47 indicates the maximum number of sectors per DRQ block
+    drive.multiple = drive.atapi ? 1 : info[47] & 0xFF;
 
-ata::drive_descriptor& ata::drive(uint8_t disk){
-    return drives[disk];
+    logging::logf(logging::log_level::TRACE, "ata: Identified disk of size: %u \n", drive.size);
 }
 
-size_t ata::ata_driver::read(void* data, char* target, size_t count, size_t offset, size_t& read){
-    verbose_logf(logging::log_level::TRACE, "ata: read(target=%p, count=%d, offset=%d)\n", target, count, offset);
+bool init_dma_channel(dma_channel& channel, uint16_t iobase){
+    channel.iobase = iobase;
 
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
-    }
+    // The PRDT and the buffer must be in the first 4GiB of physical memory
+    channel.prdt_phys = physical_allocator::allocate(1);
+    channel.buffer_phys = physical_allocator::allocate(DMA_BUFFER_PAGES);
 
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
+    if(!channel.prdt_phys || !channel.buffer_phys){
+        logging::logf(logging::log_level::ERROR, "ata: Unable to allocate DMA memory\n");
+        return false;
     }
 
-    read = 0;
-
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
-
-    auto descriptor = reinterpret_cast<disks::disk_descriptor*>(data);
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
-
-    return ata::read_sectors(*disk, start, sectors, target, read);
-}
-
-size_t ata::ata_driver::write(void* data, const char* source, size_t count, size_t offset, size_t& written){
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
+    if(channel.prdt_phys + paging::PAGE_SIZE > 0x100000000 || channel.buffer_phys + DMA_BUFFER_PAGES * paging::PAGE_SIZE > 0x100000000){
+        logging::logf(logging::log_level::ERROR, "ata: DMA memory is not addressable by the controller\n");
+        return false;
     }
 
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
+    auto prdt_virt = virtual_allocator::allocate(1);
+    if(!paging::map_pages(prdt_virt, channel.prdt_phys, 1)){
+        logging::logf(logging::log_level::ERROR, "ata: Unable to map the PRDT\n");
+        return false;
     }
 
-    written = 0;
-
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
+    auto buffer_virt = virtual_allocator::allocate(DMA_BUFFER_PAGES);
+    if(!paging::map_pages(buffer_virt, channel.buffer_phys, DMA_BUFFER_PAGES)){
+        logging::logf(logging::log_level::ERROR, "ata: Unable to map the DMA buffer\n");
+        return false;
+    }
 
-    auto descriptor = reinterpret_cast<disks::disk_descriptor*>(data);
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
+    channel.prdt = reinterpret_cast<prd_t*>(prdt_virt);
+    channel.buffer = reinterpret_cast<char*>(buffer_virt);
+    channel.enabled = true;
 
-    return ata::write_sectors(*disk, start, sectors, source, written);
+    return true;
 }
 
-size_t ata::ata_driver::clear(void* data, size_t count, size_t offset, size_t& written){
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
-    }
-
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
-    }
-
-    written = 0;
+// Find the PCI IDE controller and prepare its bus master engine
+void init_dma(){
+    for(size_t i = 0; i < pci::number_of_devices(); ++i){
+        auto& pci_device = pci::device(i);
 
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
+        if(pci_device.class_type != pci::device_class_type::MASS_STORAGE || pci_device.sub_class != 0x1){
+            continue;
+        }
 
-    auto descriptor = reinterpret_cast<disks::disk_descriptor*>(data);
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
+        // Bit 7 of the programming interface indicates bus master support
+        auto prog_if = pci::read_config_byte(pci_device.bus, pci_device.device, pci_device.function, 0x09);
+        if(!(prog_if & 0x80)){
+            continue;
+        }
 
-    return ata::clear_sectors(*disk, start, sectors, written);
-}
+        // BAR4 is the I/O base of the bus master registers
+        auto bar4 = pci::read_config_dword(pci_device.bus, pci_device.device, pci_device.function, 0x20);
+        if(!(bar4 & 0x1)){
+            continue;
+        }
 
-size_t ata::ata_driver::size(void* data){
-    auto descriptor = reinterpret_cast<disks::disk_descriptor*>(data);
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
+        uint16_t iobase = bar4 & ~0x3;
 
-    return disk->size;
-}
+        // Enable I/O space and bus mastering
+        auto command_register = pci::read_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04);
+        pci::write_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04, command_register | 0x5);
 
-size_t ata::ata_part_driver::read(void* data, char* target, size_t count, size_t offset, size_t& read){
-    verbose_logf(logging::log_level::TRACE, "ata_part: read(target=%p, count=%d, offset=%d)\n", target, count, offset);
+        logging::logf(logging::log_level::TRACE, "ata: Bus master IDE at %h\n", size_t(iobase));
 
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
-    }
+        init_dma_channel(dma_channels[0], iobase);
+        init_dma_channel(dma_channels[1], iobase + BMIDE_SECONDARY);
 
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
+        return;
     }
+}
 
-    read = 0;
-
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
+} //end of anonymous namespace
 
-    auto part_descriptor = reinterpret_cast<disks::partition_descriptor*>(data);
-    auto descriptor = part_descriptor->disk;
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
+void ata::detect_disks(){
+    dma_channels[0].lock.init();
+    dma_channels[1].lock.init();
 
-    start += part_descriptor->start;
+    drives = new drive_descriptor[4];
 
-    return ata::read_sectors(*disk, start, sectors, target, read);
-}
+    init_dma();
 
-size_t ata::ata_part_driver::write(void* data, const char* source, size_t count, size_t offset, size_t& written){
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
-    }
+    drives[0] = {ATA_PRIMARY, 0xE0, false, MASTER_BIT, false, "", "", "", 0, false, 1, false, 0};
+    drives[1] = {ATA_PRIMARY, 0xF0, false, SLAVE_BIT, false, "", "", "", 0, false, 1, false, 0};
+    drives[2] = {ATA_SECONDARY, 0xE0, false, MASTER_BIT, false, "", "", "", 0, false, 1, false, 0};
+    drives[3] = {ATA_SECONDARY, 0xF0, false, SLAVE_BIT, false, "", "", "", 0, false, 1, false, 0};
 
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
-    }
+    out_byte(ATA_PRIMARY + ATA_DEV_CTL, ATA_CTL_nIEN);
+    out_byte(ATA_SECONDARY + ATA_DEV_CTL, ATA_CTL_nIEN);
 
-    written = 0;
+    for(uint8_t i = 0; i < 4; ++i){
+        auto& drive = drives[i];
 
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
+        identify(drive);
 
-    auto part_descriptor = reinterpret_cast<disks::partition_descriptor*>(data);
-    auto descriptor = part_descriptor->disk;
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
+        if(drive.present && !drive.atapi){
+            set_multiple_mode(drive);
 
-    start += part_descriptor->start;
+            // Only use DMA if the bus master engine of the channel is ready
+            // and the drive accepts the transfer mode
+            drive.dma = drive.dma && channel_of(drive).enabled && set_dma_mode(drive);
+        }
+    }
 
-    return ata::write_sectors(*disk, start, sectors, source, written);
-}
+    out_byte(ATA_PRIMARY + ATA_DEV_CTL, 0);
+    out_byte(ATA_SECONDARY + ATA_DEV_CTL, 0);
 
-size_t ata::ata_part_driver::clear(void* data, size_t count, size_t offset, size_t& written){
-    if(count % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_COUNT;
+    if(!interrupt::register_irq_handler(14, primary_controller_handler, nullptr)){
+        logging::logf(logging::log_level::ERROR, "ata: Unable to register IRQ handler 14\n");
     }
 
-    if(offset % BLOCK_SIZE != 0){
-        return std::ERROR_INVALID_OFFSET;
+    if(!interrupt::register_irq_handler(15, secondary_controller_handler, nullptr)){
+        logging::logf(logging::log_level::ERROR, "ata: Unable to register IRQ handler 15\n");
     }
+}
 
-    written = 0;
-
-    auto sectors = count / BLOCK_SIZE;
-    auto start = offset / BLOCK_SIZE;
-
-    auto part_descriptor = reinterpret_cast<disks::partition_descriptor*>(data);
-    auto descriptor = part_descriptor->disk;
-    auto disk = reinterpret_cast<ata::drive_descriptor*>(descriptor->descriptor);
-
-    start += part_descriptor->start;
+uint8_t ata::number_of_disks(){
+    return 4;
+}
 
-    return ata::clear_sectors(*disk, start, sectors, written);
+ata::drive_descriptor& ata::drive(uint8_t disk){
+    return drives[disk];
 }
 
-size_t ata::read_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, void* target, size_t& read){
+size_t ata::read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* target, size_t& read){
     auto buffer = reinterpret_cast<uint8_t*>(target);
 
-    for(size_t i = 0; i < count; ++i){
-        std::lock_guard<decltype(ata_lock)> lock(ata_lock);
+    std::lock_guard<mutex> lock(channel_of(drive).lock);
 
-        bool valid;
-        auto block = cache.block((drive.controller << 8) + drive.drive, start + i, valid);
+    for(size_t i = 0; i < count; i += max_sectors(drive)){
+        auto run = std::min(count - i, max_sectors(drive));
 
-        if(!valid){
-            if(!read_write_sector(drive, start + i, block, sector_operation::READ)){
-                return std::ERROR_FAILED;
-            }
+        // Read the whole run with a single command, directly in the output buffer
+        if(!read_write_sectors(drive, start + i, run, buffer + i * BLOCK_SIZE, sector_operation::READ)){
+            return std::ERROR_FAILED;
         }
 
-        // Copy the block to the output buffer
-        std::copy_n(block, BLOCK_SIZE, buffer);
-
-        buffer += BLOCK_SIZE;
-        read += BLOCK_SIZE;
+        read += run * BLOCK_SIZE;
     }
 
     return 0;
 }
 
-size_t ata::write_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, const void* source, size_t& written){
+size_t ata::write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written){
     auto buffer = reinterpret_cast<uint8_t*>(const_cast<void*>(source));
 
-    for(size_t i = 0; i < count; ++i){
-        std::lock_guard<decltype(ata_lock)> lock(ata_lock);
+    std::lock_guard<mutex> lock(channel_of(drive).lock);
 
-        // If the block is in cache, simply update the cache and write through the disk
-        auto block = cache.block_if_present((drive.controller << 8) + drive.drive, start + i);
-        if(block){
-            std::copy_n(buffer, BLOCK_SIZE, block);
-        }
+    for(size_t i = 0; i < count; i += max_sectors(drive)){
+        auto run = std::min(count - i, max_sectors(drive));
 
-        if(!read_write_sector(drive, start + i, buffer, sector_operation::WRITE)){
+        if(!read_write_sectors(drive, start + i, run, buffer + i * BLOCK_SIZE, sector_operation::WRITE)){
             return std::ERROR_FAILED;
         }
 
-        buffer += BLOCK_SIZE;
-        written += BLOCK_SIZE;
+        written += run * BLOCK_SIZE;
     }
 
     return 0;
 }
 
-size_t ata::clear_sectors(drive_descriptor& drive, uint64_t start, uint8_t count, size_t& written){
-    for(size_t i = 0; i < count; ++i){
-        std::lock_guard<decltype(ata_lock)> lock(ata_lock);
+size_t ata::clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written){
+    std::lock_guard<mutex> lock(channel_of(drive).lock);
 
-        // If the block is in cache, simply update the cache and write through the disk
-        auto block = cache.block_if_present((drive.controller << 8) + drive.drive, start + i);
-        if(block){
-            std::fill_n(block, BLOCK_SIZE, 0);
-        }
+    for(size_t i = 0; i < count; i += max_sectors(drive)){
+        auto run = std::min(count - i, max_sectors(drive));
 
-        if(!read_write_sector(drive, start + i, nullptr, sector_operation::CLEAR)){
+        if(!read_write_sectors(drive, start + i, run, nullptr, sector_operation::CLEAR)){
             return std::ERROR_FAILED;
         }
 
-        written += BLOCK_SIZE;
+        written += run * BLOCK_SIZE;
     }
 
     return 0;
 }
 
-size_t ata::ata_part_driver::size(void* data){
-    auto part_descriptor = reinterpret_cast<disks::partition_descriptor*>(data);
+size_t ata::ata_driver::read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read){
+    verbose_logf(logging::log_level::TRACE, "ata: read_sectors(start=%u, count=%u)\n", start, count);
+
+    return ata::read_sectors(*reinterpret_cast<ata::drive_descriptor*>(device), start, count, destination, read);
+}
+
+size_t ata::ata_driver::write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written){
+    return ata::write_sectors(*reinterpret_cast<ata::drive_descriptor*>(device), start, count, source, written);
+}
+
+size_t ata::ata_driver::clear_sectors(void* device, uint64_t start, size_t count, size_t& written){
+    return ata::clear_sectors(*reinterpret_cast<ata::drive_descriptor*>(device), start, count, written);
+}
+
+size_t ata::ata_driver::size(void* device){
+    return reinterpret_cast<ata::drive_descriptor*>(device)->size;
+}
+
+void ata::ata_driver::submit(void* device, block_io& io){
+    auto& drive = *reinterpret_cast<ata::drive_descriptor*>(device);
+
+    // PIO transfers are done synchronously
+    if(!drive.dma || !scheduler::is_started()){
+        block_driver::submit(device, io);
+        return;
+    }
+
+    auto& channel = channel_of(drive);
 
-    return part_descriptor->sectors * BLOCK_SIZE;
+    // The lock is released by the completion of the last command
+    channel.lock.lock();
+
+    channel.drive = &drive;
+    channel.done = 0;
+    channel.io = &io;
+
+    if(!dma_next(channel)){
+        channel.io = nullptr;
+        channel.lock.unlock();
+
+        io.complete(std::ERROR_FAILED);
+    }
 }
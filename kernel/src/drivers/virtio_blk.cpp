@@ -0,0 +1,630 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <array.hpp>
+
+#include <tlib/errors.hpp>
+
+#include "drivers/virtio_blk.hpp"
+#include "drivers/virtio_constants.hpp"
+#include "drivers/pci.hpp"
+
+#include "conc/semaphore.hpp"
+#include "conc/int_lock.hpp"
+#include "conc/deferred_unique_mutex.hpp"
+
+#include "kernel_utils.hpp"
+#include "logging.hpp"
+#include "interrupts.hpp"
+#include "scheduler.hpp"
+#include "physical_allocator.hpp"
+#include "virtual_allocator.hpp"
+#include "paging.hpp"
+
+#ifdef THOR_CONFIG_VIRTIO_VERBOSE
+#define verbose_logf(...) logging::logf(__VA_ARGS__)
+#else
+#define verbose_logf(...)
+#endif
+
+namespace {
+
+static constexpr const size_t BLOCK_SIZE = 512;
+static constexpr const size_t MAX_DISKS = 4;
+
+// Each request slot has a bounce buffer made of (non-contiguous) pages
+static constexpr const size_t SLOT_PAGES = 8;
+static constexpr const size_t MAX_SLOTS = 16;
+
+// Each request uses a header, its data segments and a status
+static constexpr const size_t SLOT_DESCRIPTORS = SLOT_PAGES + 2;
+
+struct virtq_desc {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+// Header of the available ring (followed by the ring entries)
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t index;
+} __attribute__((packed));
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t length;
+} __attribute__((packed));
+
+// Header of the used ring (followed by the ring entries)
+struct virtq_used {
+    uint16_t flags;
+    volatile uint16_t index;
+} __attribute__((packed));
+
+struct request_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+struct slot_state {
+    deferred_unique_mutex lock; ///< Used to wait for the completion
+    volatile bool done;         ///< Indicates if the request is complete
+    request_header* header;     ///< The request header (followed by the status byte)
+    size_t header_phys;
+    char* buffer;               ///< The bounce buffer (virtual, contiguous)
+    size_t pages_phys[SLOT_PAGES]; ///< The physical pages of the bounce buffer
+
+    virtio_blk::drive_descriptor* drive; ///< The drive of the slot
+    size_t index;                        ///< The index of the slot
+
+    block_io* io = nullptr; ///< The asynchronous request, nullptr for synchronous transfers
+    char* data;             ///< The data of the asynchronous request in this slot
+    size_t bytes;           ///< The number of bytes of the asynchronous request in this slot
+    block_io command;       ///< Completes the part of the asynchronous request
+};
+
+} //end of anonymous namespace
+
+struct virtio_blk::queue_state {
+    virtq_desc* descriptors;
+    virtq_avail* avail;
+    uint16_t* avail_ring;
+    virtq_used* used;
+    volatile virtq_used_elem* used_ring;
+    uint16_t last_used; ///< The last used index processed by the driver
+
+    slot_state slots[MAX_SLOTS];
+    size_t slot_pages;  ///< The number of pages usable by one request
+
+    semaphore slots_sem;          ///< Count of the free slots
+    volatile uint32_t free_slots; ///< Bitmask of the free slots
+};
+
+namespace {
+
+virtio_blk::drive_descriptor drives[MAX_DISKS];
+uint8_t number_of_drives = 0;
+
+// A zero page shared by all the clear requests
+size_t zero_page_phys;
+
+size_t queue_bytes(size_t queue_size){
+    auto first = sizeof(virtq_desc) * queue_size + sizeof(uint16_t) * (3 + queue_size);
+    auto second = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem) * queue_size;
+
+    return paging::pages(first) * paging::PAGE_SIZE + paging::pages(second) * paging::PAGE_SIZE;
+}
+
+// Collect the completed requests, must be called with interrupts disabled
+uint32_t process_used(virtio_blk::queue_state& queue, uint16_t queue_size){
+    uint32_t completed = 0;
+
+    while(queue.last_used != queue.used->index){
+        auto& element = queue.used_ring[queue.last_used % queue_size];
+
+        auto slot = element.id / SLOT_DESCRIPTORS;
+        queue.slots[slot].done = true;
+        completed |= 1U << slot;
+
+        ++queue.last_used;
+    }
+
+    return completed;
+}
+
+bool irq_mode = false;
+
+void virtio_irq_handler(interrupt::syscall_regs*, void*){
+    for(size_t i = 0; i < number_of_drives; ++i){
+        auto& drive = drives[i];
+
+        // Reading the ISR acknowledges the interrupt
+        if(!(in_byte(drive.iobase + VIRTIO_ISR_STATUS) & 0x1)){
+            continue;
+        }
+
+        auto completed = process_used(*drive.state, drive.queue_size);
+
+        if(scheduler::is_started()){
+            for(size_t slot = 0; slot < MAX_SLOTS; ++slot){
+                if(completed & (1U << slot)){
+                    auto& state = drive.state->slots[slot];
+
+                    if(state.io){
+                        auto status = reinterpret_cast<volatile uint8_t*>(state.header + 1);
+                        state.command.complete_from_irq(*status == VIRTIO_BLK_S_OK ? 0 : std::ERROR_FAILED);
+                    } else {
+                        state.lock.notify();
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t acquire_slot(virtio_blk::queue_state& queue){
+    queue.slots_sem.lock();
+
+    direct_int_lock lock;
+
+    auto slot = __builtin_ctz(queue.free_slots);
+    queue.free_slots &= ~(1U << slot);
+
+    return slot;
+}
+
+bool try_acquire_slot(virtio_blk::queue_state& queue, size_t& slot){
+    if(!queue.slots_sem.try_lock()){
+        return false;
+    }
+
+    direct_int_lock lock;
+
+    slot = __builtin_ctz(queue.free_slots);
+    queue.free_slots &= ~(1U << slot);
+
+    return true;
+}
+
+void release_slot(virtio_blk::queue_state& queue, size_t slot){
+    {
+        direct_int_lock lock;
+
+        queue.free_slots |= 1U << slot;
+    }
+
+    queue.slots_sem.unlock();
+}
+
+using sector_operation = block_operation;
+
+// Put the request of the slot on the virtqueue and notify the device
+void submit_slot(virtio_blk::drive_descriptor& drive, size_t slot, uint64_t sector, size_t bytes, sector_operation operation){
+    auto& queue = *drive.state;
+    auto& state = queue.slots[slot];
+
+    auto status = reinterpret_cast<volatile uint8_t*>(state.header + 1);
+
+    state.header->type = operation == sector_operation::READ ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    state.header->reserved = 0;
+    state.header->sector = sector;
+    *status = 0xFF;
+
+    size_t first = slot * SLOT_DESCRIPTORS;
+    size_t d = first;
+
+    queue.descriptors[d].address = state.header_phys;
+    queue.descriptors[d].length = sizeof(request_header);
+    queue.descriptors[d].flags = VIRTQ_DESC_F_NEXT;
+    queue.descriptors[d].next = d + 1;
+    ++d;
+
+    // One data descriptor per page, clear requests all point to the zero page
+    for(size_t offset = 0; offset < bytes; offset += paging::PAGE_SIZE){
+        auto page = offset / paging::PAGE_SIZE;
+
+        queue.descriptors[d].address = operation == sector_operation::CLEAR ? zero_page_phys : state.pages_phys[page];
+        queue.descriptors[d].length = std::min(bytes - offset, paging::PAGE_SIZE);
+        queue.descriptors[d].flags = VIRTQ_DESC_F_NEXT | (operation == sector_operation::READ ? VIRTQ_DESC_F_WRITE : 0);
+        queue.descriptors[d].next = d + 1;
+        ++d;
+    }
+
+    queue.descriptors[d].address = state.header_phys + sizeof(request_header);
+    queue.descriptors[d].length = 1;
+    queue.descriptors[d].flags = VIRTQ_DESC_F_WRITE;
+    queue.descriptors[d].next = 0;
+
+    state.done = false;
+    state.lock.claim();
+
+    {
+        direct_int_lock lock;
+
+        queue.avail_ring[queue.avail->index % drive.queue_size] = first;
+
+        // The descriptors must be visible before the index
+        asm volatile("mfence" : : : "memory");
+
+        queue.avail->index = queue.avail->index + 1;
+
+        asm volatile("mfence" : : : "memory");
+    }
+
+    out_word(drive.iobase + VIRTIO_QUEUE_NOTIFY, 0);
+}
+
+// Wait for the completion of the request in the given slot
+bool wait_slot(virtio_blk::drive_descriptor& drive, size_t slot){
+    auto& queue = *drive.state;
+    auto& state = queue.slots[slot];
+
+    if(irq_mode && scheduler::is_started()){
+        state.lock.wait();
+    } else {
+        while(true){
+            {
+                direct_int_lock lock;
+
+                process_used(queue, drive.queue_size);
+
+                if(state.done){
+                    break;
+                }
+            }
+
+            asm volatile ("pause");
+        }
+    }
+
+    auto status = reinterpret_cast<volatile uint8_t*>(state.header + 1);
+    return *status == VIRTIO_BLK_S_OK;
+}
+
+struct pending_request {
+    size_t slot;
+    char* data;
+    size_t bytes;
+};
+
+// Transfer count sectors, spreading the transfer over as many requests as possible
+bool read_write_sectors(virtio_blk::drive_descriptor& drive, uint64_t start, size_t count, char* data, sector_operation operation){
+    auto& queue = *drive.state;
+
+    auto max_sectors = queue.slot_pages * paging::PAGE_SIZE / BLOCK_SIZE;
+
+    std::array<pending_request, MAX_SLOTS> pending;
+    size_t first = 0;
+    size_t inflight = 0;
+
+    bool success = true;
+
+    auto complete_oldest = [&]() {
+        auto& request = pending[first];
+
+        if(!wait_slot(drive, request.slot)){
+            success = false;
+        } else if(operation == sector_operation::READ){
+            std::copy_n(queue.slots[request.slot].buffer, request.bytes, request.data);
+        }
+
+        release_slot(queue, request.slot);
+
+        first = (first + 1) % MAX_SLOTS;
+        --inflight;
+    };
+
+    for(size_t done = 0; done < count && success; done += max_sectors){
+        auto sectors = std::min(count - done, max_sectors);
+        auto bytes = sectors * BLOCK_SIZE;
+
+        // Only block on the slots when no request of ours is in flight
+        size_t slot;
+        while(!try_acquire_slot(queue, slot)){
+            if(inflight){
+                complete_oldest();
+            } else {
+                slot = acquire_slot(queue);
+                break;
+            }
+        }
+
+        if(operation == sector_operation::WRITE){
+            std::copy_n(data + done * BLOCK_SIZE, bytes, queue.slots[slot].buffer);
+        }
+
+        submit_slot(drive, slot, start + done, bytes, operation);
+
+        pending[(first + inflight) % MAX_SLOTS] = {slot, data ? data + done * BLOCK_SIZE : nullptr, bytes};
+        ++inflight;
+    }
+
+    while(inflight){
+        complete_oldest();
+    }
+
+    return success;
+}
+
+// Complete the part of an asynchronous request in a slot, in the completion task
+void slot_done(block_io& command){
+    auto& state = *reinterpret_cast<slot_state*>(command.data);
+
+    auto* io = state.io;
+    auto result = command.result;
+
+    if(!result && io->operation == block_operation::READ){
+        std::copy_n(state.buffer, state.bytes, state.data);
+    }
+
+    state.io = nullptr;
+    release_slot(*state.drive->state, state.index);
+
+    io->complete_part(result);
+}
+
+bool init_slot(slot_state& slot){
+    // The header and the status share one page
+    slot.header_phys = physical_allocator::allocate(1);
+    auto header_virt = virtual_allocator::allocate(1);
+
+    if(!slot.header_phys || !paging::map_pages(header_virt, slot.header_phys, 1)){
+        return false;
+    }
+
+    slot.header = reinterpret_cast<request_header*>(header_virt);
+
+    // The pages of the buffer do not need to be physically contiguous
+    auto buffer_virt = virtual_allocator::allocate(SLOT_PAGES);
+
+    for(size_t i = 0; i < SLOT_PAGES; ++i){
+        slot.pages_phys[i] = physical_allocator::allocate(1);
+
+        if(!slot.pages_phys[i] || !paging::map(buffer_virt + i * paging::PAGE_SIZE, slot.pages_phys[i])){
+            return false;
+        }
+    }
+
+    slot.buffer = reinterpret_cast<char*>(buffer_virt);
+
+    return true;
+}
+
+bool init_device(virtio_blk::drive_descriptor& drive, pci::device_descriptor& pci_device){
+    // Enable I/O space and bus mastering
+    auto command_register = pci::read_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04);
+    pci::write_config_word(pci_device.bus, pci_device.device, pci_device.function, 0x04, command_register | 0x5);
+
+    drive.iobase = pci::read_config_dword(pci_device.bus, pci_device.device, pci_device.function, 0x10) & ~0x3;
+
+    auto iobase = drive.iobase;
+
+    // Reset the device and acknowledge it
+    out_byte(iobase + VIRTIO_DEVICE_STATUS, 0);
+    out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    // Only the maximum number of segments is negotiated
+    auto features = in_dword(iobase + VIRTIO_DEVICE_FEATURES) & VIRTIO_BLK_F_SEG_MAX;
+    out_dword(iobase + VIRTIO_GUEST_FEATURES, features);
+
+    size_t slot_pages = SLOT_PAGES;
+    if(features & VIRTIO_BLK_F_SEG_MAX){
+        auto seg_max = in_dword(iobase + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_SEG_MAX);
+        slot_pages = std::max(size_t(1), std::min(slot_pages, size_t(seg_max)));
+    }
+
+    auto capacity = uint64_t(in_dword(iobase + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_CAPACITY))
+        | (uint64_t(in_dword(iobase + VIRTIO_DEVICE_CONFIG + VIRTIO_BLK_CAPACITY + 4)) << 32);
+    drive.size = capacity * BLOCK_SIZE;
+
+    // Configure the request queue
+    out_word(iobase + VIRTIO_QUEUE_SELECT, 0);
+    drive.queue_size = in_word(iobase + VIRTIO_QUEUE_SIZE);
+
+    if(drive.queue_size < SLOT_DESCRIPTORS){
+        logging::logf(logging::log_level::ERROR, "virtio: Virtqueue is too small (%u)\n", size_t(drive.queue_size));
+        out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    auto pages = queue_bytes(drive.queue_size) / paging::PAGE_SIZE;
+    auto queue_phys = physical_allocator::allocate(pages);
+    auto queue_virt = virtual_allocator::allocate(pages);
+
+    if(!queue_phys || !paging::map_pages(queue_virt, queue_phys, pages)){
+        logging::logf(logging::log_level::ERROR, "virtio: Unable to allocate the virtqueue\n");
+        out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    std::fill_n(reinterpret_cast<char*>(queue_virt), pages * paging::PAGE_SIZE, 0);
+
+    auto* queue = new virtio_blk::queue_state;
+
+    auto used_offset = paging::pages(sizeof(virtq_desc) * drive.queue_size + sizeof(uint16_t) * (3 + drive.queue_size)) * paging::PAGE_SIZE;
+
+    queue->descriptors = reinterpret_cast<virtq_desc*>(queue_virt);
+    queue->avail = reinterpret_cast<virtq_avail*>(queue_virt + sizeof(virtq_desc) * drive.queue_size);
+    queue->avail_ring = reinterpret_cast<uint16_t*>(queue->avail + 1);
+    queue->used = reinterpret_cast<virtq_used*>(queue_virt + used_offset);
+    queue->used_ring = reinterpret_cast<virtq_used_elem*>(queue->used + 1);
+    queue->last_used = 0;
+    queue->slot_pages = slot_pages;
+
+    drive.requests = std::min(MAX_SLOTS, drive.queue_size / SLOT_DESCRIPTORS);
+
+    for(size_t i = 0; i < drive.requests; ++i){
+        queue->slots[i].drive = &drive;
+        queue->slots[i].index = i;
+
+        if(!init_slot(queue->slots[i])){
+            logging::logf(logging::log_level::ERROR, "virtio: Unable to allocate request buffers\n");
+            out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+            return false;
+        }
+    }
+
+    queue->free_slots = drive.requests == 32 ? 0xFFFFFFFF : (1U << drive.requests) - 1;
+    queue->slots_sem.init(drive.requests);
+
+    drive.state = queue;
+
+    // The legacy interface takes the page number of the queue
+    out_dword(iobase + VIRTIO_QUEUE_ADDRESS, queue_phys / paging::PAGE_SIZE);
+
+    out_byte(iobase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    logging::logf(logging::log_level::TRACE, "virtio: Block device at %h (size:%u queue:%u requests:%u)\n",
+        size_t(iobase), drive.size, size_t(drive.queue_size), size_t(drive.requests));
+
+    return true;
+}
+
+} //end of anonymous namespace
+
+void virtio_blk::detect_disks(){
+    uint8_t irq = 0xFF;
+
+    for(size_t i = 0; i < pci::number_of_devices() && number_of_drives < MAX_DISKS; ++i){
+        auto& pci_device = pci::device(i);
+
+        if(pci_device.vendor_id != VIRTIO_VENDOR_ID || pci_device.device_id != VIRTIO_BLK_DEVICE_ID){
+            continue;
+        }
+
+        if(!zero_page_phys){
+            zero_page_phys = physical_allocator::allocate(1);
+
+            auto zero_page_virt = virtual_allocator::allocate(1);
+            if(!zero_page_phys || !paging::map_pages(zero_page_virt, zero_page_phys, 1)){
+                logging::logf(logging::log_level::ERROR, "virtio: Unable to allocate the zero page\n");
+                return;
+            }
+
+            std::fill_n(reinterpret_cast<char*>(zero_page_virt), paging::PAGE_SIZE, 0);
+        }
+
+        if(init_device(drives[number_of_drives], pci_device)){
+            ++number_of_drives;
+
+            // All the devices must share the same IRQ to use interrupts
+            auto device_irq = pci::read_config_byte(pci_device.bus, pci_device.device, pci_device.function, 0x3C);
+            if(irq == 0xFF){
+                irq = device_irq;
+            } else if(irq != device_irq){
+                irq = 0xFE;
+            }
+        }
+    }
+
+    if(number_of_drives){
+        if(irq <= 15 && interrupt::register_irq_handler(irq, virtio_irq_handler, nullptr)){
+            irq_mode = true;
+        } else {
+            logging::logf(logging::log_level::ERROR, "virtio: Unable to register IRQ handler %u, polling\n", size_t(irq));
+        }
+    }
+}
+
+uint8_t virtio_blk::number_of_disks(){
+    return number_of_drives;
+}
+
+virtio_blk::drive_descriptor& virtio_blk::drive(uint8_t disk){
+    return drives[disk];
+}
+
+size_t virtio_blk::read_sectors(drive_descriptor& drive, uint64_t start, size_t count, void* target, size_t& read){
+    if(!read_write_sectors(drive, start, count, reinterpret_cast<char*>(target), sector_operation::READ)){
+        return std::ERROR_FAILED;
+    }
+
+    read += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t virtio_blk::write_sectors(drive_descriptor& drive, uint64_t start, size_t count, const void* source, size_t& written){
+    auto buffer = reinterpret_cast<char*>(const_cast<void*>(source));
+
+    if(!read_write_sectors(drive, start, count, buffer, sector_operation::WRITE)){
+        return std::ERROR_FAILED;
+    }
+
+    written += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t virtio_blk::clear_sectors(drive_descriptor& drive, uint64_t start, size_t count, size_t& written){
+    if(!read_write_sectors(drive, start, count, nullptr, sector_operation::CLEAR)){
+        return std::ERROR_FAILED;
+    }
+
+    written += count * BLOCK_SIZE;
+
+    return 0;
+}
+
+size_t virtio_blk::virtio_blk_driver::read_sectors(void* device, uint64_t start, size_t count, void* destination, size_t& read){
+    verbose_logf(logging::log_level::TRACE, "virtio: read_sectors(start=%u, count=%u)\n", start, count);
+
+    return virtio_blk::read_sectors(*reinterpret_cast<virtio_blk::drive_descriptor*>(device), start, count, destination, read);
+}
+
+size_t virtio_blk::virtio_blk_driver::write_sectors(void* device, uint64_t start, size_t count, const void* source, size_t& written){
+    return virtio_blk::write_sectors(*reinterpret_cast<virtio_blk::drive_descriptor*>(device), start, count, source, written);
+}
+
+size_t virtio_blk::virtio_blk_driver::clear_sectors(void* device, uint64_t start, size_t count, size_t& written){
+    return virtio_blk::clear_sectors(*reinterpret_cast<virtio_blk::drive_descriptor*>(device), start, count, written);
+}
+
+size_t virtio_blk::virtio_blk_driver::size(void* device){
+    return reinterpret_cast<virtio_blk::drive_descriptor*>(device)->size;
+}
+
+void virtio_blk::virtio_blk_driver::submit(void* device, block_io& io){
+    auto& drive = *reinterpret_cast<virtio_blk::drive_descriptor*>(device);
+
+    // Without interrupts, the requests are polled synchronously
+    if(!irq_mode || !scheduler::is_started()){
+        block_driver::submit(device, io);
+        return;
+    }
+
+    auto& queue = *drive.state;
+
+    auto max_sectors = queue.slot_pages * paging::PAGE_SIZE / BLOCK_SIZE;
+
+    // Each slot completes one part of the request
+    io.split((io.count + max_sectors - 1) / max_sectors);
+
+    for(size_t done = 0; done < io.count; done += max_sectors){
+        auto sectors = std::min(io.count - done, max_sectors);
+        auto bytes = sectors * BLOCK_SIZE;
+
+        auto slot = acquire_slot(queue);
+        auto& state = queue.slots[slot];
+
+        state.data = io.buffer ? io.buffer + done * BLOCK_SIZE : nullptr;
+        state.bytes = bytes;
+
+        if(io.operation == block_operation::WRITE){
+            std::copy_n(state.data, bytes, state.buffer);
+        }
+
+        state.command.init(io.operation, io.sector + done, sectors, state.data, &slot_done, &state);
+        state.io = &io;
+
+        submit_slot(drive, slot, io.sector + done, bytes, io.operation);
+    }
+}
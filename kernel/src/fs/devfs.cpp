@@ -215,6 +215,66 @@ size_t devfs::devfs_file_system::write(const path& file_path, const char* buffer
     return std::ERROR_NOT_EXISTS;
 }
 
+size_t devfs::devfs_file_system::read_direct(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read){
+    //Cannot access the root for reading
+    if(file_path.is_root()){
+        return std::ERROR_PERMISSION_DENIED;
+    }
+
+    for(auto& device_list : devices){
+        if(device_list.mount_point == mount_point){
+            for(auto& device : device_list.devices){
+                if(device.name == file_path.base_name()){
+                    // Character devices have no cache to bypass
+                    if (device.type == device_type::CHAR_DEVICE) {
+                        return this->read(file_path, buffer, count, offset, read);
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->read_direct(device.data, buffer, count, offset, read);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
+size_t devfs::devfs_file_system::write_direct(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written){
+    //Cannot access the root for writing
+    if(file_path.is_root()){
+        return std::ERROR_PERMISSION_DENIED;
+    }
+
+    for(auto& device_list : devices){
+        if(device_list.mount_point == mount_point){
+            for(auto& device : device_list.devices){
+                if(device.name == file_path.base_name()){
+                    // Character devices have no cache to bypass
+                    if (device.type == device_type::CHAR_DEVICE) {
+                        return write(file_path, buffer, count, offset, written);
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->write_direct(device.data, buffer, count, offset, written);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
 size_t devfs::devfs_file_system::clear(const path& file_path, size_t count, size_t offset, size_t& written){
     //Cannot access the root for writing
     if(file_path.is_root()){
@@ -348,3 +408,115 @@ uint64_t devfs::get_device_size(const path& device_name, size_t& size){
 
     return std::ERROR_NOT_EXISTS;
 }
+
+uint64_t devfs::prefetch_device(const path& device_name, size_t count, size_t offset){
+    if(device_name.size() != 3){
+        return std::ERROR_INVALID_DEVICE;
+    }
+
+    for (auto& device_list : devices) {
+        if (device_list.mount_point == device_name.branch_path()) {
+            for (auto& device : device_list.devices) {
+                if (device.name == device_name.base_name()) {
+                    if (device.type != device_type::BLOCK_DEVICE) {
+                        return std::ERROR_INVALID_DEVICE;
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->prefetch(device.data, count, offset);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
+uint64_t devfs::clear_device(const path& device_name, size_t count, size_t offset, size_t& written){
+    if(device_name.size() != 3){
+        return std::ERROR_INVALID_DEVICE;
+    }
+
+    for (auto& device_list : devices) {
+        if (device_list.mount_point == device_name.branch_path()) {
+            for (auto& device : device_list.devices) {
+                if (device.name == device_name.base_name()) {
+                    if (device.type != device_type::BLOCK_DEVICE) {
+                        return std::ERROR_INVALID_DEVICE;
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->clear(device.data, count, offset, written);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
+uint64_t devfs::read_device_direct(const path& device_name, char* buffer, size_t count, size_t offset, size_t& read){
+    if(device_name.size() != 3){
+        return std::ERROR_INVALID_DEVICE;
+    }
+
+    for (auto& device_list : devices) {
+        if (device_list.mount_point == device_name.branch_path()) {
+            for (auto& device : device_list.devices) {
+                if (device.name == device_name.base_name()) {
+                    if (device.type != device_type::BLOCK_DEVICE) {
+                        return std::ERROR_INVALID_DEVICE;
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->read_direct(device.data, buffer, count, offset, read);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
+uint64_t devfs::write_device_direct(const path& device_name, const char* buffer, size_t count, size_t offset, size_t& written){
+    if(device_name.size() != 3){
+        return std::ERROR_INVALID_DEVICE;
+    }
+
+    for (auto& device_list : devices) {
+        if (device_list.mount_point == device_name.branch_path()) {
+            for (auto& device : device_list.devices) {
+                if (device.name == device_name.base_name()) {
+                    if (device.type != device_type::BLOCK_DEVICE) {
+                        return std::ERROR_INVALID_DEVICE;
+                    }
+
+                    auto* driver = reinterpret_cast<devfs::dev_driver*>(device.driver);
+
+                    if (!driver) {
+                        return std::ERROR_UNSUPPORTED;
+                    }
+
+                    return driver->write_direct(device.data, buffer, count, offset, written);
+                }
+            }
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
@@ -8,10 +8,12 @@
 #include <types.hpp>
 #include <unique_ptr.hpp>
 #include <algorithms.hpp>
+#include <lock_guard.hpp>
 
 #include <tlib/errors.hpp>
 
 #include "fs/fat32.hpp"
+#include "fs/devfs.hpp"
 
 #include "drivers/rtc.hpp"
 
@@ -31,6 +33,70 @@ constexpr const uint32_t CLUSTER_RESERVED= 0x1;
 constexpr const uint32_t CLUSTER_CORRUPTED = 0x0FFFFFF7;
 constexpr const uint32_t CLUSTER_END = 0x0FFFFFF8;
 
+// The FSInfo value of an unknown free count or next free cluster
+constexpr const uint32_t FS_INFO_UNKNOWN = 0xFFFFFFFF;
+
+// The number of FAT sectors read at once to build the free cluster bitmap
+constexpr const size_t FAT_SCAN_SECTORS = 64;
+
+// The maximum number of modified FAT sectors kept in memory
+constexpr const size_t FAT_DIRTY_SECTORS = 32;
+
+// FNV-1a hash of an entry name
+uint64_t name_hash(std::string_view name){
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(auto c : name){
+        h ^= uint8_t(c);
+        h *= 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+void bucket_insert(fat32::directory_index& index, size_t i){
+    auto mask = index.buckets.size() - 1;
+    auto b = name_hash(index.files[i].file_name) & mask;
+
+    while(index.buckets[b]){
+        b = (b + 1) & mask;
+    }
+
+    index.buckets[b] = i + 1;
+}
+
+// Drop the removed entries and rebuild the table, at most half full
+void rebuild_buckets(fat32::directory_index& index){
+    if(index.removed){
+        size_t j = 0;
+
+        for(size_t i = 0; i < index.files.size(); ++i){
+            if(!index.files[i].file_name.empty()){
+                if(i != j){
+                    index.files[j] = index.files[i];
+                }
+
+                ++j;
+            }
+        }
+
+        index.files.resize(j);
+        index.removed = 0;
+    }
+
+    size_t size = 16;
+    while(size < 2 * index.files.size()){
+        size *= 2;
+    }
+
+    index.buckets.clear();
+    index.buckets.resize(size);
+
+    for(size_t i = 0; i < index.files.size(); ++i){
+        bucket_insert(index, i);
+    }
+}
+
 //Indicates if the entry is unused, indicating a file deletion or move
 inline bool entry_unused(const fat32::cluster_entry& entry){
     return entry.name[0] == 0xE5;
@@ -159,28 +225,32 @@ fat32::cluster_entry* init_entry(fat32::cluster_entry* entry_ptr, std::string_vi
 
 //Init a directory entry
 template<bool Long>
-void init_directory_entry(fat32::cluster_entry* entry_ptr, std::string_view name, uint32_t cluster){
+fat32::cluster_entry* init_directory_entry(fat32::cluster_entry* entry_ptr, std::string_view name, uint32_t cluster){
     //Init the base entry parameters
     entry_ptr = init_entry<Long>(entry_ptr, name, cluster);
 
     //Mark it as a directory
     entry_ptr->attrib = 1 << 4;
+
+    return entry_ptr;
 }
 
 //Init a file entry
 template<bool Long>
-void init_file_entry(fat32::cluster_entry* entry_ptr, std::string_view name, uint32_t cluster){
+fat32::cluster_entry* init_file_entry(fat32::cluster_entry* entry_ptr, std::string_view name, uint32_t cluster){
     //Init the base entry parameters
     entry_ptr = init_entry<Long>(entry_ptr, name, cluster);
 
     //Mark it as a  file
     entry_ptr->attrib = 0;
+
+    return entry_ptr;
 }
 
 } //end of anonymous namespace
 
 fat32::fat32_file_system::fat32_file_system(path mount_point, path device) : mount_point(mount_point), device(device) {
-    //Nothing else to init
+    fs_lock.init();
 }
 
 fat32::fat32_file_system::~fat32_file_system(){
@@ -218,28 +288,83 @@ void fat32::fat32_file_system::init(){
 }
 
 size_t fat32::fat32_file_system::get_file(const path& file_path, vfs::file& file){
-    auto all_files = files(file_path, 1);
-    for(auto& f : all_files){
-        if(f.file_name == file_path.base_name()){
-            file = f;
+    std::lock_guard<mutex> l(fs_lock);
+
+    return get_file_unlocked(file_path, file);
+}
+
+size_t fat32::fat32_file_system::get_file_unlocked(const path& file_path, vfs::file& file){
+    switch(dentries.lookup(file_path, file)){
+        case vfs::dentry_state::EXISTS:
             return 0;
+
+        case vfs::dentry_state::NOT_EXISTS:
+            return std::ERROR_NOT_EXISTS;
+
+        case vfs::dentry_state::UNKNOWN:
+            break;
+    }
+
+    auto parent_path = file_path.branch_path();
+
+    //If the parent directory is cached, avoid walking the whole path
+    uint32_t parent_cluster;
+    vfs::file parent;
+    if(!parent_path.is_root() && dentries.lookup(parent_path, parent) == vfs::dentry_state::EXISTS && parent.directory){
+        parent_cluster = parent.location;
+    } else {
+        auto cluster_number_search = find_cluster_number(file_path, 1);
+        if(!cluster_number_search.first){
+            return std::ERROR_NOT_EXISTS;
         }
+
+        parent_cluster = cluster_number_search.second;
+    }
+
+    if(find_entry(parent_cluster, file_path.base_name(), file)){
+        dentries.insert(file_path, file);
+        return 0;
     }
 
+    dentries.insert_negative(file_path);
+
     return std::ERROR_NOT_EXISTS;
 }
 
 size_t fat32::fat32_file_system::read(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read){
+    std::lock_guard<mutex> l(fs_lock);
+
+    return read_file(file_path, buffer, count, offset, read, false);
+}
+
+size_t fat32::fat32_file_system::read_direct(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read){
+    std::lock_guard<mutex> l(fs_lock);
+
+    return read_file(file_path, buffer, count, offset, read, true);
+}
+
+size_t fat32::fat32_file_system::write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written){
+    std::lock_guard<mutex> l(fs_lock);
+
+    return write_file(file_path, buffer, count, offset, written, false);
+}
+
+size_t fat32::fat32_file_system::write_direct(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written){
+    std::lock_guard<mutex> l(fs_lock);
+
+    return write_file(file_path, buffer, count, offset, written, true);
+}
+
+size_t fat32::fat32_file_system::read_file(const path& file_path, char* buffer, size_t count, size_t offset, size_t& read, bool direct){
     verbose_logf(logging::log_level::TRACE, "fat32: Start read (buffer=%p,count=%d,offset=%d)\n", buffer, count, offset);
 
     vfs::file file;
-    auto result = get_file(file_path, file);
+    auto result = get_file_unlocked(file_path, file);
     if(result > 0){
         verbose_logf(logging::log_level::TRACE, "fat32: invalid file\n");
         return result;
     }
 
-    uint32_t cluster_number = file.location;
     size_t file_size = file.size;
 
     //Check the offset parameter
@@ -258,59 +383,90 @@ size_t fat32::fat32_file_system::read(const path& file_path, char* buffer, size_
     size_t first = offset;
     size_t last = std::min(offset + count, file_size);
 
-    size_t read_bytes = 0;
     size_t position = 0;
-    size_t cluster = 0;
 
     size_t cluster_size = 512 * fat_bs->sectors_per_cluster;
 
-    // Allocate a buffer big enough to read one cluster (possibly several sectors)
-    std::unique_heap_array<char> cluster_buffer(cluster_size);
+    // The buffer is only needed for the clusters that are partially read
+    std::unique_heap_array<char> cluster_buffer;
+
+    // The whole clusters are read straight into the buffer, in runs of
+    // clusters contiguous on disk
+    uint32_t run_start = 0;
+    size_t run_length = 0;
+    size_t run_position = 0;
+
+    auto read_run = [&]() -> bool {
+        if(!run_length){
+            return true;
+        }
+
+        auto sectors = run_length * fat_bs->sectors_per_cluster;
+        run_length = 0;
 
-    while(read_bytes < last){
-        auto cluster_last = (cluster + 1) * cluster_size;
+        if(direct){
+            return read_sectors_direct(cluster_lba(run_start), sectors, buffer + run_position);
+        } else {
+            return read_sectors(cluster_lba(run_start), sectors, buffer + run_position);
+        }
+    };
 
-        if(first < cluster_last){
-            verbose_logf(logging::log_level::TRACE, "fat32: read_sectors\n");
+    // The clusters are found directly from the cluster map of the file
+    for(size_t index = first / cluster_size; index * cluster_size < last; ++index){
+        auto cluster_first = index * cluster_size;
+        auto begin = std::max(first, cluster_first);
+        auto end = std::min(last, cluster_first + cluster_size);
 
-            if(read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
-                size_t i = 0;
+        auto cluster_number = chain_cluster(file.location, index);
+
+        //It may be possible that either the file size or the FAT entry is wrong
+        if(!cluster_number){
+            break;
+        }
 
-                if(position == 0){
-                    i = first % cluster_size;
+        if(end - begin == cluster_size){
+            if(run_length && run_start + run_length == cluster_number){
+                ++run_length;
+            } else {
+                // Start reading the next run while the previous one is read
+                if(!direct && run_length){
+                    prefetch_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster);
                 }
 
-                for(; i < cluster_size && read_bytes < last; ++i, ++read_bytes){
-                    buffer[position++] = cluster_buffer[i];
+                if(!read_run()){
+                    verbose_logf(logging::log_level::TRACE, "fat32: read failed\n");
+
+                    return std::ERROR_FAILED;
                 }
-            } else {
-                verbose_logf(logging::log_level::TRACE, "fat32: read failed\n");
 
-                return std::ERROR_FAILED;
+                run_start = cluster_number;
+                run_length = 1;
+                run_position = position;
             }
         } else {
-            read_bytes += cluster_size;
-        }
-
-        ++cluster;
+            if(!cluster_buffer.get()){
+                cluster_buffer = std::unique_heap_array<char>(cluster_size);
+            }
 
-        //If the file is not read completely, get the next cluster
-        if(read_bytes < last){
-            cluster_number = next_cluster(cluster_number);
+            if(!read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
+                verbose_logf(logging::log_level::TRACE, "fat32: read failed\n");
 
-            //It may be possible that either the file size or the FAT entry is wrong
-            if(!cluster_number){
-                break;
+                return std::ERROR_FAILED;
             }
 
-            //The block is corrupted
-            if(cluster_number == 0x0FFFFFF7){
-                break;
-            }
+            std::copy_n(cluster_buffer.get() + (begin - cluster_first), end - begin, buffer + position);
         }
+
+        position += end - begin;
+    }
+
+    if(!read_run()){
+        verbose_logf(logging::log_level::TRACE, "fat32: read failed\n");
+
+        return std::ERROR_FAILED;
     }
 
-    read = last - first;
+    read = position;
 
     verbose_logf(logging::log_level::TRACE, "fat32: finished read\n");
 
@@ -321,14 +477,13 @@ size_t fat32::fat32_file_system::read(const path& /*file_path*/, char* /*buffer*
     return std::ERROR_UNSUPPORTED;
 }
 
-size_t fat32::fat32_file_system::write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written){
+size_t fat32::fat32_file_system::write_file(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written, bool direct){
     vfs::file file;
-    auto result = get_file(file_path, file);
+    auto result = get_file_unlocked(file_path, file);
     if(result > 0){
         return result;
     }
 
-    uint32_t cluster_number = file.location;
     size_t file_size = file.size;
 
     //Check the offset parameter
@@ -347,73 +502,100 @@ size_t fat32::fat32_file_system::write(const path& file_path, const char* buffer
     size_t first = offset;
     size_t last = offset + count;
 
-    size_t read_bytes = 0;
     size_t position = 0;
-    size_t cluster = 0;
 
     size_t cluster_size = 512 * fat_bs->sectors_per_cluster;
 
-    // Allocate a buffer big enough to read one cluster (possibly several sectors)
-    std::unique_heap_array<char> cluster_buffer(cluster_size);
+    // The buffer is only needed for the clusters that are partially written
+    std::unique_heap_array<char> cluster_buffer;
 
-    while(read_bytes < last){
-        auto cluster_last = (cluster + 1) * cluster_size;
+    // The whole clusters are written straight from the buffer, in runs of
+    // clusters contiguous on disk, without reading them first
+    uint32_t run_start = 0;
+    size_t run_length = 0;
+    size_t run_position = 0;
 
-        if(first < cluster_last){
+    auto write_run = [&]() -> bool {
+        if(!run_length){
+            return true;
+        }
 
-            if(read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
-                size_t i = 0;
+        auto sectors = run_length * fat_bs->sectors_per_cluster;
+        run_length = 0;
 
-                if(position == 0){
-                    i = first % cluster_size;
-                }
+        if(direct){
+            return write_sectors_direct(cluster_lba(run_start), sectors, buffer + run_position);
+        } else {
+            return write_sectors(cluster_lba(run_start), sectors, buffer + run_position);
+        }
+    };
 
-                for(; i < cluster_size && read_bytes < last; ++i, ++read_bytes){
-                    cluster_buffer[i] = buffer[position++];
-                }
+    // The clusters are found directly from the cluster map of the file
+    for(size_t index = first / cluster_size; index * cluster_size < last; ++index){
+        auto cluster_first = index * cluster_size;
+        auto begin = std::max(first, cluster_first);
+        auto end = std::min(last, cluster_first + cluster_size);
 
-                if(!write_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
-                    return std::ERROR_FAILED;
-                }
-            } else {
-                return std::ERROR_FAILED;
-            }
+        auto cluster_number = chain_cluster(file.location, index);
 
-        } else {
-            read_bytes += cluster_size;
+        //It may be possible that either the file size or the FAT entry is wrong
+        if(!cluster_number){
+            break;
         }
 
-        ++cluster;
+        if(end - begin == cluster_size){
+            if(run_length && run_start + run_length == cluster_number){
+                ++run_length;
+            } else {
+                if(!write_run()){
+                    return std::ERROR_FAILED;
+                }
 
-        //If the file is not read completely, get the next cluster
-        if(read_bytes < last){
-            cluster_number = next_cluster(cluster_number);
+                run_start = cluster_number;
+                run_length = 1;
+                run_position = position;
+            }
+        } else {
+            if(!cluster_buffer.get()){
+                cluster_buffer = std::unique_heap_array<char>(cluster_size);
+            }
 
-            //It may be possible that either the file size or the FAT entry is wrong
-            if(!cluster_number){
-                break;
+            if(!read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
+                return std::ERROR_FAILED;
             }
 
-            //The block is corrupted
-            if(cluster_number == 0x0FFFFFF7){
-                break;
+            std::copy_n(buffer + position, end - begin, cluster_buffer.get() + (begin - cluster_first));
+
+            if(!write_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
+                return std::ERROR_FAILED;
             }
         }
+
+        position += end - begin;
     }
 
-    written = last - first;
+    if(!write_run()){
+        return std::ERROR_FAILED;
+    }
+
+    written = position;
 
     return 0;
 }
 
 size_t fat32::fat32_file_system::clear(const path& file_path, size_t count, size_t offset, size_t& written){
+    std::lock_guard<mutex> l(fs_lock);
+
+    return clear_unlocked(file_path, count, offset, written);
+}
+
+size_t fat32::fat32_file_system::clear_unlocked(const path& file_path, size_t count, size_t offset, size_t& written){
     vfs::file file;
-    auto result = get_file(file_path, file);
+    auto result = get_file_unlocked(file_path, file);
     if(result > 0){
         return result;
     }
 
-    uint32_t cluster_number = file.location;
     size_t file_size = file.size;
 
     //Check the offset parameter
@@ -432,68 +614,84 @@ size_t fat32::fat32_file_system::clear(const path& file_path, size_t count, size
     size_t first = offset;
     size_t last = offset + count;
 
-    size_t read_bytes = 0;
-    size_t cluster = 0;
-    bool first_position = true;
-
     size_t cluster_size = 512 * fat_bs->sectors_per_cluster;
 
-    // Allocate a buffer big enough to read one cluster (possibly several sectors)
-    std::unique_heap_array<char> cluster_buffer(cluster_size);
+    // The buffer is only needed for the clusters that are partially cleared
+    std::unique_heap_array<char> cluster_buffer;
 
-    while(read_bytes < last){
-        auto cluster_last = (cluster + 1) * cluster_size;
+    // The whole clusters are cleared in runs of clusters contiguous on disk
+    uint32_t run_start = 0;
+    size_t run_length = 0;
 
-        if(first < cluster_last){
-            if(read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
-                size_t i = 0;
+    auto clear_run = [&]() -> bool {
+        if(!run_length){
+            return true;
+        }
 
-                if(first_position){
-                    i = first % cluster_size;
-                    first_position = false;
-                }
+        auto cleared = clear_sectors(cluster_lba(run_start), run_length * fat_bs->sectors_per_cluster);
+        run_length = 0;
+        return cleared;
+    };
 
-                for(; i < cluster_size && read_bytes < last; ++i, ++read_bytes){
-                    cluster_buffer[i] = 0;
-                }
+    size_t position = 0;
 
-                if(!write_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
-                    return std::ERROR_FAILED;
-                }
-            } else {
-                return std::ERROR_FAILED;
-            }
+    // The clusters are found directly from the cluster map of the file
+    for(size_t index = first / cluster_size; index * cluster_size < last; ++index){
+        auto cluster_first = index * cluster_size;
+        auto begin = std::max(first, cluster_first);
+        auto end = std::min(last, cluster_first + cluster_size);
 
-        } else {
-            read_bytes += cluster_size;
+        auto cluster_number = chain_cluster(file.location, index);
+
+        //It may be possible that either the file size or the FAT entry is wrong
+        if(!cluster_number){
+            break;
         }
 
-        ++cluster;
+        if(end - begin == cluster_size){
+            if(run_length && run_start + run_length == cluster_number){
+                ++run_length;
+            } else {
+                if(!clear_run()){
+                    return std::ERROR_FAILED;
+                }
 
-        //If the file is not read completely, get the next cluster
-        if(read_bytes < last){
-            cluster_number = next_cluster(cluster_number);
+                run_start = cluster_number;
+                run_length = 1;
+            }
+        } else {
+            if(!cluster_buffer.get()){
+                cluster_buffer = std::unique_heap_array<char>(cluster_size);
+            }
 
-            //It may be possible that either the file size or the FAT entry is wrong
-            if(!cluster_number){
-                break;
+            if(!read_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
+                return std::ERROR_FAILED;
             }
 
-            //The block is corrupted
-            if(cluster_number == 0x0FFFFFF7){
-                break;
+            std::fill_n(cluster_buffer.get() + (begin - cluster_first), end - begin, 0);
+
+            if(!write_sectors(cluster_lba(cluster_number), fat_bs->sectors_per_cluster, cluster_buffer.get())){
+                return std::ERROR_FAILED;
             }
         }
+
+        position += end - begin;
+    }
+
+    if(!clear_run()){
+        return std::ERROR_FAILED;
     }
 
-    written = last - first;
+    written = position;
 
     return 0;
 }
 
 size_t fat32::fat32_file_system::truncate(const path& file_path, size_t file_size){
+    std::lock_guard<mutex> l(fs_lock);
+
     vfs::file file;
-    auto result = get_file(file_path, file);
+    auto result = get_file_unlocked(file_path, file);
     if(result > 0){
         return result;
     }
@@ -512,90 +710,70 @@ size_t fat32::fat32_file_system::truncate(const path& file_path, size_t file_siz
 
     //If we need to increase the size
     if(file.size < file_size){
-        auto cluster_size = 512 * fat_bs->sectors_per_cluster;
-        auto clusters = file_size % cluster_size == 0 ? file_size / cluster_size : (file_size / cluster_size) + 1;
-
-        size_t capacity = 0;
-        auto last_cluster = file.location;
-
-        if(last_cluster >= 2){
-            ++capacity;
-
-            while(true){
-                auto next = next_cluster(last_cluster);
-
-                if(!next || next == CLUSTER_CORRUPTED){
-                    break;
-                }
-
-                last_cluster = next;
-                ++capacity;
-            }
+        auto result = reserve_clusters(parent_cluster_number_search.second, file, file_size);
+        if(result > 0){
+            return result;
         }
+    }
 
-        if(capacity < clusters){
-            if(capacity == 0){
-                auto cluster = find_free_cluster();
-                if(!cluster){
-                    return std::ERROR_DISK_FULL;
-                }
-
-                --fat_is->free_clusters;
-
-                last_cluster = cluster;
-
-                ++capacity;
+    //Set the new file size in the directory entry
+    change_directory_entry(parent_cluster_number_search.second, file.position,
+        [file_size](cluster_entry& entry){ entry.file_size = file_size; });
 
-                change_directory_entry(parent_cluster_number_search.second, file.position,
-                    [cluster](cluster_entry& entry){
-                    entry.cluster_low = cluster;
-                    entry.cluster_high = cluster >> 16;
-                    });
-            }
+    //The cached entry has the old size and maybe the old location
+    dentries.invalidate(file_path);
 
-            //Extend the clusters if necessary
-            for(auto i = capacity; i < clusters; ++i){
-                auto cluster = find_free_cluster();
-                if(!cluster){
-                    return std::ERROR_DISK_FULL;
-                }
+    //The new clusters may contain the data of removed files
+    if(file.size < file_size){
+        size_t written = 0;
+        return clear_unlocked(file_path, file_size - file.size, file.size, written);
+    }
 
-                --fat_is->free_clusters;
+    return 0;
+}
 
-                //Update the cluster chain
-                if(!write_fat_value(last_cluster, cluster)){
-                    return std::ERROR_FAILED;
-                }
+size_t fat32::fat32_file_system::fallocate(const path& file_path, size_t size){
+    std::lock_guard<mutex> l(fs_lock);
 
-                last_cluster = cluster;
-            }
+    vfs::file file;
+    auto result = get_file_unlocked(file_path, file);
+    if(result > 0){
+        return result;
+    }
 
-            //Update the cluster chain
-            if(!write_fat_value(last_cluster, CLUSTER_END)){
-                return std::ERROR_FAILED;
-            }
+    if(file.directory){
+        return std::ERROR_DIRECTORY;
+    }
 
-            if(!write_is()){
-                return std::ERROR_FAILED;
-            }
-        }
+    //Find the cluster number of the parent directory
+    auto parent_cluster_number_search = find_cluster_number(file_path, 1);
+    if(!parent_cluster_number_search.first){
+        return std::ERROR_NOT_EXISTS;
     }
 
-    //Set the new file size in the directory entry
-    change_directory_entry(parent_cluster_number_search.second, file.position,
-        [file_size](cluster_entry& entry){ entry.file_size = file_size; });
+    //The clusters are reserved after the end of the file, its size does not change
+    result = reserve_clusters(parent_cluster_number_search.second, file, size);
 
-    return 0;
+    //The first cluster of an empty file may have changed
+    dentries.invalidate(file_path);
+
+    return result;
 }
 
 size_t fat32::fat32_file_system::ls(const path& file_path, std::vector<vfs::file>& contents){
+    std::lock_guard<mutex> l(fs_lock);
+
     //TODO Better handling of error inside files()
     contents = files(file_path);
 
+    dentries.insert_directory(file_path, contents);
+
     return 0;
 }
 
 size_t fat32::fat32_file_system::touch(const path& file_path){
+    std::lock_guard<mutex> l(fs_lock);
+
     //Find the cluster number of the parent directory
     auto cluster_number = find_cluster_number(file_path, 1);
     if(!cluster_number.first){
@@ -614,17 +792,27 @@ size_t fat32::fat32_file_system::touch(const path& file_path){
     auto entries = number_of_entries(file);
     auto new_directory_entry = find_free_entry(directory_cluster, entries, parent_cluster_number);
 
-    init_file_entry<true>(new_directory_entry, file, 0);
+    auto short_entry = init_file_entry<true>(new_directory_entry, file, 0);
 
     //Write back the parent directory cluster
     if(!write_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
         return std::ERROR_FAILED;
     }
 
+    dentries.invalidate(file_path);
+
+    vfs::file new_file;
+    new_file.file_name = file;
+    decode_entry(*short_entry, new_file);
+    new_file.position = entry_position(cluster_number.second, parent_cluster_number, short_entry, directory_cluster);
+    index_entry(cluster_number.second, new_file);
+
     return 0;
 }
 
 size_t fat32::fat32_file_system::mkdir(const path& file_path){
+    std::lock_guard<mutex> l(fs_lock);
+
     //Find the cluster number of the parent directory
     auto cluster_number = find_cluster_number(file_path, 1);
     if(!cluster_number.first){
@@ -653,13 +841,24 @@ size_t fat32::fat32_file_system::mkdir(const path& file_path){
     auto entries = number_of_entries(directory);
     auto new_directory_entry = find_free_entry(directory_cluster, entries, parent_cluster_number);
 
-    init_directory_entry<true>(new_directory_entry, directory, cluster);
+    auto short_entry = init_directory_entry<true>(new_directory_entry, directory, cluster);
 
     //Write back the parent directory cluster
     if(!write_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
         return std::ERROR_FAILED;
     }
 
+    dentries.invalidate(file_path);
+
+    vfs::file new_directory;
+    new_directory.file_name = directory;
+    decode_entry(*short_entry, new_directory);
+    new_directory.position = entry_position(parent_cluster, parent_cluster_number, short_entry, directory_cluster);
+    index_entry(parent_cluster, new_directory);
+
+    //The cluster may have held a removed directory
+    drop_directory_index(cluster);
+
     //This cluster is the end of the chain
     if(!write_fat_value(cluster, CLUSTER_END)){
         return std::ERROR_FAILED;
@@ -667,7 +866,7 @@ size_t fat32::fat32_file_system::mkdir(const path& file_path){
 
     //One cluster is now used for the directory entries
     --fat_is->free_clusters;
-    if(!write_is()){
+    if(!flush_fat()){
         return std::ERROR_FAILED;
     }
 
@@ -700,8 +899,10 @@ size_t fat32::fat32_file_system::mkdir(const path& file_path){
 }
 
 size_t fat32::fat32_file_system::rm(const path& file_path){
+    std::lock_guard<mutex> l(fs_lock);
+
     vfs::file file;
-    auto result = get_file(file_path, file);
+    auto result = get_file_unlocked(file_path, file);
     if(result > 0){
         return result;
     }
@@ -718,6 +919,9 @@ size_t fat32::fat32_file_system::rm(const path& file_path){
 
     auto parent_cluster_number = cluster_number_search.second;
 
+    //Forget the entry, and the entries under it for a directory
+    dentries.invalidate(file_path);
+
     if(is_file){
         return rm_file(parent_cluster_number, position, cluster_number);
     } else {
@@ -725,7 +929,37 @@ size_t fat32::fat32_file_system::rm(const path& file_path){
     }
 }
 
+bool fat32::fat32_file_system::cacheable() const {
+    return true;
+}
+
+size_t fat32::fat32_file_system::sync(){
+    std::lock_guard<mutex> l(fs_lock);
+
+    if(!flush_fat()){
+        return std::ERROR_FAILED;
+    }
+
+    //The FSInfo is only a hint, it is written back lazily
+    if(is_dirty){
+        if(!write_is()){
+            return std::ERROR_FAILED;
+        }
+
+        is_dirty = false;
+    }
+
+    return 0;
+}
+
 size_t fat32::fat32_file_system::statfs(vfs::statfs_info& file){
+    std::lock_guard<mutex> l(fs_lock);
+
+    // The free count is only known once the FAT has been scanned
+    if(fat_is->free_clusters == FS_INFO_UNKNOWN && !free_bitmap.get()){
+        load_free_bitmap();
+    }
+
     file.total_size = fat_bs->total_sectors_long * 512;
     file.free_size = fat_is->free_clusters * fat_bs->sectors_per_cluster * 512;
 
@@ -734,62 +968,123 @@ size_t fat32::fat32_file_system::statfs(vfs::statfs_info& file){
 
 /* Private methods implementation */
 
-size_t fat32::fat32_file_system::rm_file(uint32_t parent_cluster_number, size_t position, uint32_t cluster_number){
-    std::unique_heap_array<cluster_entry> directory_cluster(16 * fat_bs->sectors_per_cluster);
-    if(!read_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
-        return std::ERROR_FAILED;
+size_t fat32::fat32_file_system::reserve_clusters(uint32_t parent_cluster_number, const vfs::file& file, size_t size){
+    auto cluster_size = 512 * fat_bs->sectors_per_cluster;
+    auto clusters = size % cluster_size == 0 ? size / cluster_size : (size / cluster_size) + 1;
+
+    if(!clusters){
+        return 0;
     }
 
-    //1. Mark the entries in directory as unused
+    size_t capacity = 0;
+    uint32_t last_cluster = 0;
+    std::vector<cluster_extent> extents;
 
-    bool found = false;
-    size_t cluster_position = 0;
-    while(!found){
-        bool end_reached = false;
+    if(file.location >= 2){
+        // The chain is only followed in the FAT past the mapped clusters
+        if(chain_cluster(file.location, clusters - 1)){
+            return 0;
+        }
 
-        //Verify if is the correct cluster
-        if(position >= cluster_position * directory_cluster.size() && position < (cluster_position + 1) * directory_cluster.size()){
-            found = true;
+        // The map is now complete, the last cluster is the tail of the last extent
+        auto& map = get_cluster_map(file.location);
 
-            auto j = position % directory_cluster.size();
-            directory_cluster[j].name[0] = 0xE5;
+        capacity = map.clusters;
+        extents = map.extents;
 
-            while(is_long_name(directory_cluster[--j])){
-                directory_cluster[j].name[0] = 0xE5;
+        auto& tail = extents.back();
+        last_cluster = tail.cluster + tail.length - 1;
+    }
 
-                if(j == 0){
-                    break;
-                }
-            }
+    //Allocate the missing clusters in runs as contiguous as possible
+    while(capacity < clusters){
+        size_t length = 0;
+        auto cluster = find_free_run(clusters - capacity, capacity ? last_cluster + 1 : fat_is->allocated_clusters, length);
+        if(!cluster){
+            return std::ERROR_DISK_FULL;
+        }
 
-            if(!write_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
+        fat_is->free_clusters -= length;
+
+        //Chain the clusters of the run together
+        for(size_t i = 0; i + 1 < length; ++i){
+            if(!write_fat_value(cluster + i, cluster + i + 1)){
                 return std::ERROR_FAILED;
             }
         }
 
-        //Jump to next cluser
-        if(!found && !end_reached){
-            parent_cluster_number = next_cluster(parent_cluster_number);
+        if(capacity == 0){
+            change_directory_entry(parent_cluster_number, file.position,
+                [cluster](cluster_entry& entry){
+                entry.cluster_low = cluster;
+                entry.cluster_high = cluster >> 16;
+                });
+        } else if(!write_fat_value(last_cluster, cluster)){
+            return std::ERROR_FAILED;
+        }
 
-            if(!parent_cluster_number){
-                break;
-            }
+        if(capacity && last_cluster + 1 == cluster){
+            extents.back().length += length;
+        } else {
+            extents.push_back({uint32_t(capacity), cluster, uint32_t(length)});
+        }
 
-            //The block is corrupted
-            if(parent_cluster_number == CLUSTER_CORRUPTED){
-                break;
-            }
+        last_cluster = cluster + length - 1;
+        capacity += length;
 
-            if(!read_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
-                break;
-            }
+        //Update the cluster chain
+        if(!write_fat_value(last_cluster, CLUSTER_END)){
+            return std::ERROR_FAILED;
         }
     }
 
-    if(!found){
-        return std::ERROR_NOT_EXISTS;
+    if(!flush_fat()){
+        return std::ERROR_FAILED;
+    }
+
+    // Writing the FAT invalidated the map of the chain, but it is completely
+    // known, so it is kept for the next accesses
+    auto& map = get_cluster_map(extents.front().cluster);
+
+    map.clusters = capacity;
+    map.complete = true;
+    map.extents = std::move(extents);
+
+    return 0;
+}
+
+size_t fat32::fat32_file_system::rm_file(uint32_t parent_cluster_number, size_t position, uint32_t cluster_number){
+    std::unique_heap_array<cluster_entry> directory_cluster(16 * fat_bs->sectors_per_cluster);
+
+    //1. Mark the entries in directory as unused
+
+    //Find the cluster of the directory containing the entry
+    auto entry_cluster = chain_cluster(parent_cluster_number, position / directory_cluster.size());
+    if(!entry_cluster){
+        return std::ERROR_NOT_EXISTS;
+    }
+
+    if(!read_sectors(cluster_lba(entry_cluster), fat_bs->sectors_per_cluster, directory_cluster.get())){
+        return std::ERROR_FAILED;
+    }
+
+    auto j = position % directory_cluster.size();
+    directory_cluster[j].name[0] = 0xE5;
+
+    //The long name entries are just before, in the same cluster
+    while(j > 0 && is_long_name(directory_cluster[--j])){
+        directory_cluster[j].name[0] = 0xE5;
     }
 
+    if(!write_sectors(cluster_lba(entry_cluster), fat_bs->sectors_per_cluster, directory_cluster.get())){
+        return std::ERROR_FAILED;
+    }
+
+    unindex_entry(parent_cluster_number, position);
+
+    //If it was a directory, its index is now meaningless
+    drop_directory_index(cluster_number);
+
     //2. Release all the clusters of the chain
     if(cluster_number >= 2){
         while(true){
@@ -810,7 +1105,7 @@ size_t fat32::fat32_file_system::rm_file(uint32_t parent_cluster_number, size_t
         }
     }
 
-    if(!write_is()){
+    if(!flush_fat()){
         return std::ERROR_FAILED;
     }
 
@@ -845,52 +1140,26 @@ size_t fat32::fat32_file_system::rm_dir(uint32_t parent_cluster_number, size_t p
 
 size_t fat32::fat32_file_system::change_directory_entry(uint32_t parent_cluster_number, size_t position, const std::function<void(cluster_entry&)>& functor){
     std::unique_heap_array<cluster_entry> directory_cluster(16 * fat_bs->sectors_per_cluster);
-    if(!read_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
-        return std::ERROR_FAILED;
-    }
 
-    //1. Mark the entries in directory as unused
-
-    bool found = false;
-    size_t cluster_position = 0;
-    while(!found){
-        bool end_reached = false;
-
-        //Verify if is the correct cluster
-        if(position >= cluster_position * directory_cluster.size() && position < (cluster_position + 1) * directory_cluster.size()){
-            found = true;
-
-            auto j = position % directory_cluster.size();
-
-            functor(directory_cluster[j]);
-
-            if(!write_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
-                return std::ERROR_FAILED;
-            }
-        }
+    //Find the cluster of the directory containing the entry
+    auto entry_cluster = chain_cluster(parent_cluster_number, position / directory_cluster.size());
+    if(!entry_cluster){
+        return std::ERROR_NOT_EXISTS;
+    }
 
-        //Jump to next cluser
-        if(!found && !end_reached){
-            parent_cluster_number = next_cluster(parent_cluster_number);
+    if(!read_sectors(cluster_lba(entry_cluster), fat_bs->sectors_per_cluster, directory_cluster.get())){
+        return std::ERROR_FAILED;
+    }
 
-            if(!parent_cluster_number){
-                break;
-            }
+    auto& entry = directory_cluster[position % directory_cluster.size()];
 
-            //The block is corrupted
-            if(parent_cluster_number == CLUSTER_CORRUPTED){
-                break;
-            }
+    functor(entry);
 
-            if(!read_sectors(cluster_lba(parent_cluster_number), fat_bs->sectors_per_cluster, directory_cluster.get())){
-                break;
-            }
-        }
+    if(!write_sectors(cluster_lba(entry_cluster), fat_bs->sectors_per_cluster, directory_cluster.get())){
+        return std::ERROR_FAILED;
     }
 
-    if(!found){
-        return std::ERROR_NOT_EXISTS;
-    }
+    reindex_entry(parent_cluster_number, position, entry);
 
     return 0;
 }
@@ -1024,9 +1293,6 @@ fat32::cluster_entry* fat32::fat32_file_system::extend_directory(std::unique_hea
     }
 
     --fat_is->free_clusters;
-    if(!write_is()){
-        return nullptr;
-    }
 
     //Update the cluster chain
     if(!write_fat_value(cluster_number, cluster)){
@@ -1037,6 +1303,10 @@ fat32::cluster_entry* fat32::fat32_file_system::extend_directory(std::unique_hea
         return nullptr;
     }
 
+    if(!flush_fat()){
+        return nullptr;
+    }
+
     //Remove all the end of directory marker in the previous cluster
     for(auto& entry : directory_cluster){
         if(end_of_directory(entry)){
@@ -1157,45 +1427,10 @@ std::vector<vfs::file> fat32::fat32_file_system::files(uint32_t cluster_number){
                 }
             }
 
-            file.hidden = entry.attrib & 0x1;
-            file.system = entry.attrib & 0x2;
-            file.directory = entry.attrib & 0x10;
-
-            file.created.day = entry.creation_date & 0x1F;
-            file.created.month = (entry.creation_date >> 5) & 0xF;
-            file.created.year = (entry.creation_date >> 9) + 1980;
-
-            file.created.seconds = entry.creation_time & 0x1F;
-            file.created.minutes = (entry.creation_time >> 5) & 0x3F;
-            file.created.hour = entry.creation_time >> 11;
-
-            file.modified.day = entry.modification_date & 0x1F;
-            file.modified.month = (entry.modification_date >> 5) & 0xF;
-            file.modified.year = (entry.modification_date >> 9) + 1980;
-
-            file.modified.seconds = entry.modification_time & 0x1F;
-            file.modified.minutes = (entry.modification_time >> 5) & 0x3F;
-            file.modified.hour = entry.modification_time >> 11;
+            decode_entry(entry, file);
 
-            file.accessed.day = entry.accessed_date & 0x1F;
-            file.accessed.month = (entry.accessed_date >> 5) & 0xF;
-            file.accessed.year = (entry.accessed_date >> 9) + 1980;
-
-            if(file.directory){
-                //TODO Should read the cluster chain to get the number of
-                //clusters
-                file.size = fat_bs->sectors_per_cluster * 512;
-            } else {
-                file.size = entry.file_size;
-            }
-
-            file.location = (uint32_t(entry.cluster_high) << 16) + uint32_t(entry.cluster_low);
             file.position = cluster_position * cluster.size() + (position - 1);
 
-            if(file.location == 0){
-                file.location = fat_bs->root_directory_cluster_start;
-            }
-
             files.push_back(file);
         }
 
@@ -1231,36 +1466,207 @@ std::pair<bool, uint32_t> fat32::fat32_file_system::find_cluster_number(const pa
     for(size_t i = 1; i < file_path.size() - last; ++i){
         auto p = file_path[i];
 
-        bool found = false;
+        vfs::file file;
+        if(!find_entry(cluster_number, p, file)){
+            return std::make_pair(false, 0);
+        }
 
-        auto entries = files(cluster_number);
+        cluster_number = file.location;
 
-        for(auto& file : entries){
-            if(i == file_path.size() - 1 - last || file.directory){
-                if(file.file_name == p){
-                    cluster_number = file.location;
+        //If it is the last part of the path, just return the number
+        if(i == file_path.size() - 1 - last){
+            return std::make_pair(true, cluster_number);
+        }
 
-                    //If it is the last part of the path, just return the
-                    //number
-                    if(i == file_path.size() - 1 - last){
-                        return std::make_pair(true, cluster_number);
-                    }
+        //Otherwise, continue with the next level of the path
+        if(!file.directory){
+            return std::make_pair(false, 0);
+        }
+    }
 
-                    //Otherwise, continue with the next level of the path
+    return std::make_pair(false, 0);
+}
 
-                    found = true;
+//Fill the file with the information of the entry, except its name and position
+void fat32::fat32_file_system::decode_entry(const cluster_entry& entry, vfs::file& file){
+    file.hidden = entry.attrib & 0x1;
+    file.system = entry.attrib & 0x2;
+    file.directory = entry.attrib & 0x10;
 
-                    break;
-                }
-            }
+    file.created.day = entry.creation_date & 0x1F;
+    file.created.month = (entry.creation_date >> 5) & 0xF;
+    file.created.year = (entry.creation_date >> 9) + 1980;
+
+    file.created.seconds = entry.creation_time & 0x1F;
+    file.created.minutes = (entry.creation_time >> 5) & 0x3F;
+    file.created.hour = entry.creation_time >> 11;
+
+    file.modified.day = entry.modification_date & 0x1F;
+    file.modified.month = (entry.modification_date >> 5) & 0xF;
+    file.modified.year = (entry.modification_date >> 9) + 1980;
+
+    file.modified.seconds = entry.modification_time & 0x1F;
+    file.modified.minutes = (entry.modification_time >> 5) & 0x3F;
+    file.modified.hour = entry.modification_time >> 11;
+
+    file.accessed.day = entry.accessed_date & 0x1F;
+    file.accessed.month = (entry.accessed_date >> 5) & 0xF;
+    file.accessed.year = (entry.accessed_date >> 9) + 1980;
+
+    if(file.directory){
+        //TODO Should read the cluster chain to get the number of
+        //clusters
+        file.size = fat_bs->sectors_per_cluster * 512;
+    } else {
+        file.size = entry.file_size;
+    }
+
+    file.location = (uint32_t(entry.cluster_high) << 16) + uint32_t(entry.cluster_low);
+
+    //Only the .. entries refer to the root directory as 0
+    if(file.location == 0 && file.directory){
+        file.location = fat_bs->root_directory_cluster_start;
+    }
+}
+
+fat32::directory_index* fat32::fat32_file_system::find_directory_index(uint32_t cluster){
+    for(auto& index : directory_indexes){
+        if(index.cluster == cluster){
+            return &index;
         }
+    }
 
-        if(!found){
-            return std::make_pair(false, 0);
+    return nullptr;
+}
+
+fat32::directory_index& fat32::fat32_file_system::get_directory_index(uint32_t cluster){
+    ++directory_indexes_clock;
+
+    directory_index* victim = &directory_indexes[0];
+
+    for(auto& index : directory_indexes){
+        if(index.cluster == cluster){
+            index.last_use = directory_indexes_clock;
+            return index;
+        }
+
+        if(index.last_use < victim->last_use){
+            victim = &index;
         }
     }
 
-    return std::make_pair(false, 0);
+    // Replace the least recently used index, the directory is decoded once.
+    // The victim is only claimed once the directory has been read from the disk
+    auto entries = files(cluster);
+
+    victim->cluster = cluster;
+    victim->last_use = directory_indexes_clock;
+    victim->removed = 0;
+    victim->files = std::move(entries);
+
+    rebuild_buckets(*victim);
+
+    return *victim;
+}
+
+bool fat32::fat32_file_system::find_entry(uint32_t directory, std::string_view name, vfs::file& file){
+    auto& index = get_directory_index(directory);
+
+    auto mask = index.buckets.size() - 1;
+    auto b = name_hash(name) & mask;
+
+    while(index.buckets[b]){
+        auto& entry = index.files[index.buckets[b] - 1];
+
+        if(entry.file_name == name){
+            file = entry;
+            return true;
+        }
+
+        b = (b + 1) & mask;
+    }
+
+    return false;
+}
+
+void fat32::fat32_file_system::index_entry(uint32_t directory, const vfs::file& file){
+    // The directory is indexed only when it is accessed
+    auto index = find_directory_index(directory);
+    if(!index){
+        return;
+    }
+
+    index->files.push_back(file);
+
+    if(2 * index->files.size() > index->buckets.size()){
+        rebuild_buckets(*index);
+    } else {
+        bucket_insert(*index, index->files.size() - 1);
+    }
+}
+
+void fat32::fat32_file_system::unindex_entry(uint32_t directory, size_t position){
+    auto index = find_directory_index(directory);
+    if(!index){
+        return;
+    }
+
+    for(auto& file : index->files){
+        if(!file.file_name.empty() && file.position == position){
+            // The entry stays in the table, but cannot match anymore
+            file.file_name.clear();
+            ++index->removed;
+            break;
+        }
+    }
+
+    if(2 * index->removed > index->files.size()){
+        rebuild_buckets(*index);
+    }
+}
+
+void fat32::fat32_file_system::reindex_entry(uint32_t directory, size_t position, const cluster_entry& entry){
+    auto index = find_directory_index(directory);
+    if(!index){
+        return;
+    }
+
+    for(auto& file : index->files){
+        if(!file.file_name.empty() && file.position == position){
+            decode_entry(entry, file);
+            break;
+        }
+    }
+}
+
+void fat32::fat32_file_system::drop_directory_index(uint32_t cluster){
+    auto index = find_directory_index(cluster);
+    if(!index){
+        return;
+    }
+
+    index->cluster = 0;
+    index->last_use = 0;
+    index->removed = 0;
+    index->files.clear();
+    index->buckets.clear();
+}
+
+//Return the position in the directory of the given entry of the given cluster
+size_t fat32::fat32_file_system::entry_position(uint32_t directory, uint32_t cluster, const cluster_entry* entry, std::unique_heap_array<cluster_entry>& directory_cluster){
+    size_t index = 0;
+
+    while(true){
+        auto c = chain_cluster(directory, index);
+
+        if(!c || c == cluster){
+            break;
+        }
+
+        ++index;
+    }
+
+    return index * directory_cluster.size() + (entry - directory_cluster.get());
 }
 
 //Return all the files in the directory denoted by its path
@@ -1291,12 +1697,19 @@ uint64_t fat32::fat32_file_system::cluster_lba(uint64_t cluster){
 //Return the value of the fat for the given cluster
 //Return 0 if an error occurs
 uint32_t fat32::fat32_file_system::read_fat_value(uint32_t cluster){
+    uint64_t entry_offset = cluster % (512 / sizeof(uint32_t));
+
+    // The modified sectors are more recent than the disk
+    auto dirty = find_fat_sector((cluster * sizeof(uint32_t)) / 512);
+    if(dirty){
+        return dirty->entries[entry_offset] & 0x0FFFFFFF;
+    }
+
     uint64_t fat_begin = fat_bs->reserved_sectors;
     uint64_t fat_sector = fat_begin + (cluster * sizeof(uint32_t)) / 512;
 
     std::unique_heap_array<uint32_t> fat_table(512 / sizeof(uint32_t));
     if(read_sectors(fat_sector, 1, fat_table.get())){
-        uint64_t entry_offset = cluster % (512 / sizeof(uint32_t));
         auto v = fat_table[entry_offset] & 0x0FFFFFFF;
         return v;
     } else {
@@ -1305,36 +1718,89 @@ uint32_t fat32::fat32_file_system::read_fat_value(uint32_t cluster){
 }
 
 //Write a value to the FAT for the given cluster
+//The value is only written to the disk by flush_fat()
 bool fat32::fat32_file_system::write_fat_value(uint32_t cluster, uint32_t value){
-    const auto fat_sectors = fat_bs->sectors_per_fat_long + fat_bs->sectors_per_fat;
+    uint64_t sector = (cluster * sizeof(uint32_t)) / 512;
 
-    uint64_t fat_begin = fat_bs->reserved_sectors;
-
-    for(size_t f = 0; f < fat_bs->number_of_fat; ++f){
-        uint64_t fat_sector = fat_begin + (cluster * sizeof(uint32_t)) / 512;
+    auto dirty = find_fat_sector(sector);
 
-        //Read the cluster we need to alter
-        std::unique_heap_array<uint32_t> fat_table(512 / sizeof(uint32_t));
-        if(!read_sectors(fat_sector, 1, fat_table.get())){
+    if(!dirty){
+        if(dirty_fat.size() == FAT_DIRTY_SECTORS && !flush_fat()){
             return false;
         }
 
-        //Set the entry to the given value
-        uint64_t entry_offset = cluster % (512 / sizeof(uint32_t));
-        fat_table[entry_offset] = value;
+        //Read the sector we need to alter from the first FAT
+        auto& entry = dirty_fat.emplace_back();
+        entry.sector = sector;
 
-        //Write back the cluster
-        if(!write_sectors(fat_sector, 1, fat_table.get())){
+        if(!read_sectors(fat_bs->reserved_sectors + sector, 1, entry.entries)){
+            dirty_fat.pop_back();
             return false;
         }
 
+        dirty = &entry;
+    }
+
+    //Set the entry to the given value
+    dirty->entries[cluster % (512 / sizeof(uint32_t))] = value;
+
+    set_cluster_free(cluster, value == CLUSTER_FREE);
+
+    // The chain containing the cluster changed
+    invalidate_cluster_maps(cluster);
+
+    // The free count and the allocation hint have changed
+    is_dirty = true;
+
+    return true;
+}
+
+fat32::fat_sector* fat32::fat32_file_system::find_fat_sector(uint64_t sector){
+    for(auto& dirty : dirty_fat){
+        if(dirty.sector == sector){
+            return &dirty;
+        }
+    }
+
+    return nullptr;
+}
+
+//Write the modified FAT sectors to every copy of the FAT
+bool fat32::fat32_file_system::flush_fat(){
+    if(dirty_fat.empty()){
+        return true;
+    }
+
+    const auto fat_sectors = fat_bs->sectors_per_fat_long + fat_bs->sectors_per_fat;
+
+    std::sort(dirty_fat.begin(), dirty_fat.end(), [](const fat_sector& lhs, const fat_sector& rhs){ return lhs.sector < rhs.sector; });
+
+    // The first FAT is written through the cache and is on the disk before
+    // the mirrors are written, so that one copy is always consistent. The
+    // mirrors can go through the write-back cache
+    uint64_t fat_begin = fat_bs->reserved_sectors;
+
+    for(size_t f = 0; f < fat_bs->number_of_fat; ++f){
+        for(auto& dirty : dirty_fat){
+            if(f == 0){
+                if(!write_sectors_direct(fat_begin + dirty.sector, 1, dirty.entries)){
+                    return false;
+                }
+            } else if(!write_sectors(fat_begin + dirty.sector, 1, dirty.entries)){
+                return false;
+            }
+        }
+
         // Switch to the next FAT
         fat_begin += fat_sectors;
     }
 
+    dirty_fat.clear();
+
     return true;
 }
 
+
 //Return the next cluster in the chain for the give cluster
 //0 indicates that there is no next cluster
 uint32_t fat32::fat32_file_system::next_cluster(uint32_t cluster){
@@ -1346,49 +1812,303 @@ uint32_t fat32::fat32_file_system::next_cluster(uint32_t cluster){
     return fat_value;
 }
 
-//Find a free cluster in the disk
+//Return the cluster at the given index in the chain starting at the given cluster
+//0 indicates that the chain is shorter or corrupted
+uint32_t fat32::fat32_file_system::chain_cluster(uint32_t start, size_t index){
+    if(start < 2){
+        return 0;
+    }
+
+    auto& map = get_cluster_map(start);
+
+    // Follow the chain in the FAT only up to the needed cluster
+    while(index >= map.clusters && !map.complete){
+        uint32_t next = start;
+
+        if(!map.extents.empty()){
+            auto& last = map.extents.back();
+            next = next_cluster(last.cluster + last.length - 1);
+        }
+
+        if(next < 2 || next == CLUSTER_CORRUPTED){
+            map.complete = true;
+            break;
+        }
+
+        if(!map.extents.empty() && map.extents.back().cluster + map.extents.back().length == next){
+            ++map.extents.back().length;
+        } else {
+            map.extents.push_back({uint32_t(map.clusters), next, 1});
+        }
+
+        ++map.clusters;
+    }
+
+    if(index >= map.clusters){
+        return 0;
+    }
+
+    // Find the last extent starting at or before the index
+    size_t low = 0;
+    size_t high = map.extents.size();
+
+    while(high - low > 1){
+        auto middle = (low + high) / 2;
+
+        if(map.extents[middle].index <= index){
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    return map.extents[low].cluster + (index - map.extents[low].index);
+}
+
+//Return the cached cluster map of the chain starting at the given cluster
+fat32::cluster_map& fat32::fat32_file_system::get_cluster_map(uint32_t start){
+    ++cluster_maps_clock;
+
+    cluster_map* victim = &cluster_maps[0];
+
+    for(auto& map : cluster_maps){
+        if(map.start == start){
+            map.last_use = cluster_maps_clock;
+            return map;
+        }
+
+        if(map.last_use < victim->last_use){
+            victim = &map;
+        }
+    }
+
+    // Replace the least recently used map
+    victim->start = start;
+    victim->clusters = 0;
+    victim->complete = false;
+    victim->last_use = cluster_maps_clock;
+    victim->extents.clear();
+
+    return *victim;
+}
+
+//Forget the cluster maps of the chain containing the given cluster
+void fat32::fat32_file_system::invalidate_cluster_maps(uint32_t cluster){
+    for(auto& map : cluster_maps){
+        if(!map.start){
+            continue;
+        }
+
+        bool contains = map.start == cluster;
+
+        for(auto& extent : map.extents){
+            if(cluster >= extent.cluster && cluster < extent.cluster + extent.length){
+                contains = true;
+                break;
+            }
+        }
+
+        if(contains){
+            map.start = 0;
+            map.clusters = 0;
+            map.complete = false;
+            map.last_use = 0;
+            map.extents.clear();
+        }
+    }
+}
+
+//Find a free cluster in the disk and reserve it
 //0 indicates failure or disk full
 uint32_t fat32::fat32_file_system::find_free_cluster(){
-    uint64_t fat_begin = fat_bs->reserved_sectors;
+    size_t length = 0;
+    return find_free_run(1, fat_is->allocated_clusters, length);
+}
 
-    static constexpr const auto entries_per_sector = 512 / sizeof(uint32_t);
+uint32_t fat32::fat32_file_system::find_free_run(size_t wanted, uint32_t hint, size_t& length){
+    if(!free_bitmap.get() && !load_free_bitmap()){
+        return 0; //0 is not a valid cluster number, indicates failure
+    }
+
+    if(hint < 2 || hint >= clusters){
+        hint = 2;
+    }
+
+    uint32_t best_start = 0;
+    size_t best_length = 0;
+
+    // Look for the first run long enough, remembering the longest one
+    auto scan = [&](uint32_t from, uint32_t to) -> bool {
+        uint32_t run_start = 0;
+        size_t run_length = 0;
+
+        for(uint32_t cluster = from; cluster < to;){
+            auto word = free_bitmap[cluster / 64];
+
+            if(cluster % 64 == 0 && cluster + 64 <= to && (word == 0 || word == ~uint64_t(0))){
+                // Skip the whole word at once
+                if(word){
+                    if(!run_length){
+                        run_start = cluster;
+                    }
+
+                    run_length += 64;
+                } else {
+                    run_length = 0;
+                }
+
+                cluster += 64;
+            } else {
+                if(word & (uint64_t(1) << (cluster % 64))){
+                    if(!run_length){
+                        run_start = cluster;
+                    }
+
+                    ++run_length;
+                } else {
+                    run_length = 0;
+                }
+
+                ++cluster;
+            }
+
+            if(run_length > best_length){
+                best_start = run_start;
+                best_length = run_length;
+
+                if(best_length >= wanted){
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    };
+
+    // Start from the hint, the next clusters are likely free
+    if(!scan(hint, clusters)){
+        scan(2, hint);
+    }
+
+    if(!best_length){
+        return 0; //0 is not a valid cluster number, indicates failure
+    }
 
-    std::unique_heap_array<uint32_t> fat_table(entries_per_sector);
+    length = std::min(best_length, wanted);
+
+    // The clusters are reserved until the caller links them in the FAT
+    for(size_t i = 0; i < length; ++i){
+        set_cluster_free(best_start + i, false);
+    }
+
+    fat_is->allocated_clusters = best_start + length - 1;
+
+    return best_start;
+}
+
+//Build the bitmap of the free clusters from the FAT
+bool fat32::fat32_file_system::load_free_bitmap(){
+    static constexpr const auto entries_per_sector = 512 / sizeof(uint32_t);
 
     const auto fat_sectors = fat_bs->sectors_per_fat_long + fat_bs->sectors_per_fat;
 
-    // Iterate over each sector of the FAT
-    for(size_t j = 0; j < fat_sectors; ++j){
-        uint64_t fat_sector = fat_begin + j;
+    // The number of clusters is limited by the size of the data region and by the FAT
+    uint64_t fat_begin = fat_bs->reserved_sectors;
+    uint64_t data_sectors = fat_bs->total_sectors_long - cluster_lba(2);
 
-        // Read one sector of the FAT
-        if(!read_sectors(fat_sector, 1, fat_table.get())){
-            return 0; //0 is not a valid cluster number, indicates failure
+    clusters = std::min(uint64_t(data_sectors / fat_bs->sectors_per_cluster + 2), uint64_t(fat_sectors * entries_per_sector));
+
+    // The scan must see the modified sectors
+    if(!flush_fat()){
+        clusters = 0;
+        return false;
+    }
+
+    std::unique_heap_array<uint64_t> bitmap((clusters + 63) / 64);
+    std::fill_n(bitmap.get(), bitmap.size(), 0);
+
+    std::unique_heap_array<uint32_t> fat_table(FAT_SCAN_SECTORS * entries_per_sector);
+
+    uint32_t free = 0;
+
+    // The FAT is read directly, the scan would evict the whole cache otherwise
+    for(size_t j = 0; j < fat_sectors; j += FAT_SCAN_SECTORS){
+        auto sectors = std::min(FAT_SCAN_SECTORS, fat_sectors - j);
+
+        if(!read_sectors_direct(fat_begin + j, sectors, fat_table.get())){
+            clusters = 0;
+            return false;
         }
 
-        // Check all cluster
-        for(size_t i = 0; i < fat_table.size(); ++i){
+        for(size_t i = 0; i < sectors * entries_per_sector; ++i){
+            auto cluster = j * entries_per_sector + i;
+
             //Cluster 0 and 1 are not valid cluster
-            if(j == 0 && i < 2){
+            if(cluster < 2 || cluster >= clusters){
                 continue;
             }
 
-            auto value = fat_table[i] & 0x0FFFFFFF;
-            if(value == CLUSTER_FREE){
-                return i + j * entries_per_sector;
+            if((fat_table[i] & 0x0FFFFFFF) == CLUSTER_FREE){
+                bitmap[cluster / 64] |= uint64_t(1) << (cluster % 64);
+                ++free;
             }
         }
     }
 
-    return 0; //0 is not a valid cluster number, indicates failure
+    free_bitmap = std::move(bitmap);
+
+    if(fat_is->free_clusters != free){
+        logging::logf(logging::log_level::TRACE, "fat32: Free clusters: %u (FSInfo: %u)\n", uint64_t(free), uint64_t(fat_is->free_clusters));
+
+        fat_is->free_clusters = free;
+        is_dirty = true;
+    }
+
+    return true;
+}
+
+//Update the bitmap of the free clusters, if it is built
+void fat32::fat32_file_system::set_cluster_free(uint32_t cluster, bool free){
+    if(!free_bitmap.get() || cluster >= clusters){
+        return;
+    }
+
+    if(free){
+        free_bitmap[cluster / 64] |= uint64_t(1) << (cluster % 64);
+    } else {
+        free_bitmap[cluster / 64] &= ~(uint64_t(1) << (cluster % 64));
+    }
 }
 
-bool fat32::fat32_file_system::read_sectors(uint64_t start, uint8_t count, void* destination){
+bool fat32::fat32_file_system::read_sectors(uint64_t start, size_t count, void* destination){
     auto result = vfs::direct_read(device, reinterpret_cast<char*>(destination), count * 512, start * 512);
     return result && *result == count * 512;
 }
 
-bool fat32::fat32_file_system::write_sectors(uint64_t start, uint8_t count, void* source){
+bool fat32::fat32_file_system::clear_sectors(uint64_t start, size_t count){
+    size_t written = 0;
+    auto result = devfs::clear_device(device, count * 512, start * 512, written);
+    return !result && written == count * 512;
+}
+
+void fat32::fat32_file_system::prefetch_sectors(uint64_t start, size_t count){
+    // This is only a hint, the sectors are read again later anyway
+    devfs::prefetch_device(device, count * 512, start * 512);
+}
+
+bool fat32::fat32_file_system::write_sectors(uint64_t start, size_t count, const void* source){
     auto result = vfs::direct_write(device, reinterpret_cast<const char*>(source), count * 512, start * 512);
     return result && *result == count * 512;
 }
+
+bool fat32::fat32_file_system::read_sectors_direct(uint64_t start, size_t count, void* destination){
+    size_t read = 0;
+    auto result = devfs::read_device_direct(device, reinterpret_cast<char*>(destination), count * 512, start * 512, read);
+    return !result && read == count * 512;
+}
+
+bool fat32::fat32_file_system::write_sectors_direct(uint64_t start, size_t count, const void* source){
+    size_t written = 0;
+    auto result = devfs::write_device_direct(device, reinterpret_cast<const char*>(source), count * 512, start * 512, written);
+    return !result && written == count * 512;
+}
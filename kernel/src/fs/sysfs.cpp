@@ -25,6 +25,7 @@ struct sys_value {
     std::string _value;
     sysfs::dynamic_fun_t fun           = nullptr;
     sysfs::dynamic_fun_data_t fun_data = nullptr;
+    sysfs::writable_fun_data_t setter  = nullptr;
     void* data                         = nullptr;
 
     sys_value() {}
@@ -43,6 +44,11 @@ struct sys_value {
         //Nothing else to init
     }
 
+    sys_value(std::string_view name, sysfs::dynamic_fun_data_t fun_data, sysfs::writable_fun_data_t setter, void* data)
+            : name(name.begin(), name.end()), fun_data(fun_data), setter(setter), data(data) {
+        //Nothing else to init
+    }
+
     sys_value(sys_value&) = default;
     sys_value(sys_value&&) = default;
 
@@ -196,6 +202,50 @@ size_t read(const sys_folder& folder, const path& file_path, char* buffer, size_
     return std::ERROR_NOT_EXISTS;
 }
 
+size_t write(sys_folder& folder, const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) {
+    for (auto& file : folder.values) {
+        if (file.name == file_path.base_name()) {
+            if (!file.setter) {
+                return std::ERROR_PERMISSION_DENIED;
+            }
+
+            // Values are always written at once
+            if (offset) {
+                return std::ERROR_INVALID_OFFSET;
+            }
+
+            // Ignore the trailing new line
+            auto length = count;
+            while (length && (buffer[length - 1] == '\n' || buffer[length - 1] == '\0')) {
+                --length;
+            }
+
+            std::string value;
+            for (size_t i = 0; i < length; ++i) {
+                value += buffer[i];
+            }
+
+            auto result = file.setter(file.data, value);
+
+            if (result) {
+                return result;
+            }
+
+            written = count;
+
+            return 0;
+        }
+    }
+
+    for (auto& file : folder.folders) {
+        if (file.name == file_path.base_name()) {
+            return std::ERROR_DIRECTORY;
+        }
+    }
+
+    return std::ERROR_NOT_EXISTS;
+}
+
 void set_value(sys_folder& folder, std::string_view name, const std::string& value) {
     for (auto& v : folder.values) {
         if (v.name == name) {
@@ -230,6 +280,19 @@ void set_value(sys_folder& folder, std::string_view name, sysfs::dynamic_fun_dat
     folder.values.emplace_back(name, fun, data);
 }
 
+void set_value(sys_folder& folder, std::string_view name, sysfs::dynamic_fun_data_t fun, sysfs::writable_fun_data_t setter, void* data) {
+    for (auto& v : folder.values) {
+        if (v.name == name) {
+            v.fun_data = fun;
+            v.setter   = setter;
+            v.data     = data;
+            return;
+        }
+    }
+
+    folder.values.emplace_back(name, fun, setter, data);
+}
+
 void delete_value(sys_folder& folder, std::string_view name) {
     folder.values.erase(std::remove_if(folder.values.begin(), folder.values.end(), [&name](const sys_value& value){
         return value.name == name;
@@ -299,8 +362,22 @@ size_t sysfs::sysfs_file_system::read(const path& /*file_path*/, char* /*buffer*
     return std::ERROR_UNSUPPORTED;
 }
 
-size_t sysfs::sysfs_file_system::write(const path&, const char*, size_t, size_t, size_t&) {
-    return std::ERROR_PERMISSION_DENIED;
+size_t sysfs::sysfs_file_system::write(const path& file_path, const char* buffer, size_t count, size_t offset, size_t& written) {
+    auto& root_folder = find_root_folder(mount_point);
+
+    if (file_path.is_root()) {
+        return std::ERROR_DIRECTORY;
+    } else if (file_path.size() == 2) {
+        return ::write(root_folder, file_path, buffer, count, offset, written);
+    } else {
+        if (exists_folder(root_folder, file_path, 1, file_path.size() - 1)) {
+            auto& folder = find_folder(root_folder, file_path, 1, file_path.size() - 1);
+
+            return ::write(folder, file_path, buffer, count, offset, written);
+        }
+
+        return std::ERROR_NOT_EXISTS;
+    }
 }
 
 size_t sysfs::sysfs_file_system::clear(const path&, size_t, size_t, size_t&) {
@@ -379,6 +456,33 @@ void sysfs::set_dynamic_value_data(const path& mount_point, const path& file_pat
     }
 }
 
+void sysfs::set_writable_value_data(const path& mount_point, const path& file_path, dynamic_fun_data_t getter, writable_fun_data_t setter, void* data) {
+    auto& root_folder = find_root_folder(mount_point);
+
+    if (file_path.size() == 2) {
+        ::set_value(root_folder, file_path.base_name(), getter, setter, data);
+    } else {
+        auto& folder = find_folder(root_folder, file_path, 1, file_path.size() - 1);
+        ::set_value(folder, file_path.base_name(), getter, setter, data);
+    }
+}
+
+size_t sysfs::parse_value(const std::string& value, size_t& result) {
+    if (value.empty()) {
+        return std::ERROR_INVALID_REQUEST;
+    }
+
+    for (auto c : value) {
+        if (c < '0' || c > '9') {
+            return std::ERROR_INVALID_REQUEST;
+        }
+    }
+
+    result = std::parse(value);
+
+    return 0;
+}
+
 void sysfs::delete_value(const path& mount_point, const path& file_path) {
     auto& root_folder = find_root_folder(mount_point);
 
@@ -20,6 +20,11 @@
 
 namespace {
 
+constexpr const uint64_t PF_PRESENT = 0x1; ///< Page fault error code bit for a present page
+constexpr const uint64_t PF_WRITE   = 0x2; ///< Page fault error code bit for a write access
+
+constexpr const uint64_t RFLAGS_IF = 0x200; ///< The interrupt flag in RFLAGS
+
 struct idt_flags {
     uint8_t type    : 4;
     uint8_t zero    : 1;
@@ -266,6 +271,28 @@ void _fault_handler(interrupt::fault_regs regs){
     }
 }
 
+bool _page_fault_handler(uint64_t error_code, uint64_t rflags){
+    // Read the address before another fault can happen
+    auto address = get_cr2();
+
+    // Only the missing pages can be resolved, and only when the faulting code
+    // can be interrupted, since the file must be read
+    if(!scheduler::is_started() || (error_code & PF_PRESENT) || !(rflags & RFLAGS_IF)){
+        return false;
+    }
+
+    enable_interrupts();
+
+    if(scheduler::page_fault(address, error_code & PF_WRITE)){
+        return true;
+    }
+
+    // The fault handler runs with interrupts disabled
+    asm volatile("cli" : : );
+
+    return false;
+}
+
 void _irq_handler(interrupt::syscall_regs* regs){
     //If the IRQ is on the slave controller, send EOI to it
     if(regs->code >= 8){
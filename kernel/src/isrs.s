@@ -44,7 +44,6 @@ create_irq 10
 create_irq 11
 create_irq 12
 create_irq 13
-create_irq 14
 create_irq_dummy 15
 create_irq_dummy 16
 create_irq_dummy 17
@@ -63,6 +62,34 @@ create_irq_dummy 29
 create_irq_dummy 30
 create_irq_dummy 31
 
+// The page faults on the memory mapped files are resolved, the context is
+// saved to return to the faulting code
+.global _isr14
+_isr14:
+    push 14
+
+    save_context
+
+    mov rdi, [rsp + 384] // The error code
+    mov rsi, [rsp + 408] // The flags of the faulting code
+    call _page_fault_handler
+
+    test al, al
+    jz page_fault_unresolved
+
+    restore_context
+
+    add rsp, 16 // Cleans the pushed number and error code
+
+    iretq
+
+page_fault_unresolved:
+    restore_context
+
+    push rbp
+
+    jmp isr_common_handler
+
 isr_common_handler:
     //TODO Kernel segments should be restored
 
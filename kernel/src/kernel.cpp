@@ -15,6 +15,8 @@
 #include "drivers/mouse.hpp"
 #include "drivers/serial.hpp"
 #include "disks.hpp"
+#include "buffer_cache.hpp"
+#include "block_io.hpp"
 #include "drivers/pci.hpp"
 #include "acpi.hpp"
 #include "interrupts.hpp"
@@ -29,6 +31,7 @@
 #include "logging.hpp"
 #include "net/network.hpp"
 #include "vfs/vfs.hpp"
+#include "vfs/page_cache.hpp"
 #include "fs/sysfs.hpp"
 #include "drivers/hpet.hpp"
 
@@ -109,8 +112,10 @@ void kernel_main(){
     timer::install();
     keyboard::install_driver();
     mouse::install();
-    disks::detect_disks();
     pci::detect_devices();
+    buffer_cache::init();
+    page_cache::init();
+    disks::detect_disks();
     network::init();
     stdio::register_devices();
 
@@ -129,6 +134,8 @@ void kernel_main(){
     // Start the secondary kernel processes
     network::finalize();
     stdio::finalize();
+    block_completion::finalize();
+    buffer_cache::finalize();
 
     // Report some information before starting the scheduler
     logging::logf(logging::log_level::TRACE, "Allocations before start of scheduler: %u\n", kalloc::allocations());
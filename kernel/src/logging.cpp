@@ -42,13 +42,22 @@ inline const char* level_to_string(logging::log_level level){
     return "UNKNOWN";
 }
 
+constexpr const size_t LOG_RESERVE = 64 * 1024; ///< The granularity of the space reserved for the log file
+
 void append_to_file(const char* s, size_t length){
     auto fd = vfs::open("/messages", std::OPEN_CREATE);
 
     if(fd){
         vfs::stat_info info;
         if(vfs::stat(*fd, info)){
-            if(vfs::truncate(*fd, info.size + length + 1)){
+            auto size = info.size + length + 1;
+
+            //The log grows by small pieces, its space is reserved ahead to keep it contiguous
+            if(!info.size || size / LOG_RESERVE != info.size / LOG_RESERVE){
+                vfs::fallocate(*fd, (size / LOG_RESERVE + 1) * LOG_RESERVE);
+            }
+
+            if(vfs::truncate(*fd, size)){
                 std::string buffer = s;
                 buffer += '\n';
 
@@ -500,7 +500,7 @@ void clear_physical_page(size_t physical){
 }
 
 //TODO It is highly inefficient to remap CR3 each time
-bool paging::user_map(scheduler::process_t& process, size_t virt, size_t physical){
+bool paging::user_map(scheduler::process_t& process, size_t virt, size_t physical, uint8_t flags){
     physical_pointer cr3_ptr(process.physical_cr3, 1);
 
     if(!cr3_ptr){
@@ -573,11 +573,71 @@ bool paging::user_map(scheduler::process_t& process, size_t virt, size_t physica
     auto pt = pt_ptr.as<pt_t>();
 
     //Map to the physical address
-    pt[pte] = reinterpret_cast<page_entry>(physical | WRITE | USER | PRESENT);
+    pt[pte] = reinterpret_cast<page_entry>(physical | flags);
+
+    //The page may be remapped in the current process
+    flush_tlb(virt);
 
     return true;
 }
 
+size_t paging::user_unmap(scheduler::process_t& process, size_t virt){
+    physical_pointer cr3_ptr(process.physical_cr3, 1);
+
+    if(!cr3_ptr){
+        return 0;
+    }
+
+    //Find the correct indexes inside the paging table for the virtual address
+    auto pml4e = pml4_entry(virt);
+    auto pdpte = pdpt_entry(virt);
+    auto pde = pd_entry(virt);
+    auto pte = pt_entry(virt);
+
+    auto pml4t = cr3_ptr.as<pml4t_t>();
+    if(!(reinterpret_cast<uintptr_t>(pml4t[pml4e]) & PRESENT)){
+        return 0;
+    }
+
+    physical_pointer pdpt_ptr(reinterpret_cast<uintptr_t>(pml4t[pml4e]) & ~0xFFF, 1);
+
+    if(!pdpt_ptr){
+        return 0;
+    }
+
+    auto pdpt = pdpt_ptr.as<pdpt_t>();
+    if(!(reinterpret_cast<uintptr_t>(pdpt[pdpte]) & PRESENT)){
+        return 0;
+    }
+
+    physical_pointer pd_ptr(reinterpret_cast<uintptr_t>(pdpt[pdpte]) & ~0xFFF, 1);
+
+    if(!pd_ptr){
+        return 0;
+    }
+
+    auto pd = pd_ptr.as<pd_t>();
+    if(!(reinterpret_cast<uintptr_t>(pd[pde]) & PRESENT)){
+        return 0;
+    }
+
+    physical_pointer pt_ptr(reinterpret_cast<uintptr_t>(pd[pde]) & ~0xFFF, 1);
+
+    if(!pt_ptr){
+        return 0;
+    }
+
+    auto pt = pt_ptr.as<pt_t>();
+
+    auto entry = reinterpret_cast<uintptr_t>(pt[pte]);
+
+    pt[pte] = reinterpret_cast<page_entry>(0);
+
+    flush_tlb(virt);
+
+    return entry;
+}
+
 bool paging::user_map_pages(scheduler::process_t& process, size_t virt, size_t physical, size_t pages){
     //Map each page
     for(size_t page = 0; page < pages; ++page){
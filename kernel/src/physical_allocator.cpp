@@ -5,6 +5,9 @@
 //  http://www.opensource.org/licenses/MIT)
 //=======================================================================
 
+#include <array.hpp>
+#include <algorithms.hpp>
+
 #include "physical_allocator.hpp"
 #include "e820.hpp"
 #include "paging.hpp"
@@ -34,6 +37,12 @@ buddy_type allocator;
 size_t first_physical_address;
 size_t last_physical_address;
 
+// The caches are shrunk when less than this memory would remain free
+constexpr const size_t low_watermark = 4 * 1024 * 1024;
+
+std::array<physical_allocator::shrinker_t, 8> shrinkers;
+size_t number_of_shrinkers = 0;
+
 bool buddy = false;
 size_t buddy_managed_space = 0;
 size_t buddy_allocated_memory = 0;
@@ -218,8 +227,27 @@ void physical_allocator::finalize(){
     }
 }
 
+void physical_allocator::register_shrinker(shrinker_t shrinker){
+    thor_assert(number_of_shrinkers < shrinkers.size(), "Too many shrinkers");
+
+    shrinkers[number_of_shrinkers++] = shrinker;
+}
+
 size_t physical_allocator::allocate(size_t blocks){
-    thor_assert(blocks * paging::PAGE_SIZE < free(), "Not enough physical memory");
+    // Ask the caches to give back memory before running out of it
+    if(buddy && blocks * paging::PAGE_SIZE + low_watermark > free()){
+        auto needed = (blocks * paging::PAGE_SIZE + low_watermark - free()) / paging::PAGE_SIZE + 1;
+
+        for(size_t i = 0; i < number_of_shrinkers && needed; ++i){
+            auto released = shrinkers[i](needed);
+            needed -= std::min(released, needed);
+        }
+    }
+
+    if(blocks * paging::PAGE_SIZE >= free()){
+        logging::logf(logging::log_level::ERROR, "palloc: Not enough physical memory for %u blocks\n", blocks);
+        return 0;
+    }
 
     buddy_allocated_memory += buddy_type::level_size(blocks) * unit;
 
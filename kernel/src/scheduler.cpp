@@ -13,6 +13,7 @@
 
 #include <tlib/errors.hpp>
 #include <tlib/elf.hpp>
+#include <tlib/flags.hpp>
 
 #include "conc/int_lock.hpp"
 
@@ -33,6 +34,8 @@
 
 #include "fs/procfs.hpp"
 
+#include "vfs/vfs.hpp"
+
 //Provided by task_switch.s
 extern "C" {
 extern void task_switch(size_t current, size_t next);
@@ -84,6 +87,88 @@ void idle_task(){
     }
 }
 
+// Unmap the pages of a mapping and write back the modified ones
+void release_mapping(scheduler::process_t& process, scheduler::mapping_t& mapping){
+    for(size_t i = 0; i < mapping.pages.size(); ++i){
+        auto physical = mapping.pages[i];
+
+        if(!physical){
+            continue;
+        }
+
+        auto entry = paging::user_unmap(process, mapping.virtual_start + i * paging::PAGE_SIZE);
+        auto offset = mapping.offset + i * paging::PAGE_SIZE;
+
+        // The processor marks the pages written since they were mapped
+        if(mapping.writable && (entry & paging::DIRTY) && offset < mapping.file_size){
+            physical_pointer page_ptr(physical, 1);
+
+            auto count = std::min(paging::PAGE_SIZE, mapping.file_size - offset);
+            auto result = page_ptr ? vfs::write(*mapping.file, page_ptr.as_ptr<char>(), count, offset)
+                                   : std::make_unexpected<size_t>(std::ERROR_FAILED);
+
+            if(!result){
+                logging::logf(logging::log_level::ERROR, "mmap: Unable to write back p%u at %h: %s\n",
+                    process.pid, mapping.virtual_start + i * paging::PAGE_SIZE, std::error_message(result.error()));
+            }
+        }
+
+        physical_allocator::free(physical, 1);
+    }
+
+    mapping.pages.clear();
+}
+
+// Find room for a new mapping, first in the released ranges
+size_t allocate_mmap_range(scheduler::process_t& process, size_t size){
+    auto& ranges = process.mmap_free;
+
+    for(size_t i = 0; i < ranges.size(); ++i){
+        if(ranges[i].size >= size){
+            auto start = ranges[i].virtual_start;
+
+            if(ranges[i].size == size){
+                ranges.erase(i);
+            } else {
+                ranges[i].virtual_start += size;
+                ranges[i].size -= size;
+            }
+
+            return start;
+        }
+    }
+
+    auto start = process.mmap_end;
+    process.mmap_end += size;
+    return start;
+}
+
+// Release the range of a mapping, merged with the released ranges around it
+void free_mmap_range(scheduler::process_t& process, size_t start, size_t size){
+    auto& ranges = process.mmap_free;
+
+    // The released ranges are never adjacent, there is at most one on each side
+    for(size_t i = 0; i < ranges.size();){
+        if(ranges[i].virtual_start + ranges[i].size == start){
+            start = ranges[i].virtual_start;
+            size += ranges[i].size;
+            ranges.erase(i);
+        } else if(start + size == ranges[i].virtual_start){
+            size += ranges[i].size;
+            ranges.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    // A range at the end of the area is given back to it
+    if(start + size == process.mmap_end){
+        process.mmap_end = start;
+    } else {
+        ranges.push_back({start, size});
+    }
+}
+
 void gc_task(){
     while(true){
         //Wait until there is something to do
@@ -106,6 +191,14 @@ void gc_task(){
                     }
                 }
 
+                // The paging structures still hold the dirty bits of the mapped
+                // files, the modified pages are written back before they are freed
+                for(auto& mapping : desc.mappings){
+                    release_mapping(desc, mapping);
+                }
+                desc.mappings.clear();
+                desc.mmap_free.clear();
+
                 // 1. Release physical memory of PML4T (if not system task)
 
                 if(!desc.system){
@@ -174,6 +267,7 @@ void gc_task(){
                 desc.paging_size = 0;
                 desc.context = nullptr;
                 desc.brk_start = desc.brk_end = 0;
+                desc.mmap_end = 0;
 
                 // 7. Clean file handles
                 //TODO If not empty, probably something should be done
@@ -270,6 +364,7 @@ scheduler::process_t& new_process(){
 
     process.process.brk_start = 0;
     process.process.brk_end = 0;
+    process.process.mmap_end = 0;
 
     process.process.wait.pid = pid;
     process.process.wait.next = nullptr;
@@ -325,9 +420,9 @@ void create_init_tasks(){
         auto tty = "/dev/tty" + std::to_string(i);
 
         // Create the 0,1,2 file descriptors
-        pcb[pid].handles.emplace_back(tty);
-        pcb[pid].handles.emplace_back(tty);
-        pcb[pid].handles.emplace_back(tty);
+        pcb[pid].handles.emplace_back(path(tty));
+        pcb[pid].handles.emplace_back(path(tty));
+        pcb[pid].handles.emplace_back(path(tty));
 
         scheduler::queue_system_process(pid);
 
@@ -752,6 +847,7 @@ std::expected<scheduler::pid_t> scheduler::exec(const std::string& file, const s
 
     process.brk_start = program_break;
     process.brk_end = program_break;
+    process.mmap_end = program_mmap;
 
     init_context(process, buffer, file, params);
 
@@ -800,6 +896,180 @@ void scheduler::sbrk(size_t inc){
     process.brk_end += size;
 }
 
+std::expected<size_t> scheduler::mmap(size_t fd, size_t offset, size_t size, size_t prot){
+    auto& process = pcb[current_pid].process;
+
+    if(process.system){
+        return std::make_unexpected<size_t>(std::ERROR_UNSUPPORTED);
+    }
+
+    if(!size){
+        return std::make_unexpected<size_t>(std::ERROR_INVALID_COUNT);
+    }
+
+    if(!paging::page_aligned(offset)){
+        return std::make_unexpected<size_t>(std::ERROR_INVALID_OFFSET);
+    }
+
+    vfs::stat_info info;
+    auto status = vfs::stat(fd, info);
+
+    if(!status){
+        return std::make_unexpected<size_t>(status.error());
+    }
+
+    if(info.flags & vfs::STAT_FLAG_DIRECTORY){
+        return std::make_unexpected<size_t>(std::ERROR_DIRECTORY);
+    }
+
+    if(offset > info.size){
+        return std::make_unexpected<size_t>(std::ERROR_INVALID_OFFSET);
+    }
+
+    auto pages = paging::pages(size);
+
+    process.mappings.emplace_back();
+
+    auto& mapping = process.mappings.back();
+    mapping.virtual_start = allocate_mmap_range(process, pages * paging::PAGE_SIZE);
+    mapping.size = pages * paging::PAGE_SIZE;
+    mapping.offset = offset;
+    mapping.file_size = info.size;
+    mapping.writable = prot & std::MMAP_WRITE;
+    mapping.file = pcb[current_pid].handles[fd - 1].file;
+    mapping.pages.resize(pages);
+
+    logging::logf(logging::log_level::DEBUG, "mmap: Map(p%u) %u pages of fd %u at %h\n", process.pid, pages, fd, mapping.virtual_start);
+
+    return mapping.virtual_start;
+}
+
+std::expected<void> scheduler::munmap(size_t address){
+    auto& process = pcb[current_pid].process;
+
+    for(size_t i = 0; i < process.mappings.size(); ++i){
+        if(process.mappings[i].virtual_start == address){
+            release_mapping(process, process.mappings[i]);
+            free_mmap_range(process, process.mappings[i].virtual_start, process.mappings[i].size);
+            process.mappings.erase(i);
+
+            return {};
+        }
+    }
+
+    return std::make_unexpected<void>(std::ERROR_INVALID_REQUEST);
+}
+
+void scheduler::munmap_all(){
+    auto& process = pcb[current_pid].process;
+
+    for(auto& mapping : process.mappings){
+        release_mapping(process, mapping);
+        free_mmap_range(process, mapping.virtual_start, mapping.size);
+    }
+
+    process.mappings.clear();
+}
+
+bool scheduler::page_fault(size_t address, bool write){
+    auto& process = pcb[current_pid].process;
+
+    if(process.system){
+        return false;
+    }
+
+    for(auto& mapping : process.mappings){
+        if(address < mapping.virtual_start || address >= mapping.virtual_start + mapping.size){
+            continue;
+        }
+
+        auto index = (address - mapping.virtual_start) / paging::PAGE_SIZE;
+
+        // A mapped page only faults on a forbidden access
+        if(mapping.pages[index] || (write && !mapping.writable)){
+            return false;
+        }
+
+        auto physical = physical_allocator::allocate(1);
+
+        if(!physical){
+            logging::logf(logging::log_level::DEBUG, "mmap: Impossible to allocate a page for process %u\n", process.pid);
+            return false;
+        }
+
+        {
+            physical_pointer page_ptr(physical, 1);
+
+            if(!page_ptr){
+                physical_allocator::free(physical, 1);
+                return false;
+            }
+
+            auto* data = page_ptr.as_ptr<char>();
+            auto offset = mapping.offset + index * paging::PAGE_SIZE;
+
+            // The end of the last page of the file is left zeroed
+            std::fill_n(data, paging::PAGE_SIZE, 0);
+
+            if(offset < mapping.file_size){
+                auto count = std::min(paging::PAGE_SIZE, mapping.file_size - offset);
+                auto result = vfs::read(*mapping.file, data, count, offset);
+
+                if(!result){
+                    logging::logf(logging::log_level::ERROR, "mmap: Unable to read p%u at %h: %s\n",
+                        process.pid, address, std::error_message(result.error()));
+
+                    physical_allocator::free(physical, 1);
+                    return false;
+                }
+            }
+        }
+
+        auto flags = paging::PRESENT | paging::USER | (mapping.writable ? paging::WRITE : 0);
+        auto virt = mapping.virtual_start + index * paging::PAGE_SIZE;
+
+        if(!paging::user_map(process, virt, physical, flags)){
+            physical_allocator::free(physical, 1);
+            return false;
+        }
+
+        mapping.pages[index] = physical;
+
+        return true;
+    }
+
+    return false;
+}
+
+std::expected<void> scheduler::populate(size_t address, size_t size, bool write){
+    auto& process = pcb[current_pid].process;
+
+    // The range is clamped to the end of the address space
+    auto end = size > size_t(-1) - address ? size_t(-1) : address + size;
+
+    for(auto& mapping : process.mappings){
+        auto first = std::max(address, mapping.virtual_start);
+        auto last = std::min(end, mapping.virtual_start + mapping.size);
+
+        if(first >= last){
+            continue;
+        }
+
+        // The kernel must not fault on the buffer, check the access first
+        if(write && !mapping.writable){
+            return std::make_unexpected<void>(std::ERROR_PERMISSION_DENIED);
+        }
+
+        for(auto page = paging::page_align(first); page < last; page += paging::PAGE_SIZE){
+            if(!mapping.pages[(page - mapping.virtual_start) / paging::PAGE_SIZE] && !page_fault(page, write)){
+                return std::make_unexpected<void>(std::ERROR_FAILED);
+            }
+        }
+    }
+
+    return {};
+}
+
 void scheduler::await_termination(pid_t pid){
     while(true){
         {
@@ -1042,22 +1312,26 @@ void scheduler::sleep_ms(pid_t pid, size_t time){
     reschedule();
 }
 
-size_t scheduler::register_new_handle(const path& p){
-    pcb[current_pid].handles.push_back(p);
+size_t scheduler::register_new_handle(const path& p, size_t flags){
+    pcb[current_pid].handles.emplace_back(p, flags);
 
     return pcb[current_pid].handles.size();
 }
 
 void scheduler::release_handle(size_t fd){
-    pcb[current_pid].handles[fd - 1].invalidate();
+    pcb[current_pid].handles[fd - 1].file = nullptr;
 }
 
 bool scheduler::has_handle(size_t fd){
-    return fd > 0 && fd <= pcb[current_pid].handles.size() && pcb[current_pid].handles[fd - 1].is_valid();
+    return fd > 0 && fd <= pcb[current_pid].handles.size() && pcb[current_pid].handles[fd - 1].file;
 }
 
 const path& scheduler::get_handle(size_t fd){
-    return pcb[current_pid].handles[fd - 1];
+    return pcb[current_pid].handles[fd - 1].file->file_path;
+}
+
+vfs::open_file& scheduler::get_open_file(size_t fd){
+    return *pcb[current_pid].handles[fd - 1].file;
 }
 
 size_t scheduler::register_new_socket(network::socket_domain domain, network::socket_type type, network::socket_protocol protocol){
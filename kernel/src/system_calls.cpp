@@ -10,6 +10,7 @@
 #include "system_calls.hpp"
 #include "print.hpp"
 #include "scheduler.hpp"
+#include "paging.hpp"
 #include "timer.hpp"
 #include "drivers/keyboard.hpp"
 #include "stdio.hpp"
@@ -49,7 +50,55 @@ int64_t expected_to_i64(const std::expected<size_t>& status){
     }
 }
 
+// Check a user buffer and read the missing pages of the mapped files in it
+// The file system cannot read a mapped file while it holds its locks, so this
+// is done before the kernel touches the buffer. On failure, the error is
+// returned to the process.
+bool prepare_buffer(interrupt::syscall_regs* regs, size_t address, size_t size, bool write){
+    // The buffer must not wrap around the address space
+    if(size > size_t(-1) - address){
+        regs->rax = -std::ERROR_INVALID_COUNT;
+        return false;
+    }
+
+    auto status = scheduler::populate(address, size, write);
+    if(!status){
+        regs->rax = expected_to_i64(status);
+        return false;
+    }
+
+    return true;
+}
+
+// Check a user string and read the missing pages of the mapped files in it
+// The string is prepared page by page, up to its terminating zero
+bool prepare_string(interrupt::syscall_regs* regs, size_t address){
+    while(true){
+        auto page_end = paging::page_align(address) + paging::PAGE_SIZE;
+
+        // The string must not wrap around the address space
+        if(!page_end){
+            regs->rax = -std::ERROR_INVALID_COUNT;
+            return false;
+        }
+
+        if(!prepare_buffer(regs, address, page_end - address, false)){
+            return false;
+        }
+
+        for(; address < page_end; ++address){
+            if(!*reinterpret_cast<const char*>(address)){
+                return true;
+            }
+        }
+    }
+}
+
 void sc_log_string(interrupt::syscall_regs* regs){
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
     auto m = reinterpret_cast<const char*>(regs->rbx);
     logging::logf(logging::log_level::USER, "%s\n", m);
 }
@@ -80,9 +129,26 @@ void sc_exec(interrupt::syscall_regs* regs){
     auto argc = regs->rcx;
     auto argv = reinterpret_cast<const char**>(regs->rdx);
 
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
+    if(argc > size_t(-1) / sizeof(const char*)){
+        regs->rax = -std::ERROR_INVALID_COUNT;
+        return;
+    }
+
+    if(!prepare_buffer(regs, regs->rdx, argc * sizeof(const char*), false)){
+        return;
+    }
+
     std::vector<std::string> params;
 
     for(size_t i = 0; i < argc; ++i){
+        if(!prepare_string(regs, reinterpret_cast<size_t>(argv[i]))){
+            return;
+        }
+
         params.emplace_back(argv[i]);
     }
 
@@ -115,6 +181,23 @@ void sc_sbrk(interrupt::syscall_regs* regs){
     regs->rax = process.brk_end;
 }
 
+void sc_mmap(interrupt::syscall_regs* regs){
+    auto fd = regs->rbx;
+    auto offset = regs->rcx;
+    auto size = regs->rdx;
+    auto prot = regs->rsi;
+
+    auto status = scheduler::mmap(fd, offset, size, prot);
+    regs->rax = expected_to_i64(status);
+}
+
+void sc_munmap(interrupt::syscall_regs* regs){
+    auto address = regs->rbx;
+
+    auto status = scheduler::munmap(address);
+    regs->rax = expected_to_i64(status);
+}
+
 void sc_get_columns(interrupt::syscall_regs* regs){
     auto ttyid = scheduler::get_process(scheduler::get_pid()).tty;
     auto& tty = stdio::get_terminal(ttyid);
@@ -137,6 +220,8 @@ void sc_clear_screen(interrupt::syscall_regs*){
 }
 
 void sc_reboot(interrupt::syscall_regs*){
+    vfs::sync();
+
     if(!acpi::initialized() || !acpi::reboot()){
         logging::logf(logging::log_level::ERROR, "ACPI reset not possible, fallback to 8042 reboot\n");
         asm volatile("mov al, 0x64; or al, 0xFE; out 0x64, al; mov al, 0xFE; out 0x64, al; " : : );
@@ -146,6 +231,8 @@ void sc_reboot(interrupt::syscall_regs*){
 }
 
 void sc_shutdown(interrupt::syscall_regs*){
+    vfs::sync();
+
     if(!acpi::initialized()){
         logging::logf(logging::log_level::ERROR, "ACPI not initialized, impossible to shutdown\n");
         return;
@@ -155,6 +242,10 @@ void sc_shutdown(interrupt::syscall_regs*){
 }
 
 void sc_open(interrupt::syscall_regs* regs){
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
     auto file = reinterpret_cast<char*>(regs->rbx);
     auto flags = regs->rcx;
 
@@ -172,6 +263,10 @@ void sc_stat(interrupt::syscall_regs* regs){
     auto fd = regs->rbx;
     auto info = reinterpret_cast<vfs::stat_info*>(regs->rcx);
 
+    if(!prepare_buffer(regs, regs->rcx, sizeof(vfs::stat_info), true)){
+        return;
+    }
+
     auto status = vfs::stat(fd, *info);
     regs->rax = expected_to_i64(status);
 }
@@ -180,6 +275,10 @@ void sc_statfs(interrupt::syscall_regs* regs){
     auto mount_point  = reinterpret_cast<char*>(regs->rbx);
     auto info = reinterpret_cast<vfs::statfs_info*>(regs->rcx);
 
+    if(!prepare_string(regs, regs->rbx) || !prepare_buffer(regs, regs->rcx, sizeof(vfs::statfs_info), true)){
+        return;
+    }
+
     auto status = vfs::statfs(mount_point, *info);
     regs->rax = expected_to_i64(status);
 }
@@ -190,6 +289,10 @@ void sc_read(interrupt::syscall_regs* regs){
     auto max    = regs->rdx;
     auto offset = regs->rsi;
 
+    if(!prepare_buffer(regs, regs->rcx, max, true)){
+        return;
+    }
+
     auto status = vfs::read(fd, buffer, max, offset);
     regs->rax = expected_to_i64(status);
 }
@@ -201,6 +304,10 @@ void sc_read_timeout(interrupt::syscall_regs* regs){
     auto offset = regs->rsi;
     auto ms     = regs->rdi;
 
+    if(!prepare_buffer(regs, regs->rcx, max, true)){
+        return;
+    }
+
     auto status = vfs::read(fd, buffer, max, offset, ms);
     regs->rax = expected_to_i64(status);
 }
@@ -211,6 +318,10 @@ void sc_write(interrupt::syscall_regs* regs){
     auto max = regs->rdx;
     auto offset = regs->rsi;
 
+    if(!prepare_buffer(regs, regs->rcx, max, false)){
+        return;
+    }
+
     auto status = vfs::write(fd, buffer, max, offset);
     regs->rax = expected_to_i64(status);
 }
@@ -232,11 +343,28 @@ void sc_truncate(interrupt::syscall_regs* regs){
     regs->rax = expected_to_i64(status);
 }
 
+void sc_fallocate(interrupt::syscall_regs* regs){
+    auto fd = regs->rbx;
+    auto size = regs->rcx;
+
+    auto status = vfs::fallocate(fd, size);
+    regs->rax = expected_to_i64(status);
+}
+
+void sc_sync(interrupt::syscall_regs* regs){
+    auto status = vfs::sync();
+    regs->rax = expected_to_i64(status);
+}
+
 void sc_entries(interrupt::syscall_regs* regs){
     auto fd = regs->rbx;
     auto buffer = reinterpret_cast<char*>(regs->rcx);
     auto max = regs->rdx;
 
+    if(!prepare_buffer(regs, regs->rcx, max, true)){
+        return;
+    }
+
     auto status = vfs::entries(fd, buffer, max);
     regs->rax = expected_to_i64(status);
 }
@@ -245,6 +373,10 @@ void sc_mounts(interrupt::syscall_regs* regs){
     auto buffer = reinterpret_cast<char*>(regs->rbx);
     auto max = regs->rcx;
 
+    if(!prepare_buffer(regs, regs->rbx, max, true)){
+        return;
+    }
+
     auto status = vfs::mounts(buffer, max);
     regs->rax = expected_to_i64(status);
 }
@@ -262,12 +394,20 @@ void sc_pwd(interrupt::syscall_regs* regs){
     auto& wd = scheduler::get_working_directory();
     auto p = wd.string();
 
+    if(!prepare_buffer(regs, regs->rbx, p.size() + 1, true)){
+        return;
+    }
+
     auto buffer = reinterpret_cast<char*>(regs->rbx);
     std::copy(p.begin(), p.end(), buffer);
     buffer[p.size()] = '\0';
 }
 
 void sc_cwd(interrupt::syscall_regs* regs){
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
     auto p = reinterpret_cast<const char*>(regs->rbx);
 
     path cwd(p);
@@ -275,6 +415,10 @@ void sc_cwd(interrupt::syscall_regs* regs){
 }
 
 void sc_mkdir(interrupt::syscall_regs* regs){
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
     auto file = reinterpret_cast<char*>(regs->rbx);
 
     auto status = vfs::mkdir(file);
@@ -282,6 +426,10 @@ void sc_mkdir(interrupt::syscall_regs* regs){
 }
 
 void sc_rm(interrupt::syscall_regs* regs){
+    if(!prepare_string(regs, regs->rbx)){
+        return;
+    }
+
     auto file = reinterpret_cast<char*>(regs->rbx);
 
     auto status = vfs::rm(file);
@@ -291,6 +439,10 @@ void sc_rm(interrupt::syscall_regs* regs){
 void sc_datetime(interrupt::syscall_regs* regs){
     auto date = reinterpret_cast<rtc::datetime*>(regs->rbx);
 
+    if(!prepare_buffer(regs, regs->rbx, sizeof(rtc::datetime), true)){
+        return;
+    }
+
     *date = rtc::all_data();
 }
 
@@ -336,6 +488,10 @@ void sc_vesa_blue_shift(interrupt::syscall_regs* regs){
 void sc_vesa_redraw(interrupt::syscall_regs* regs){
     auto new_buffer = reinterpret_cast<const char*>(regs->rbx);
 
+    if(!prepare_buffer(regs, regs->rbx, vesa::get_height() * vesa::get_bytes_per_scan_line(), false)){
+        return;
+    }
+
     vesa::redraw(new_buffer);
 }
 
@@ -352,6 +508,11 @@ void sc_ioctl(interrupt::syscall_regs* regs){
     auto request = regs->rcx;
     auto data = reinterpret_cast<void*>(regs->rdx);
 
+    // The only request writes a size
+    if(!prepare_buffer(regs, regs->rdx, sizeof(size_t), true)){
+        return;
+    }
+
     auto status = ioctl(device, static_cast<io::ioctl_request>(request), data);
     regs->rax = expected_to_i64(status);
 }
@@ -407,6 +568,10 @@ void sc_send(interrupt::syscall_regs* regs){
     auto n             = regs->rdx;
     auto target_buffer = reinterpret_cast<char*>(regs->rsi);
 
+    if(!prepare_buffer(regs, regs->rcx, n, false)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::send(socket_fd, buffer, n, target_buffer));
 }
 
@@ -417,6 +582,10 @@ void sc_send_to(interrupt::syscall_regs* regs){
     auto target_buffer = reinterpret_cast<char*>(regs->rsi);
     auto address       = reinterpret_cast<void*>(regs->rdi);
 
+    if(!prepare_buffer(regs, regs->rcx, n, false)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::send_to(socket_fd, buffer, n, target_buffer, address));
 }
 
@@ -425,6 +594,10 @@ void sc_receive(interrupt::syscall_regs* regs){
     auto buffer    = reinterpret_cast<char*>(regs->rcx);
     auto n         = regs->rdx;
 
+    if(!prepare_buffer(regs, regs->rcx, n, true)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::receive(socket_fd, buffer, n));
 }
 
@@ -434,6 +607,10 @@ void sc_receive_timeout(interrupt::syscall_regs* regs){
     auto n         = regs->rdx;
     auto ms        = regs->rsi;
 
+    if(!prepare_buffer(regs, regs->rcx, n, true)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::receive(socket_fd, buffer, n, ms));
 }
 
@@ -443,6 +620,10 @@ void sc_receive_from(interrupt::syscall_regs* regs){
     auto n         = regs->rdx;
     auto address   = reinterpret_cast<void*>(regs->rsi);
 
+    if(!prepare_buffer(regs, regs->rcx, n, true)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::receive_from(socket_fd, buffer, n, address));
 }
 
@@ -453,6 +634,10 @@ void sc_receive_from_timeout(interrupt::syscall_regs* regs){
     auto ms        = regs->rsi;
     auto address   = reinterpret_cast<void*>(regs->rdi);
 
+    if(!prepare_buffer(regs, regs->rcx, n, true)){
+        return;
+    }
+
     regs->rax = expected_to_i64(network::receive_from(socket_fd, buffer, n, ms, address));
 }
 
@@ -572,6 +757,9 @@ void sc_wait_for_packet_ms(interrupt::syscall_regs* regs){
 
 void sc_kill(interrupt::syscall_regs* /*regs*/) __attribute((noreturn));
 void sc_kill(interrupt::syscall_regs* /*regs*/){
+    // Write back the mapped files before the address space is released
+    scheduler::munmap_all();
+
     scheduler::kill_current_process();
 }
 
@@ -607,6 +795,8 @@ void install_system_calls(){
     system_calls[0x7] = sc_brk_start;
     system_calls[0x8] = sc_brk_end;
     system_calls[0x9] = sc_sbrk;
+    system_calls[0xA] = sc_mmap;
+    system_calls[0xB] = sc_munmap;
     system_calls[0x20] = sc_set_canonical;
     system_calls[0x21] = sc_set_mouse;
     system_calls[0x22] = sc_clear_screen;
@@ -630,6 +820,8 @@ void install_system_calls(){
     system_calls[0x313] = sc_clear;
     system_calls[0x314] = sc_mount;
     system_calls[0x315] = sc_read_timeout;
+    system_calls[0x316] = sc_sync;
+    system_calls[0x317] = sc_fallocate;
     system_calls[0x400] = sc_datetime;
     system_calls[0x401] = sc_time_seconds;
     system_calls[0x402] = sc_time_milliseconds;
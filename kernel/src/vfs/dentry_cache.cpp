@@ -0,0 +1,115 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <algorithms.hpp>
+
+#include "vfs/dentry_cache.hpp"
+
+namespace {
+
+// The number of slots of the cache, a power of two
+constexpr const size_t DENTRY_SLOTS = 512;
+
+// FNV-1a hash of a path
+uint64_t hash(std::string_view key){
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for(auto c : key){
+        h ^= uint8_t(c);
+        h *= 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+bool equals(const std::string& key, std::string_view value){
+    return key.size() == value.size() && std::equal_n(value.begin(), key.begin(), value.size());
+}
+
+} //end of anonymous namespace
+
+vfs::dentry_cache::dentry_cache() : entries(DENTRY_SLOTS) {
+    lock.init();
+
+    for(size_t i = 0; i < entries.size(); ++i){
+        entries[i].exists = false;
+    }
+}
+
+vfs::dentry_cache::dentry& vfs::dentry_cache::slot(std::string_view key){
+    return entries[hash(key) & (DENTRY_SLOTS - 1)];
+}
+
+vfs::dentry_state vfs::dentry_cache::lookup(const path& file_path, vfs::file& file){
+    auto key = file_path.string();
+
+    std::lock_guard<mutex> l(lock);
+
+    auto& entry = slot(key);
+
+    if(!equals(entry.key, key)){
+        return dentry_state::UNKNOWN;
+    }
+
+    if(!entry.exists){
+        return dentry_state::NOT_EXISTS;
+    }
+
+    file = entry.file;
+
+    return dentry_state::EXISTS;
+}
+
+void vfs::dentry_cache::insert(const path& file_path, const vfs::file& file){
+    auto key = file_path.string();
+
+    std::lock_guard<mutex> l(lock);
+
+    auto& entry = slot(key);
+
+    entry.key = key;
+    entry.exists = true;
+    entry.file = file;
+}
+
+void vfs::dentry_cache::insert_negative(const path& file_path){
+    auto key = file_path.string();
+
+    std::lock_guard<mutex> l(lock);
+
+    auto& entry = slot(key);
+
+    entry.key = key;
+    entry.exists = false;
+}
+
+void vfs::dentry_cache::insert_directory(const path& directory, const std::vector<vfs::file>& files){
+    for(auto& file : files){
+        // The special entries describe other directories
+        if(file.file_name == "." || file.file_name == ".."){
+            continue;
+        }
+
+        insert(path(directory, file.file_name), file);
+    }
+}
+
+void vfs::dentry_cache::invalidate(const path& file_path){
+    // The canonical paths end with a slash, the paths under this one start with it
+    auto prefix = file_path.string();
+
+    std::lock_guard<mutex> l(lock);
+
+    for(size_t i = 0; i < entries.size(); ++i){
+        auto& entry = entries[i];
+
+        if(entry.key.size() >= prefix.size() && std::equal_n(prefix.begin(), entry.key.begin(), prefix.size())){
+            entry.key.clear();
+            entry.exists = false;
+        }
+    }
+}
@@ -0,0 +1,717 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <vector.hpp>
+#include <array.hpp>
+#include <algorithms.hpp>
+#include <lock_guard.hpp>
+
+#include <tlib/errors.hpp>
+
+#include "vfs/page_cache.hpp"
+
+#include "block_cache.hpp"
+#include "physical_allocator.hpp"
+#include "virtual_allocator.hpp"
+#include "paging.hpp"
+#include "logging.hpp"
+
+#include "conc/mutex.hpp"
+
+#include "fs/sysfs.hpp"
+
+namespace {
+
+constexpr const size_t PAGE_SIZE = paging::PAGE_SIZE;
+
+// The minimum number of pages of the cache (256KiB)
+constexpr const size_t MIN_CACHE_PAGES = 64;
+
+// The maximum number of pages read from the file system at once (64KiB)
+constexpr const size_t MAX_READ_PAGES = 16;
+
+// The number of buckets of the table of the files, a power of two
+constexpr const size_t FILE_BUCKETS = 256;
+
+// New pages are only allocated while this memory remains free
+constexpr const size_t GROW_RESERVE = 16 * 1024 * 1024;
+
+// The size of a file whose end has not been read yet
+constexpr const size_t UNKNOWN_SIZE = size_t(-1);
+
+struct cached_file;
+
+struct cached_page {
+    cached_file* file; ///< The file of the page
+    size_t index;      ///< The index of the page in the file
+    size_t physical;   ///< The physical address of the data
+    char* data;        ///< The data
+
+    cached_page* prev;      ///< The previous page in the LRU list
+    cached_page* next;      ///< The next page in the LRU list
+    cached_page* hash_next; ///< The next page of the bucket
+    cached_page* file_prev; ///< The previous page of the file
+    cached_page* file_next; ///< The next page of the file
+};
+
+struct cached_file {
+    vfs::file_system* fs; ///< The file system of the file
+    std::string path;     ///< The path of the file in its file system
+    uint64_t hash;        ///< The hash of the file system and the path
+    size_t size;          ///< The size of the file, if a read reached its end
+    size_t pages;         ///< The number of cached pages
+
+    cached_page* first;     ///< The cached pages of the file
+    cached_file* hash_next; ///< The next file of the bucket
+};
+
+mutex cache_lock; ///< Protect the cache
+
+block_list<cached_page> lru; ///< The pages, the most recently used first
+block_list<cached_page> retired; ///< The pages removed by the shrinker, not yet released
+
+std::vector<cached_file*> file_table;
+std::vector<cached_page*> page_table; ///< The buckets of the pages, a power of two
+
+size_t max_pages = 0;
+
+// Incremented by each modification, a read only inserts the pages it read if
+// no modification happened in the meantime
+size_t generation = 0;
+
+size_t hits = 0;
+size_t misses = 0;
+size_t evictions = 0;
+
+// FNV-1a hash of the file system and of the path
+uint64_t file_hash(vfs::file_system& fs, std::string_view key){
+    uint64_t h = 0xCBF29CE484222325ULL ^ reinterpret_cast<uint64_t>(&fs);
+
+    for(auto c : key){
+        h ^= uint8_t(c);
+        h *= 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+size_t page_bucket(const cached_file* file, size_t index){
+    return (file->hash + index * 0x9E3779B97F4A7C15ULL) & (page_table.size() - 1);
+}
+
+bool starts_with(const std::string& value, std::string_view prefix){
+    return value.size() >= prefix.size() && std::equal_n(prefix.begin(), value.begin(), prefix.size());
+}
+
+cached_file* find_file(vfs::file_system& fs, std::string_view key, uint64_t hash){
+    auto* file = file_table[hash & (FILE_BUCKETS - 1)];
+
+    while(file){
+        if(file->hash == hash && file->fs == &fs && file->path.size() == key.size() && starts_with(file->path, key)){
+            return file;
+        }
+
+        file = file->hash_next;
+    }
+
+    return nullptr;
+}
+
+cached_file* get_file(vfs::file_system& fs, std::string_view key, uint64_t hash){
+    auto* file = find_file(fs, key, hash);
+
+    if(!file){
+        file = new cached_file;
+
+        file->fs = &fs;
+        file->path = std::string(key.begin(), key.end());
+        file->hash = hash;
+        file->size = UNKNOWN_SIZE;
+        file->pages = 0;
+        file->first = nullptr;
+
+        auto& bucket = file_table[hash & (FILE_BUCKETS - 1)];
+        file->hash_next = bucket;
+        bucket = file;
+    }
+
+    return file;
+}
+
+// Forget a file once its last page is gone
+void release_file(cached_file* file){
+    if(file->pages){
+        return;
+    }
+
+    auto* it = &file_table[file->hash & (FILE_BUCKETS - 1)];
+
+    while(*it != file){
+        it = &(*it)->hash_next;
+    }
+
+    *it = file->hash_next;
+
+    delete file;
+}
+
+cached_page* find_page(const cached_file* file, size_t index){
+    auto* page = page_table[page_bucket(file, index)];
+
+    while(page){
+        if(page->file == file && page->index == index){
+            return page;
+        }
+
+        page = page->hash_next;
+    }
+
+    return nullptr;
+}
+
+void insert_page(cached_file* file, size_t index, cached_page* page){
+    page->file = file;
+    page->index = index;
+
+    auto& bucket = page_table[page_bucket(file, index)];
+    page->hash_next = bucket;
+    bucket = page;
+
+    page->file_prev = nullptr;
+    page->file_next = file->first;
+
+    if(file->first){
+        file->first->file_prev = page;
+    }
+
+    file->first = page;
+    ++file->pages;
+
+    lru.push_front(page);
+}
+
+// Remove a page from the cache, its file is not released
+void remove_page(cached_page* page){
+    auto* file = page->file;
+
+    auto* it = &page_table[page_bucket(file, page->index)];
+
+    while(*it != page){
+        it = &(*it)->hash_next;
+    }
+
+    *it = page->hash_next;
+
+    if(page->file_prev){
+        page->file_prev->file_next = page->file_next;
+    } else {
+        file->first = page->file_next;
+    }
+
+    if(page->file_next){
+        page->file_next->file_prev = page->file_prev;
+    }
+
+    --file->pages;
+
+    lru.remove(page);
+
+    page->file = nullptr;
+}
+
+cached_page* allocate_page(){
+    auto physical = physical_allocator::allocate(1);
+    if(!physical){
+        return nullptr;
+    }
+
+    auto virt = virtual_allocator::allocate(1);
+    if(!virt || !paging::map_pages(virt, physical, 1)){
+        physical_allocator::free(physical, 1);
+        return nullptr;
+    }
+
+    auto* page = new cached_page;
+    page->physical = physical;
+    page->data = reinterpret_cast<char*>(virt);
+    page->file = nullptr;
+
+    return page;
+}
+
+void free_page(cached_page* page){
+    auto virt = reinterpret_cast<size_t>(page->data);
+
+    paging::unmap_pages(virt, 1);
+    virtual_allocator::free(virt, 1);
+    physical_allocator::free(page->physical, 1);
+
+    delete page;
+}
+
+// Return a page for new data, either a new one or the least recently used one
+cached_page* take_page(){
+    if(lru.size < max_pages && physical_allocator::free() >= GROW_RESERVE){
+        if(auto* page = allocate_page()){
+            return page;
+        }
+    }
+
+    auto* page = lru.tail;
+
+    if(page){
+        auto* file = page->file;
+
+        remove_page(page);
+        release_file(file);
+
+        ++evictions;
+    }
+
+    return page;
+}
+
+void drop_file(cached_file* file){
+    while(file->first){
+        auto* page = file->first;
+
+        remove_page(page);
+        free_page(page);
+    }
+
+    release_file(file);
+}
+
+// Read pages from the file system, insert them in the cache and copy the
+// requested part into the destination. The destination may be user memory, it
+// is never accessed with the cache lock held
+size_t fill(vfs::file_system& fs, const path& file_path, uint64_t hash, size_t index, size_t pages, size_t page_offset, char* destination, size_t count, size_t& copied, bool& eof){
+    auto key = file_path.string();
+    auto length = pages * PAGE_SIZE;
+
+    // Whole pages are read directly into the destination
+    std::unique_heap_array<char> bounce;
+    char* data = destination;
+
+    if(page_offset || count < length){
+        bounce = std::unique_heap_array<char>(length);
+        data = bounce.get();
+    }
+
+    size_t start;
+    {
+        std::lock_guard<mutex> l(cache_lock);
+        start = generation;
+    }
+
+    size_t n = 0;
+    auto result = fs.read(file_path, data, length, index * PAGE_SIZE, n);
+
+    if(result){
+        return result;
+    }
+
+    if(page_offset > n){
+        return std::ERROR_INVALID_OFFSET;
+    }
+
+    eof = n < length;
+
+    // The pages are taken from the cache, filled without the lock and then inserted
+    std::array<cached_page*, MAX_READ_PAGES> taken;
+    auto filled = std::min(pages, (n + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+
+        for(size_t i = 0; i < filled; ++i){
+            auto* file = find_file(fs, key, hash);
+
+            // The data read may already be stale, this may release the file
+            taken[i] = generation == start && !(file && find_page(file, index + i)) ? take_page() : nullptr;
+        }
+    }
+
+    for(size_t i = 0; i < filled; ++i){
+        if(taken[i]){
+            std::copy_n(data + i * PAGE_SIZE, std::min(PAGE_SIZE, n - i * PAGE_SIZE), taken[i]->data);
+        }
+    }
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+
+        for(size_t i = 0; i < filled; ++i){
+            auto* page = taken[i];
+
+            if(!page){
+                continue;
+            }
+
+            // Another read may have inserted the page in the meantime
+            auto* file = find_file(fs, key, hash);
+
+            if(generation != start || (file && find_page(file, index + i))){
+                free_page(page);
+                continue;
+            }
+
+            insert_page(get_file(fs, key, hash), index + i, page);
+        }
+
+        if(eof && generation == start){
+            if(auto* file = find_file(fs, key, hash)){
+                file->size = index * PAGE_SIZE + n;
+            }
+        }
+    }
+
+    copied = std::min(n - page_offset, count);
+
+    if(data != destination){
+        std::copy_n(data + page_offset, copied, destination);
+    }
+
+    return 0;
+}
+
+// Called by the physical allocator when memory runs low
+// The allocation may come from the middle of a page table, virtual allocator
+// or kalloc update, so the pages are only removed from the cache here. The
+// next read or write gives them back to the system
+size_t shrink_cache(size_t pages){
+    // The allocation may come from a process holding the lock
+    if(!cache_lock.try_lock()){
+        return 0;
+    }
+
+    size_t removed = 0;
+
+    while(removed < pages && lru.tail){
+        auto* page = lru.tail;
+
+        // The file is forgotten with the release of the page
+        remove_page(page);
+        retired.push_front(page);
+
+        ++removed;
+        ++evictions;
+    }
+
+    cache_lock.unlock();
+
+    if(removed){
+        logging::logf(logging::log_level::DEBUG, "page_cache: Removed %u pages\n", removed);
+    }
+
+    return 0;
+}
+
+// Give the pages removed by the shrinker back to the system and forget the
+// files left without pages
+// Must be called with the lock held
+void release_retired(){
+    if(!retired.head){
+        return;
+    }
+
+    size_t released = 0;
+
+    while(auto* page = retired.head){
+        retired.remove(page);
+        free_page(page);
+
+        ++released;
+    }
+
+    for(auto& bucket : file_table){
+        auto* it = &bucket;
+
+        while(*it){
+            auto* file = *it;
+
+            if(file->pages){
+                it = &file->hash_next;
+            } else {
+                *it = file->hash_next;
+                delete file;
+            }
+        }
+    }
+
+    logging::logf(logging::log_level::DEBUG, "page_cache: Released %u pages\n", released);
+}
+
+std::string sysfs_pages(){
+    return std::to_string(lru.size);
+}
+
+std::string sysfs_max_pages(){
+    return std::to_string(max_pages);
+}
+
+std::string sysfs_hits(){
+    return std::to_string(hits);
+}
+
+std::string sysfs_misses(){
+    return std::to_string(misses);
+}
+
+std::string sysfs_evictions(){
+    return std::to_string(evictions);
+}
+
+} //end of anonymous namespace
+
+void page_cache::init(){
+    cache_lock.init();
+
+    // Use a sixteenth of the memory for the cache
+    max_pages = std::max(physical_allocator::available() / 16 / PAGE_SIZE, MIN_CACHE_PAGES);
+
+    size_t buckets = 1;
+    while(buckets < max_pages){
+        buckets *= 2;
+    }
+
+    file_table.resize(FILE_BUCKETS);
+    page_table.resize(buckets);
+
+    for(auto& file : file_table){
+        file = nullptr;
+    }
+
+    for(auto& page : page_table){
+        page = nullptr;
+    }
+
+    physical_allocator::register_shrinker(&shrink_cache);
+
+    logging::logf(logging::log_level::TRACE, "page_cache: at most %u pages\n", max_pages);
+
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/vfs/page_cache/pages"), &sysfs_pages);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/vfs/page_cache/max_pages"), &sysfs_max_pages);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/vfs/page_cache/hits"), &sysfs_hits);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/vfs/page_cache/misses"), &sysfs_misses);
+    sysfs::set_dynamic_value(sysfs::get_sys_path(), path("/vfs/page_cache/evictions"), &sysfs_evictions);
+}
+
+size_t page_cache::read(vfs::file_system& fs, const path& file_path, char* buffer, size_t count, size_t offset, size_t& read){
+    auto key = file_path.string();
+    auto hash = file_hash(fs, key);
+
+    read = 0;
+
+    // The cached data is copied out of the lock, the buffer may be user memory
+    std::unique_heap_array<char> bounce(PAGE_SIZE);
+
+    while(read < count){
+        auto position = offset + read;
+        auto index = position / PAGE_SIZE;
+        auto page_offset = position % PAGE_SIZE;
+
+        size_t hit = 0;
+        size_t missing = 0;
+
+        {
+            std::lock_guard<mutex> l(cache_lock);
+
+            release_retired();
+
+            auto* file = find_file(fs, key, hash);
+
+            if(file && file->size != UNKNOWN_SIZE){
+                if(position > file->size){
+                    return std::ERROR_INVALID_OFFSET;
+                }
+
+                if(position == file->size){
+                    return 0;
+                }
+            }
+
+            auto* page = file ? find_page(file, index) : nullptr;
+
+            if(page){
+                ++hits;
+
+                lru.remove(page);
+                lru.push_front(page);
+
+                auto valid = file->size == UNKNOWN_SIZE ? PAGE_SIZE : std::min(PAGE_SIZE, file->size - index * PAGE_SIZE);
+                hit = std::min(valid - page_offset, count - read);
+
+                std::copy_n(page->data + page_offset, hit, bounce.get());
+            } else {
+                // Read all the following missing pages at once
+                auto last = (offset + count - 1) / PAGE_SIZE;
+
+                missing = 1;
+                while(missing < MAX_READ_PAGES && index + missing <= last && !(file && find_page(file, index + missing))){
+                    ++missing;
+                }
+
+                misses += missing;
+            }
+        }
+
+        if(hit){
+            std::copy_n(bounce.get(), hit, buffer + read);
+
+            read += hit;
+
+            continue;
+        }
+
+        size_t copied = 0;
+        bool eof = false;
+
+        auto result = fill(fs, file_path, hash, index, missing, page_offset, buffer + read, count - read, copied, eof);
+
+        if(result){
+            return result;
+        }
+
+        read += copied;
+
+        if(eof){
+            break;
+        }
+    }
+
+    return 0;
+}
+
+bool page_cache::size(vfs::file_system& fs, const path& file_path, size_t& size){
+    auto key = file_path.string();
+
+    std::lock_guard<mutex> l(cache_lock);
+
+    auto* file = find_file(fs, key, file_hash(fs, key));
+
+    if(file && file->size != UNKNOWN_SIZE){
+        size = file->size;
+        return true;
+    }
+
+    return false;
+}
+
+void page_cache::write(vfs::file_system& fs, const path& file_path, const char* buffer, size_t count, size_t offset){
+    auto key = file_path.string();
+    auto hash = file_hash(fs, key);
+
+    {
+        std::lock_guard<mutex> l(cache_lock);
+
+        release_retired();
+
+        ++generation;
+
+        if(!find_file(fs, key, hash) || !count){
+            return;
+        }
+    }
+
+    // The data is copied out of the lock, the buffer may be user memory
+    std::unique_heap_array<char> bounce;
+
+    if(buffer){
+        bounce = std::unique_heap_array<char>(PAGE_SIZE);
+    }
+
+    auto end = offset + count;
+
+    for(size_t index = offset / PAGE_SIZE; index <= (end - 1) / PAGE_SIZE; ++index){
+        auto first = std::max(offset, index * PAGE_SIZE);
+        auto last = std::min(end, (index + 1) * PAGE_SIZE);
+
+        if(buffer){
+            std::copy_n(buffer + (first - offset), last - first, bounce.get());
+        }
+
+        std::lock_guard<mutex> l(cache_lock);
+
+        auto* file = find_file(fs, key, hash);
+
+        if(!file){
+            return;
+        }
+
+        auto* page = find_page(file, index);
+
+        if(!page){
+            continue;
+        }
+
+        if(buffer){
+            std::copy_n(bounce.get(), last - first, page->data + (first - index * PAGE_SIZE));
+        } else {
+            std::fill_n(page->data + (first - index * PAGE_SIZE), last - first, 0);
+        }
+    }
+}
+
+void page_cache::truncate(vfs::file_system& fs, const path& file_path, size_t size){
+    auto key = file_path.string();
+
+    std::lock_guard<mutex> l(cache_lock);
+
+    ++generation;
+
+    auto* file = find_file(fs, key, file_hash(fs, key));
+
+    if(!file){
+        return;
+    }
+
+    // The pages after the old or the new end of the file are stale
+    auto limit = std::min(file->size, size) / PAGE_SIZE;
+
+    auto* page = file->first;
+
+    while(page){
+        auto* next = page->file_next;
+
+        if(page->index >= limit){
+            remove_page(page);
+            free_page(page);
+        }
+
+        page = next;
+    }
+
+    if(file->pages){
+        file->size = size;
+    } else {
+        release_file(file);
+    }
+}
+
+void page_cache::invalidate(vfs::file_system& fs, const path& file_path){
+    // The canonical paths end with a slash, the paths under this one start with it
+    auto prefix = file_path.string();
+
+    std::lock_guard<mutex> l(cache_lock);
+
+    ++generation;
+
+    for(auto& bucket : file_table){
+        auto* file = bucket;
+
+        while(file){
+            auto* next = file->hash_next;
+
+            if(file->fs == &fs && starts_with(file->path, prefix)){
+                drop_file(file);
+            }
+
+            file = next;
+        }
+    }
+}
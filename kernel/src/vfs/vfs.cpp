@@ -15,6 +15,7 @@
 
 #include "vfs/vfs.hpp"
 #include "vfs/file_system.hpp"
+#include "vfs/page_cache.hpp"
 
 #include "fs/fat32.hpp"
 #include "fs/sysfs.hpp"
@@ -22,6 +23,7 @@
 #include "fs/procfs.hpp"
 
 #include "scheduler.hpp"
+#include "buffer_cache.hpp"
 #include "console.hpp"
 #include "logging.hpp"
 #include "assert.hpp"
@@ -61,9 +63,68 @@ std::string partition_type_to_string(vfs::partition_type type) {
 
 std::vector<mounted_fs> mount_point_list;
 
+// A node of the trie of the mount points, one per path component
+struct mount_node {
+    std::string component;        ///< The path component of the node
+    size_t mounted = 0;           ///< The index of the file system mounted here, plus one, 0 if none
+    std::vector<size_t> children; ///< The indexes of the children nodes
+};
+
+// The trie of the mount points, the first node is the root directory
+std::vector<mount_node> mount_trie;
+
+void add_mount_point(size_t index) {
+    if (mount_trie.empty()) {
+        mount_trie.emplace_back();
+    }
+
+    auto& mount_point = mount_point_list[index].mount_point;
+
+    size_t node = 0;
+
+    for (size_t i = 1; i < mount_point.size(); ++i) {
+        auto component = mount_point[i];
+        size_t next    = 0;
+
+        for (auto child : mount_trie[node].children) {
+            if (mount_trie[child].component == component) {
+                next = child;
+                break;
+            }
+        }
+
+        if (!next) {
+            next = mount_trie.size();
+            mount_trie.emplace_back();
+            mount_trie[next].component = component;
+            mount_trie[node].children.push_back(next);
+        }
+
+        node = next;
+    }
+
+    mount_trie[node].mounted = index + 1;
+}
+
 void mount_root() {
     //TODO Get information about the root from a configuration file
-    mount(vfs::partition_type::FAT32, "/", "/dev/hda1");
+#ifdef THOR_CONFIG_ROOT_DEVICE
+    mount(vfs::partition_type::FAT32, "/", THOR_CONFIG_ROOT_DEVICE);
+#else
+    // Use the first partition of the first disk that is present
+    const char* candidates[] = {"/dev/hda1", "/dev/vda1", "/dev/sda1"};
+
+    for (auto* device : candidates) {
+        size_t size = 0;
+        if (!devfs::get_device_size(path(device), size)) {
+            logging::logf(logging::log_level::TRACE, "vfs: Root device is %s\n", device);
+            mount(vfs::partition_type::FAT32, "/", device);
+            return;
+        }
+    }
+
+    logging::logf(logging::log_level::ERROR, "vfs: No root device found\n");
+#endif
 }
 
 void mount_sys() {
@@ -92,47 +153,70 @@ path get_path(const char* file_path) {
     return p;
 }
 
+// Find the file system of the deepest mount point containing the path
 mounted_fs& get_fs(const path& base_path) {
-    size_t best       = 0;
-    size_t best_match = 0;
+    size_t best = 0;
 
-    if (base_path.is_root()) {
-        for (auto& mp : mount_point_list) {
-            if (mp.mount_point.is_root()) {
-                return mp;
-            }
-        }
-    }
+    if (!mount_trie.empty()) {
+        size_t node = 0;
+        best        = mount_trie[0].mounted;
 
-    for (size_t i = 0; i < mount_point_list.size(); ++i) {
-        auto& mp = mount_point_list[i];
+        for (size_t i = 1; i < base_path.size(); ++i) {
+            auto component = base_path[i];
+            size_t next    = 0;
 
-        bool match = true;
-        for (size_t j = 0; j < mp.mount_point.size() && j < base_path.size(); ++j) {
-            if (mp.mount_point[j] != base_path[j]) {
-                match = false;
+            for (auto child : mount_trie[node].children) {
+                if (mount_trie[child].component == component) {
+                    next = child;
+                    break;
+                }
+            }
+
+            if (!next) {
                 break;
             }
-        }
 
-        if (match && mp.mount_point.size() > best) {
-            best       = mp.mount_point.size();
-            best_match = i;
+            node = next;
+
+            if (mount_trie[node].mounted) {
+                best = mount_trie[node].mounted;
+            }
         }
     }
 
-    return mount_point_list[best_match];
+    return mount_point_list[best ? best - 1 : 0];
 }
 
 path get_fs_path(const path& base_path, const mounted_fs& fs) {
     thor_assert(base_path.is_absolute(), "Invalid base_path in get_fs_path");
     thor_assert(fs.mount_point.is_absolute(), "Invalid base_path in get_fs_path");
 
-    if (base_path == fs.mount_point) {
+    // get_fs matched one trie node per component of the mount point, the
+    // remaining components form the path inside the file system
+    auto depth = fs.mount_point.size();
+
+    if (base_path.size() == depth) {
         return path("/");
     }
 
-    return path("/") / base_path.sub_path(fs.mount_point.size());
+    return path("/") / base_path.sub_path(depth);
+}
+
+// The file system of an opened file is only resolved once
+void resolve(vfs::open_file& file) {
+    if (!file.file_system) {
+        auto& fs         = get_fs(file.file_path);
+        file.file_system = fs.file_system;
+        file.fs_path     = get_fs_path(file.file_path, fs);
+    }
+}
+
+vfs::open_file& get_open_file(vfs::fd_t fd) {
+    auto& file = scheduler::get_open_file(fd);
+
+    resolve(file);
+
+    return file;
 }
 
 vfs::file_system* get_new_fs(vfs::partition_type type, const path& mount_point, const path& device) {
@@ -193,6 +277,7 @@ std::expected<void> vfs::mount(partition_type type, fd_t mp_fd, fd_t dev_fd) {
     }
 
     mount_point_list.emplace_back(type, dev_path, mp_path, fs);
+    add_mount_point(mount_point_list.size() - 1);
     fs->init();
 
     auto dev_path_string = dev_path.string();
@@ -216,6 +301,7 @@ std::expected<void> vfs::mount(partition_type type, const char* mount_point, con
     }
 
     mount_point_list.emplace_back(type, dev_path, mp_path, fs);
+    add_mount_point(mount_point_list.size() - 1);
 
     auto dev_path_string = dev_path.string();
     auto mp_path_string = mp_path.string();
@@ -227,6 +313,23 @@ std::expected<void> vfs::mount(partition_type type, const char* mount_point, con
     return {};
 }
 
+std::expected<void> vfs::sync() {
+    size_t result = 0;
+
+    // The file systems write their metadata into the cache first
+    for (auto& mp : mount_point_list) {
+        auto status = mp.file_system->sync();
+
+        if (status && !result) {
+            result = status;
+        }
+    }
+
+    auto status = buffer_cache::sync();
+
+    return std::make_expected_zero(result ? result : status);
+}
+
 std::expected<void> vfs::statfs(const char* mount_point, vfs::statfs_info& info) {
     auto base_path = get_path(mount_point);
 
@@ -251,28 +354,33 @@ std::expected<vfs::fd_t> vfs::open(const char* file_path, size_t flags) {
     auto fs_path = get_fs_path(base_path, fs);
 
     //Special handling for opening the root
-    if (fs_path.is_root()) {
-        return scheduler::register_new_handle(base_path);
-    }
-
-    int64_t sub_result;
-    if (flags & std::OPEN_CREATE) {
-        vfs::file file;
-        sub_result = fs.file_system->get_file(fs_path, file);
+    if (!fs_path.is_root()) {
+        int64_t sub_result;
+        if (flags & std::OPEN_CREATE) {
+            vfs::file file;
+            sub_result = fs.file_system->get_file(fs_path, file);
+
+            if (sub_result == std::ERROR_NOT_EXISTS) {
+                sub_result = fs.file_system->touch(fs_path);
+            }
+        } else {
+            vfs::file file;
+            sub_result = fs.file_system->get_file(fs_path, file);
+        }
 
-        if (sub_result == std::ERROR_NOT_EXISTS) {
-            sub_result = fs.file_system->touch(fs_path);
+        if (sub_result > 0) {
+            return std::make_unexpected<fd_t, size_t>(sub_result);
         }
-    } else {
-        vfs::file file;
-        sub_result = fs.file_system->get_file(fs_path, file);
     }
 
-    if (sub_result > 0) {
-        return std::make_unexpected<fd_t, size_t>(sub_result);
-    } else {
-        return scheduler::register_new_handle(base_path);
-    }
+    auto fd = scheduler::register_new_handle(base_path, flags);
+
+    // The file system is already known, it is not resolved again
+    auto& handle       = scheduler::get_open_file(fd);
+    handle.file_system = fs.file_system;
+    handle.fs_path     = fs_path;
+
+    return fd;
 }
 
 void vfs::close(fd_t fd) {
@@ -318,6 +426,10 @@ std::expected<void> vfs::rm(const char* file_path) {
     auto fs_path = get_fs_path(base_path, fs);
 
     auto error = fs.file_system->rm(fs_path);
+
+    if (!error && fs.file_system->cacheable()) {
+        page_cache::invalidate(*fs.file_system, fs_path);
+    }
     return std::make_expected_zero(error);
 }
 
@@ -326,12 +438,10 @@ std::expected<void> vfs::stat(fd_t fd, vfs::stat_info& info) {
         return std::make_unexpected<void>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
-    auto& fs        = get_fs(base_path);
-    auto fs_path    = get_fs_path(base_path, fs);
+    auto& handle = get_open_file(fd);
 
     //Special handling for root
-    if (fs_path.is_root()) {
+    if (handle.fs_path.is_root()) {
         //TODO Add file system support for stat of the root directory
         info.size  = 4096;
         info.flags = vfs::STAT_FLAG_DIRECTORY;
@@ -340,7 +450,7 @@ std::expected<void> vfs::stat(fd_t fd, vfs::stat_info& info) {
     }
 
     vfs::file f;
-    auto result = fs.file_system->get_file(fs_path, f);
+    auto result = handle.file_system->get_file(handle.fs_path, f);
 
     if (result) {
         return std::make_unexpected<void>(result);
@@ -362,7 +472,7 @@ std::expected<void> vfs::stat(fd_t fd, vfs::stat_info& info) {
     }
 
     // All files starting with a .dot are hidden by default
-    if (fs_path.base_name()[0] == '.') {
+    if (handle.fs_path.base_name()[0] == '.') {
         info.flags |= vfs::STAT_FLAG_HIDDEN;
     }
 
@@ -378,17 +488,26 @@ std::expected<size_t> vfs::read(fd_t fd, char* buffer, size_t count, size_t offs
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
+    return vfs::read(get_open_file(fd), buffer, count, offset);
+}
+
+std::expected<size_t> vfs::read(open_file& handle, char* buffer, size_t count, size_t offset) {
+    resolve(handle);
 
-    if (base_path.is_root()) {
+    if (handle.file_path.is_root()) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_PATH);
     }
 
-    auto& fs     = get_fs(base_path);
-    auto fs_path = get_fs_path(base_path, fs);
-
     size_t read = 0;
-    auto result = fs.file_system->read(fs_path, buffer, count, offset, read);
+    size_t result;
+
+    if (handle.flags & std::OPEN_DIRECT) {
+        result = handle.file_system->read_direct(handle.fs_path, buffer, count, offset, read);
+    } else if (handle.file_system->cacheable()) {
+        result = page_cache::read(*handle.file_system, handle.fs_path, buffer, count, offset, read);
+    } else {
+        result = handle.file_system->read(handle.fs_path, buffer, count, offset, read);
+    }
 
     if (result) {
         return std::make_unexpected<size_t>(result);
@@ -402,17 +521,14 @@ std::expected<size_t> vfs::read(fd_t fd, char* buffer, size_t count, size_t offs
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
+    auto& handle = get_open_file(fd);
 
-    if (base_path.is_root()) {
+    if (handle.file_path.is_root()) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_PATH);
     }
 
-    auto& fs     = get_fs(base_path);
-    auto fs_path = get_fs_path(base_path, fs);
-
     size_t read = 0;
-    auto result = fs.file_system->read(fs_path, buffer, count, offset, read, ms);
+    auto result = handle.file_system->read(handle.fs_path, buffer, count, offset, read, ms);
 
     if (result) {
         return std::make_unexpected<size_t>(result);
@@ -426,7 +542,13 @@ std::expected<size_t> vfs::direct_read(const path& base_path, char* buffer, size
     auto fs_path = get_fs_path(base_path, fs);
 
     size_t read = 0;
-    auto result = fs.file_system->read(fs_path, buffer, count, offset, read);
+    size_t result;
+
+    if (fs.file_system->cacheable()) {
+        result = page_cache::read(*fs.file_system, fs_path, buffer, count, offset, read);
+    } else {
+        result = fs.file_system->read(fs_path, buffer, count, offset, read);
+    }
 
     if (result) {
         return std::make_unexpected<size_t>(result);
@@ -440,17 +562,28 @@ std::expected<size_t> vfs::write(fd_t fd, const char* buffer, size_t count, size
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
+    return vfs::write(get_open_file(fd), buffer, count, offset);
+}
+
+std::expected<size_t> vfs::write(open_file& handle, const char* buffer, size_t count, size_t offset) {
+    resolve(handle);
 
-    if (base_path.is_root()) {
+    if (handle.file_path.is_root()) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_PATH);
     }
 
-    auto& fs     = get_fs(base_path);
-    auto fs_path = get_fs_path(base_path, fs);
-
     size_t written = 0;
-    auto result    = fs.file_system->write(fs_path, buffer, count, offset, written);
+    size_t result;
+
+    if (handle.flags & std::OPEN_DIRECT) {
+        result = handle.file_system->write_direct(handle.fs_path, buffer, count, offset, written);
+    } else {
+        result = handle.file_system->write(handle.fs_path, buffer, count, offset, written);
+    }
+
+    if (handle.file_system->cacheable()) {
+        page_cache::write(*handle.file_system, handle.fs_path, buffer, written, offset);
+    }
 
     if (result) {
         return std::make_unexpected<size_t>(result);
@@ -464,17 +597,18 @@ std::expected<size_t> vfs::clear(fd_t fd, size_t count, size_t offset) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
+    auto& handle = get_open_file(fd);
 
-    if (base_path.is_root()) {
+    if (handle.file_path.is_root()) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_PATH);
     }
 
-    auto& fs     = get_fs(base_path);
-    auto fs_path = get_fs_path(base_path, fs);
-
     size_t written = 0;
-    auto result    = fs.file_system->clear(fs_path, count, offset, written);
+    auto result    = handle.file_system->clear(handle.fs_path, count, offset, written);
+
+    if (handle.file_system->cacheable()) {
+        page_cache::write(*handle.file_system, handle.fs_path, nullptr, written, offset);
+    }
 
     if (result) {
         return std::make_unexpected<size_t>(result);
@@ -490,6 +624,10 @@ std::expected<size_t> vfs::direct_write(const path& base_path, const char* buffe
     size_t written = 0;
     auto result    = fs.file_system->write(fs_path, buffer, count, offset, written);
 
+    if (fs.file_system->cacheable()) {
+        page_cache::write(*fs.file_system, fs_path, buffer, written, offset);
+    }
+
     if (result) {
         return std::make_unexpected<size_t>(result);
     } else {
@@ -502,16 +640,36 @@ std::expected<void> vfs::truncate(fd_t fd, size_t size) {
         return std::make_unexpected<void>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
+    auto& handle = get_open_file(fd);
 
-    if (base_path.is_root()) {
+    if (handle.file_path.is_root()) {
         return std::make_unexpected<void>(std::ERROR_INVALID_FILE_PATH);
     }
 
-    auto& fs     = get_fs(base_path);
-    auto fs_path = get_fs_path(base_path, fs);
+    auto result = handle.file_system->truncate(handle.fs_path, size);
 
-    auto result = fs.file_system->truncate(fs_path, size);
+    if (handle.file_system->cacheable()) {
+        if (result) {
+            page_cache::invalidate(*handle.file_system, handle.fs_path);
+        } else {
+            page_cache::truncate(*handle.file_system, handle.fs_path, size);
+        }
+    }
+    return std::make_expected_zero(result);
+}
+
+std::expected<void> vfs::fallocate(fd_t fd, size_t size) {
+    if (!scheduler::has_handle(fd)) {
+        return std::make_unexpected<void>(std::ERROR_INVALID_FILE_DESCRIPTOR);
+    }
+
+    auto& handle = get_open_file(fd);
+
+    if (handle.file_path.is_root()) {
+        return std::make_unexpected<void>(std::ERROR_INVALID_FILE_PATH);
+    }
+
+    auto result = handle.file_system->fallocate(handle.fs_path, size);
     return std::make_expected_zero(result);
 }
 
@@ -519,17 +677,30 @@ std::expected<size_t> vfs::direct_read(const path& base_path, std::string& conte
     auto& fs     = get_fs(base_path);
     auto fs_path = get_fs_path(base_path, fs);
 
-    vfs::file f;
-    auto result = fs.file_system->get_file(fs_path, f);
+    size_t size = 0;
+    size_t result;
 
-    if (result > 0) {
-        return -result;
+    // The page cache may know the size without asking the file system
+    if (!fs.file_system->cacheable() || !page_cache::size(*fs.file_system, fs_path, size)) {
+        vfs::file f;
+        result = fs.file_system->get_file(fs_path, f);
+
+        if (result > 0) {
+            return -result;
+        }
+
+        size = f.size;
     }
 
-    content.reserve(f.size + 1);
+    content.reserve(size + 1);
 
     size_t read = 0;
-    result      = fs.file_system->read(fs_path, content.c_str(), f.size, 0, read);
+
+    if (fs.file_system->cacheable()) {
+        result = page_cache::read(*fs.file_system, fs_path, content.c_str(), size, 0, read);
+    } else {
+        result = fs.file_system->read(fs_path, content.c_str(), size, 0, read);
+    }
 
     if (result > 0) {
         return -result;
@@ -550,12 +721,10 @@ std::expected<size_t> vfs::entries(fd_t fd, char* buffer, size_t size) {
         return std::make_unexpected<size_t>(std::ERROR_INVALID_FILE_DESCRIPTOR);
     }
 
-    auto& base_path = scheduler::get_handle(fd);
-    auto& fs        = get_fs(base_path);
-    auto fs_path    = get_fs_path(base_path, fs);
+    auto& handle = get_open_file(fd);
 
     std::vector<vfs::file> files;
-    auto result = fs.file_system->ls(fs_path, files);
+    auto result = handle.file_system->ls(handle.fs_path, files);
 
     if (result > 0) {
         return -result;
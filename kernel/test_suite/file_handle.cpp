@@ -0,0 +1,92 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <cstdio>
+#include <cstring>
+
+#include <vector.hpp>
+
+#include "file_handle.hpp"
+
+#include "test.hpp"
+
+namespace {
+
+void test_open(){
+    scheduler::file_handle handle(path("/sys/uptime"), 3);
+
+    CHECK_DIRECT(handle.file.get());
+    CHECK_DIRECT(handle.file->file_path == path("/sys/uptime"));
+    CHECK_EQUALS_DIRECT(handle.file->flags, 3);
+    CHECK_DIRECT(!handle.file->file_system);
+    CHECK_EQUALS_DIRECT(handle.file.use_count(), 1);
+}
+
+void test_closed(){
+    scheduler::file_handle handle;
+
+    CHECK_DIRECT(!handle.file.get());
+}
+
+void test_copy(){
+    scheduler::file_handle a(path("/sys/uptime"));
+    scheduler::file_handle b(a);
+
+    CHECK_DIRECT(a.file.get() == b.file.get());
+    CHECK_EQUALS_DIRECT(a.file.use_count(), 2);
+
+    // The resolution made through one descriptor is seen through the other
+    a.file->fs_path = path("/uptime");
+
+    CHECK_DIRECT(b.file->fs_path == path("/uptime"));
+}
+
+void test_close_copy(){
+    scheduler::file_handle a(path("/sys/uptime"), 1);
+    scheduler::file_handle b(a);
+
+    a.file = nullptr;
+
+    CHECK_DIRECT(!a.file.get());
+    CHECK_DIRECT(b.file.get());
+    CHECK_DIRECT(b.file->file_path == path("/sys/uptime"));
+    CHECK_EQUALS_DIRECT(b.file->flags, 1);
+    CHECK_EQUALS_DIRECT(b.file.use_count(), 1);
+}
+
+void test_handles(){
+    std::vector<scheduler::file_handle> parent;
+
+    parent.emplace_back(path("/dev/tty0"));
+    parent.emplace_back(path("/dev/tty0"));
+
+    // The handles of a child are copied from the ones of its parent
+    std::vector<scheduler::file_handle> child;
+
+    child.emplace_back(parent[0]);
+    child.emplace_back(parent[1]);
+
+    CHECK_DIRECT(child[0].file.get() == parent[0].file.get());
+    CHECK_DIRECT(child[1].file.get() == parent[1].file.get());
+    CHECK_DIRECT(child[0].file.get() != child[1].file.get());
+    CHECK_EQUALS_DIRECT(parent[0].file.use_count(), 2);
+
+    parent.clear();
+
+    CHECK_EQUALS_DIRECT(child[0].file.use_count(), 1);
+    CHECK_DIRECT(child[0].file->file_path == path("/dev/tty0"));
+}
+
+} //end of anonymous namespace
+
+void file_handle_tests(){
+    test_open();
+    test_closed();
+    test_copy();
+    test_close_copy();
+    test_handles();
+}
@@ -11,9 +11,11 @@
 #include "test.hpp"
 
 void path_tests();
+void file_handle_tests();
 
 int main(){
     path_tests();
+    file_handle_tests();
 
     printf("All tests finished\n");
 
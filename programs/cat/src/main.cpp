@@ -27,22 +27,25 @@ int main(int argc, char* argv[]){
             } else {
                 auto size = info->size;
 
-                auto buffer = new char[size];
+                if(!size){
+                    tlib::print_line();
+                } else {
+                    // The pages of the file are read as they are printed
+                    auto content_result = tlib::mmap(*fd, 0, size);
 
-                auto content_result = tlib::read(*fd, buffer, size);
+                    if(content_result.valid()){
+                        auto buffer = static_cast<const char*>(*content_result);
 
-                if(content_result.valid()){
-                    if(*content_result != size){
-                        //TODO Read more
-                    } else {
                         for(size_t i = 0; i < size; ++i){
                             tlib::print(buffer[i]);
                         }
 
                         tlib::print_line();
+
+                        tlib::munmap(*content_result);
+                    } else {
+                        tlib::printf("cat: error: %s\n", std::error_message(content_result.error()));
                     }
-                } else {
-                    tlib::printf("cat: error: %s\n", std::error_message(content_result.error()));
                 }
             }
         } else {
@@ -0,0 +1,168 @@
+//=======================================================================
+// Copyright Baptiste Wicht 2013-2018.
+// Distributed under the terms of the MIT License.
+// (See accompanying file LICENSE or copy at
+//  http://www.opensource.org/licenses/MIT)
+//=======================================================================
+
+#include <vector.hpp>
+
+#include <tlib/file.hpp>
+#include <tlib/system.hpp>
+#include <tlib/errors.hpp>
+#include <tlib/print.hpp>
+
+namespace {
+
+struct device_stats {
+    std::string name;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_sectors;
+    uint64_t write_sectors;
+    uint64_t merged;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t service_time; // ms
+    uint64_t in_flight;
+};
+
+uint64_t read_value(const std::string& path){
+    tlib::file f(path);
+
+    if(!f){
+        return 0;
+    }
+
+    return atoui(f.read_file());
+}
+
+void read_stats(std::vector<device_stats>& devices){
+    tlib::file dir("/sys/block/");
+
+    if(!dir){
+        return;
+    }
+
+    for(auto entry_name : dir.entries()){
+        std::string name(entry_name);
+
+        // The buffer cache publishes its own values
+        if(name == "cache"){
+            continue;
+        }
+
+        std::string base_path = "/sys/block/" + name;
+
+        device_stats stats;
+        stats.name          = name;
+        stats.reads         = read_value(base_path + "/reads");
+        stats.writes        = read_value(base_path + "/writes");
+        stats.read_sectors  = read_value(base_path + "/read_sectors");
+        stats.write_sectors = read_value(base_path + "/write_sectors");
+        stats.merged        = read_value(base_path + "/merged");
+        stats.hits          = read_value(base_path + "/hits");
+        stats.misses        = read_value(base_path + "/misses");
+        stats.service_time  = read_value(base_path + "/service_time");
+        stats.in_flight     = read_value(base_path + "/in_flight");
+
+        devices.push_back(stats);
+    }
+}
+
+uint64_t hit_ratio(uint64_t hits, uint64_t misses){
+    return hits + misses ? (100 * hits) / (hits + misses) : 0;
+}
+
+// Print the counters accumulated since boot
+void print_totals(const std::vector<device_stats>& devices){
+    tlib::printf("%8s %10s %10s %10s %10s %8s %5s %10s %6s\n", "Device", "reads", "writes", "kB_read", "kB_wrtn", "merged", "hit%", "busy_ms", "queue");
+
+    for(auto& d : devices){
+        tlib::printf("%8s %10u %10u %10u %10u %8u %5u %10u %6u\n", d.name.c_str(), d.reads, d.writes, d.read_sectors / 2, d.write_sectors / 2,
+                     d.merged, hit_ratio(d.hits, d.misses), d.service_time, d.in_flight);
+    }
+}
+
+// Print the rates between two samples
+void print_rates(const std::vector<device_stats>& before, const std::vector<device_stats>& after, uint64_t interval){
+    tlib::printf("%8s %8s %8s %8s %8s %8s %5s %8s %5s %6s\n", "Device", "r/s", "w/s", "rkB/s", "wkB/s", "merge/s", "hit%", "await", "util%", "queue");
+
+    for(auto& a : after){
+        const device_stats* b = nullptr;
+
+        for(auto& candidate : before){
+            if(candidate.name == a.name){
+                b = &candidate;
+                break;
+            }
+        }
+
+        if(!b){
+            continue;
+        }
+
+        auto requests = (a.reads - b->reads) + (a.writes - b->writes);
+        auto busy     = a.service_time - b->service_time;
+
+        // The average time to serve a request and the fraction of time the device was busy
+        auto await = requests ? busy / requests : 0;
+        auto util  = std::min(uint64_t(100), (100 * busy) / (interval * 1000));
+
+        tlib::printf("%8s %8u %8u %8u %8u %8u %5u %8u %5u %6u\n", a.name.c_str(),
+                     (a.reads - b->reads) / interval,
+                     (a.writes - b->writes) / interval,
+                     (a.read_sectors - b->read_sectors) / 2 / interval,
+                     (a.write_sectors - b->write_sectors) / 2 / interval,
+                     (a.merged - b->merged) / interval,
+                     hit_ratio(a.hits - b->hits, a.misses - b->misses),
+                     await, util, a.in_flight);
+    }
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char* argv[]){
+    if(argc > 3){
+        tlib::print_line("Usage: iostat [interval [count]]");
+        return 1;
+    }
+
+    std::vector<device_stats> before;
+    read_stats(before);
+
+    if(before.empty()){
+        tlib::print_line("iostat: No block device");
+        return 1;
+    }
+
+    if(argc == 1){
+        print_totals(before);
+        return 0;
+    }
+
+    auto interval = std::parse(argv[1]);
+    auto count    = argc == 3 ? std::parse(argv[2]) : 0;
+
+    if(!interval){
+        tlib::print_line("iostat: The interval must be at least one second");
+        return 1;
+    }
+
+    for(size_t i = 0; !count || i < count; ++i){
+        tlib::sleep_ms(interval * 1000);
+
+        std::vector<device_stats> after;
+        read_stats(after);
+
+        if(i){
+            tlib::printf("\n");
+        }
+
+        print_rates(before, after, interval);
+
+        std::swap(before, after);
+    }
+
+    return 0;
+}
@@ -29,12 +29,16 @@ std::expected<size_t> read(size_t fd, char* buffer, size_t max, size_t offset, s
 std::expected<size_t> write(size_t fd, const char* buffer, size_t max, size_t offset = 0);
 std::expected<size_t> clear(size_t fd, size_t max, size_t offset = 0);
 std::expected<size_t> truncate(size_t fd, size_t size);
+std::expected<size_t> fallocate(size_t fd, size_t size);
+std::expected<void*> mmap(size_t fd, size_t offset, size_t size, size_t prot = 0);
+std::expected<void> munmap(void* address);
 std::expected<size_t> entries(size_t fd, char* buffer, size_t max);
 void close(size_t fd);
 std::expected<stat_info> stat(size_t fd);
 std::expected<statfs_info> statfs(const char* file);
 std::expected<size_t> mounts(char* buffer, size_t max);
 std::expected<void> mount(size_t type, size_t dev_fd, size_t mp_fd);
+std::expected<void> sync();
 
 std::string current_working_directory();
 void set_current_working_directory(const std::string& directory);
@@ -13,6 +13,9 @@
 namespace std {
 
 constexpr const size_t OPEN_CREATE = 0x1;
+constexpr const size_t OPEN_DIRECT = 0x2; ///< Transfer the data directly between the device and the buffer, bypassing the cache
+
+constexpr const size_t MMAP_WRITE = 0x1; ///< The mapping can be modified, the modified pages are written back to the file
 
 } // end of namespace
 
@@ -147,6 +147,48 @@ std::expected<size_t> tlib::truncate(size_t fd, size_t size){
     }
 }
 
+std::expected<size_t> tlib::fallocate(size_t fd, size_t size){
+    int64_t code;
+    asm volatile("mov rax, 0x317; mov rbx, %[fd]; mov rcx, %[size]; int 50; mov %[code], rax"
+        : [code] "=m" (code)
+        : [fd] "g" (fd), [size] "g" (size)
+        : "rax", "rbx", "rcx");
+
+    if(code < 0){
+        return std::make_expected_from_error<size_t, size_t>(-code);
+    } else {
+        return std::make_expected<size_t>(code);
+    }
+}
+
+std::expected<void*> tlib::mmap(size_t fd, size_t offset, size_t size, size_t prot){
+    int64_t code;
+    asm volatile("mov rax, 0xA; mov rbx, %[fd]; mov rcx, %[offset]; mov rdx, %[size]; mov rsi, %[prot]; int 50; mov %[code], rax"
+        : [code] "=m" (code)
+        : [fd] "g" (fd), [offset] "g" (offset), [size] "g" (size), [prot] "g" (prot)
+        : "rax", "rbx", "rcx", "rdx", "rsi");
+
+    if(code < 0){
+        return std::make_expected_from_error<void*, size_t>(-code);
+    } else {
+        return std::make_expected<void*>(reinterpret_cast<void*>(code));
+    }
+}
+
+std::expected<void> tlib::munmap(void* address){
+    int64_t code;
+    asm volatile("mov rax, 0xB; mov rbx, %[address]; int 50; mov %[code], rax"
+        : [code] "=m" (code)
+        : [address] "g" (reinterpret_cast<size_t>(address))
+        : "rax", "rbx");
+
+    if(code < 0){
+        return std::make_expected_from_error<void, size_t>(-code);
+    } else {
+        return std::make_expected();
+    }
+}
+
 std::expected<size_t> tlib::entries(size_t fd, char* buffer, size_t max){
     int64_t code;
     asm volatile("mov rax, 0x308; mov rbx, %[fd]; mov rcx, %[buffer]; mov rdx, %[max]; int 50; mov %[code], rax"
@@ -189,6 +231,20 @@ std::expected<void> tlib::mount(size_t type, size_t dev_fd, size_t mp_fd){
     }
 }
 
+std::expected<void> tlib::sync(){
+    int64_t code;
+    asm volatile("mov rax, 0x316; int 50; mov %[code], rax"
+        : [code] "=m" (code)
+        : //No inputs
+        : "rax");
+
+    if(code < 0){
+        return std::make_expected_from_error<void, size_t>(-code);
+    } else {
+        return std::make_expected();
+    }
+}
+
 std::string tlib::current_working_directory(){
     char buffer[128];
     buffer[0] = '\0';
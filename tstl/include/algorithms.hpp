@@ -297,6 +297,65 @@ Iterator remove_if(Iterator first, Iterator last, Pred pred) {
     return first;
 }
 
+/*!
+ * \brief Sift down the element at the given position of a binary max heap
+ */
+template<typename Iterator, typename Compare>
+void sift_down(Iterator first, size_t root, size_t size, Compare comp){
+    while(2 * root + 1 < size){
+        auto child = 2 * root + 1;
+
+        if(child + 1 < size && comp(first[child], first[child + 1])){
+            ++child;
+        }
+
+        if(!comp(first[root], first[child])){
+            return;
+        }
+
+        std::swap(first[root], first[child]);
+        root = child;
+    }
+}
+
+/*!
+ * \brief Sort the range [first, last) with the given comparator.
+ *
+ * This is a heap sort: O(n log n) without recursion nor allocation. The sort
+ * is not stable.
+ *
+ * \param first The beginning of the range
+ * \param last The end of the range
+ * \param comp The strict weak ordering comparator
+ */
+template<typename Iterator, typename Compare>
+void sort(Iterator first, Iterator last, Compare comp){
+    size_t size = last - first;
+
+    if(size < 2){
+        return;
+    }
+
+    for(size_t i = size / 2; i > 0; --i){
+        sift_down(first, i - 1, size, comp);
+    }
+
+    for(size_t end = size - 1; end > 0; --end){
+        std::swap(first[0], first[end]);
+        sift_down(first, 0, end, comp);
+    }
+}
+
+/*!
+ * \brief Sort the range [first, last) in ascending order
+ * \param first The beginning of the range
+ * \param last The end of the range
+ */
+template<typename Iterator>
+void sort(Iterator first, Iterator last){
+    std::sort(first, last, [](const decltype(*first)& a, const decltype(*first)& b){ return a < b; });
+}
+
 template<typename T>
 constexpr const T& min(const T& a, const T& b){
     return a <= b ? a : b;
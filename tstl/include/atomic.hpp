@@ -71,6 +71,16 @@ struct atomic<uint64_t> {
         return new_value;
     }
 
+    value_type operator--(){
+        auto new_value = __atomic_sub_fetch(&value, 1, __ATOMIC_RELEASE);
+        return new_value;
+    }
+
+    value_type operator+=(value_type add){
+        auto new_value = __atomic_add_fetch(&value, add, __ATOMIC_RELEASE);
+        return new_value;
+    }
+
 private:
     volatile uint64_t value;
 };
@@ -130,6 +130,8 @@ struct shared_ptr {
         this->ptr = ptr;
 
         control_block = new control_block_impl<U, default_delete<U>>(ptr);
+
+        return *this;
     }
 
     /*!
@@ -140,6 +142,8 @@ struct shared_ptr {
 
         this->ptr = nullptr;
         this->control_block = nullptr;
+
+        return *this;
     }
 
     /*!
@@ -178,6 +182,13 @@ struct shared_ptr {
         return get();
     }
 
+    /*!
+     * \brief Returns the number of shared_ptr managing the object, 0 if there is none
+     */
+    size_t use_count() const {
+        return control_block ? control_block->counter : 0;
+    }
+
     struct control_block_t {
         volatile size_t counter;
 
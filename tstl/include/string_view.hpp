@@ -142,7 +142,7 @@ struct basic_string_view {
     }
 
     constexpr basic_string_view substr(size_t pos = 0, size_t n = npos) const {
-        return {data + pos, std::min(n, size() - pos)};
+        return {data() + pos, std::min(n, size() - pos)};
     }
 
     // Compare
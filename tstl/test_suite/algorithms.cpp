@@ -162,6 +162,43 @@ void test_fill_n_3(){
     check(test[3].a == 99, "Invalid fill_n");
 }
 
+void test_sort(){
+    int a[9] = {5, 3, 9, 1, 5, 7, 0, 8, 2};
+
+    std::sort(a, a + 9);
+
+    check(a[0] == 0, "Invalid sort");
+    for(size_t i = 1; i < 9; ++i){
+        check(a[i - 1] <= a[i], "Invalid sort");
+    }
+    check(a[8] == 9, "Invalid sort");
+}
+
+void test_sort_comp(){
+    int a[6] = {4, 1, 6, 2, 6, 3};
+
+    std::sort(a, a + 6, [](int x, int y){ return x > y; });
+
+    check(a[0] == 6, "Invalid sort");
+    for(size_t i = 1; i < 6; ++i){
+        check(a[i - 1] >= a[i], "Invalid sort");
+    }
+    check(a[5] == 1, "Invalid sort");
+}
+
+void test_sort_small(){
+    int a[2] = {2, 1};
+
+    std::sort(a, a);
+    check(a[0] == 2, "Invalid sort");
+
+    std::sort(a, a + 1);
+    check(a[0] == 2, "Invalid sort");
+
+    std::sort(a, a + 2);
+    check(a[0] == 1 && a[1] == 2, "Invalid sort");
+}
+
 } //end of anonymous namespace
 
 void algorithms_tests(){
@@ -173,4 +210,7 @@ void algorithms_tests(){
     test_fill_n_3();
     test_clear();
     test_clear_n();
+    test_sort();
+    test_sort_comp();
+    test_sort_small();
 }
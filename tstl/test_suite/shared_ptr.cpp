@@ -9,6 +9,7 @@
 #include <cstring>
 
 #include <shared_ptr.hpp>
+#include <vector.hpp>
 
 #include "test.hpp"
 
@@ -76,6 +77,121 @@ void test_make_shared() {
     check(counter == 1, "make_shared: Invalid destructors");
 }
 
+void test_use_count() {
+    std::shared_ptr<int> a;
+
+    check_equals(a.use_count(), 0, "use_count: Invalid empty count");
+
+    a = std::make_shared<int>(9);
+
+    check_equals(a.use_count(), 1, "use_count: Invalid count");
+
+    {
+        auto b = a;
+
+        check_equals(a.use_count(), 2, "use_count: Invalid copy count");
+        check_equals(b.use_count(), 2, "use_count: Invalid copy count");
+    }
+
+    check_equals(a.use_count(), 1, "use_count: Invalid count after destruction");
+}
+
+void test_copy_assign() {
+    int first = 0;
+    int second = 0;
+
+    {
+        std::shared_ptr<kiss> a(new kiss(&first));
+        std::shared_ptr<kiss> b(new kiss(&second));
+
+        b = a;
+
+        check_equals(second, 1, "copy_assign: The previous object was not destroyed");
+        check_equals(first, 0, "copy_assign: The object was destroyed");
+        check(a.get() == b.get(), "copy_assign: Invalid pointer");
+        check_equals(a.use_count(), 2, "copy_assign: Invalid count");
+    }
+
+    check_equals(first, 1, "copy_assign: Invalid destructors");
+    check_equals(second, 1, "copy_assign: Invalid destructors");
+}
+
+void test_move_assign() {
+    int first = 0;
+    int second = 0;
+
+    {
+        std::shared_ptr<kiss> a(new kiss(&first));
+        std::shared_ptr<kiss> b(new kiss(&second));
+
+        auto* raw = a.get();
+
+        b = std::move(a);
+
+        check_equals(second, 1, "move_assign: The previous object was not destroyed");
+        check_equals(first, 0, "move_assign: The object was destroyed");
+        check(!a.get(), "move_assign: The source still points to the object");
+        check(b.get() == raw, "move_assign: Invalid pointer");
+        check_equals(b.use_count(), 1, "move_assign: Invalid count");
+    }
+
+    check_equals(first, 1, "move_assign: Invalid destructors");
+}
+
+void test_self_assign() {
+    int counter = 0;
+
+    {
+        std::shared_ptr<kiss> a(new kiss(&counter));
+
+        // Assign through references to avoid self-assignment warnings
+        auto& copy = a;
+        a = copy;
+
+        check_equals(counter, 0, "self_assign: The object was destroyed by a copy");
+        check_equals(a.use_count(), 1, "self_assign: Invalid count after a copy");
+
+        auto& moved = a;
+        a = std::move(moved);
+
+        check_equals(counter, 0, "self_assign: The object was destroyed by a move");
+        check(a.get(), "self_assign: The pointer was reset by a move");
+        check_equals(a.use_count(), 1, "self_assign: Invalid count after a move");
+    }
+
+    check_equals(counter, 1, "self_assign: Invalid destructors");
+}
+
+// Duplicated handles share the object, like file descriptors after a dup
+void test_duplicated_handles() {
+    int counter = 0;
+
+    {
+        std::vector<std::shared_ptr<kiss>> handles;
+
+        {
+            auto handle = std::make_shared<kiss>(&counter);
+
+            handles.push_back(handle);
+            handles.push_back(handle);
+        }
+
+        check_equals(handles[0].use_count(), 2, "handles: Invalid count after the duplication");
+
+        // Close the first handle
+        handles[0] = nullptr;
+
+        check_equals(counter, 0, "handles: The object was destroyed with a handle still open");
+        check_equals(handles[1].use_count(), 1, "handles: Invalid count after a close");
+
+        handles[1] = nullptr;
+
+        check_equals(counter, 1, "handles: The object was not destroyed with the last handle");
+    }
+
+    check_equals(counter, 1, "handles: Invalid destructors");
+}
+
 } //end of anonymous namespace
 
 void shared_ptr_tests(){
@@ -83,4 +199,9 @@ void shared_ptr_tests(){
     test_struct();
     test_destructor();
     test_make_shared();
+    test_use_count();
+    test_copy_assign();
+    test_move_assign();
+    test_self_assign();
+    test_duplicated_handles();
 }
@@ -58,6 +58,23 @@ void test_suffix(){
     CHECK(*(sv.end()-1) == 'f', "invalid end()");
 }
 
+void test_substr(){
+    std::string s("/dev/tty0");
+    auto sv = static_cast<std::string_view>(s);
+
+    auto sub = sv.substr(4);
+
+    CHECK(sub.size() == 5, "Invalid size");
+    CHECK(sub[0] == '/', "invalid operator[]");
+    CHECK(sub[4] == '0', "invalid operator[]");
+
+    auto middle = sv.substr(1, 3);
+
+    CHECK(middle.size() == 3, "Invalid size");
+    CHECK(middle[0] == 'd', "invalid operator[]");
+    CHECK(middle[2] == 'v', "invalid operator[]");
+}
+
 void test_empty(){
     std::string_view s;
 
@@ -152,6 +169,7 @@ void test_mixed_compare(){
 void string_view_tests(){
     test_small();
     test_suffix();
+    test_substr();
     test_empty();
     test_compare();
     test_mixed_compare();